@@ -10,21 +10,59 @@ using namespace base;
 Assets::Assets(string_view _path) {
 	
 	m_path = string(_path);
-	if (auto result = sqlite3_open_v2(m_path.c_str(), &m_db, SQLITE_OPEN_READONLY, nullptr); result != SQLITE_OK) {
+	auto db = static_cast<sqlite3*>(nullptr);
+	if (auto result = sqlite3_open_v2(m_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr); result != SQLITE_OK) {
 		
-		sqlite3_close(m_db);
+		sqlite3_close(db);
 		throw runtime_error_fmt("Failed to open database {}: {}", m_path, sqlite3_errstr(result));
 		
 	}
 	
+	// Closed once the last reader is gone
+	m_db = std::shared_ptr<sqlite3>(db, [path = m_path](sqlite3* _db) {
+		
+		if (auto result = sqlite3_close(_db); result != SQLITE_OK)
+			L_WARN("Failed to close database {}: {}", path, sqlite3_errstr(result));
+		
+	});
+	
 	L_INFO("Opened assets file {}", m_path);
 	
 }
 
-Assets::~Assets() {
+Assets::LazyBlob::LazyBlob(std::shared_ptr<sqlite3> _db, string_view _path, sqlite3_int64 _rowid, usize _size):
+	m_db(std::move(_db)),
+	m_path(_path),
+	m_rowid(_rowid),
+	m_size(_size),
+	m_blob(nullptr) {}
+
+Assets::LazyBlob::LazyBlob(LazyBlob const& _other):
+	LazyBlob(_other.m_db, _other.m_path, _other.m_rowid, _other.m_size) {}
+
+Assets::LazyBlob::~LazyBlob() {
+	
+	if (m_blob)
+		sqlite3_blob_close(m_blob);
+	
+}
+
+void Assets::LazyBlob::operator()(usize _offset, std::span<char> _dst) {
+	
+	if (_offset + _dst.size() > m_size)
+		throw runtime_error_fmt("Out of bounds read from table {} in database {}", Models_n, m_path);
+	
+	{
+		
+		auto lock = std::lock_guard(m_openLock);
+		if (!m_blob && sqlite3_blob_open(m_db.get(), "main", Models_n, ModelsData_n, m_rowid, 0, &m_blob) != SQLITE_OK)
+			throw runtime_error_fmt("Failed to open row {} of table {} in database {}: {}",
+				m_rowid, Models_n, m_path, sqlite3_errmsg(m_db.get()));
+		
+	}
 	
-	if (auto result = sqlite3_close(m_db); result != SQLITE_OK)
-		L_WARN("Failed to close database {}: {}", m_path, sqlite3_errstr(result));
+	if (auto result = sqlite3_blob_read(m_blob, _dst.data(), int(_dst.size()), int(_offset)); result != SQLITE_OK)
+		throw runtime_error_fmt("Failed to read from database {}: {}", m_path, sqlite3_errstr(result));
 	
 }
 
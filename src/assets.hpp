@@ -1,9 +1,13 @@
 #pragma once
 
+#include <functional>
 #include <concepts>
+#include <memory>
+#include <mutex>
 #include <span>
 #include "sqlite3.h"
 #include "base/containers/string.hpp"
+#include "base/types.hpp"
 
 namespace minote {
 
@@ -11,15 +15,23 @@ using namespace base;
 
 struct Assets {
 	
+	// Reads a range of a BLOB into dst, starting at offset bytes from its start.
+	// Throws on failure. Can be called from any thread, and kept around after
+	// the call that provided it; it keeps the database open, even past
+	// the lifetime of the Assets object. The BLOB itself is only open between
+	// the first read of a copy and that copy's destruction.
+	using BlobReader = std::function<void(usize offset, std::span<char> dst)>;
+	
 	// Open the sqlite database containing game assets. File remains open
-	// until this object is destroyed.
+	// until this object and all of its readers are destroyed.
 	explicit Assets(string_view path);
-	~Assets();
 	
 	// Iterate over all rows in the models table, and call the provided function
-	// on each model's data.
+	// with each model's name and size. Model data is not loaded up front;
+	// the function pulls whatever ranges it needs through the reader, which
+	// streams them from the database with incremental BLOB I/O.
 	template<typename F>
-	requires std::invocable<F, string_view, std::span<char const>>
+	requires std::invocable<F, string_view, usize, BlobReader const&>
 	void loadModels(F func);
 	
 	// Not moveable, not copyable
@@ -29,8 +41,34 @@ struct Assets {
 private:
 	
 	static constexpr auto Models_n = "models";
+	static constexpr auto ModelsData_n = "data"; // BLOB column of the models table
+	
+	// Callable behind a BlobReader, opening its BLOB on the first read. Copies
+	// start out closed, so that a copy made for a single load only holds
+	// the handle until that load is done with it.
+	struct LazyBlob {
+		
+		LazyBlob(std::shared_ptr<sqlite3> db, string_view path, sqlite3_int64 rowid, usize size);
+		~LazyBlob();
+		
+		void operator()(usize offset, std::span<char> dst);
+		
+		LazyBlob(LazyBlob const&);
+		auto operator=(LazyBlob const&) -> LazyBlob& = delete;
+		
+	private:
+		
+		std::shared_ptr<sqlite3> m_db;
+		string m_path;
+		sqlite3_int64 m_rowid;
+		usize m_size;
+		
+		std::mutex m_openLock;
+		sqlite3_blob* m_blob;
+		
+	};
 	
-	sqlite3* m_db = nullptr;
+	std::shared_ptr<sqlite3> m_db;
 	string m_path;
 	
 };
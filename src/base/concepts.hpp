@@ -1,6 +1,7 @@
 #pragma once
 
 #include <type_traits>
+#include <concepts>
 #include <tuple>
 
 namespace minote::base {
@@ -14,6 +15,7 @@ template<typename T>
 concept arithmetic = std::is_arithmetic_v<T>;
 
 using std::integral;
+using std::floating_point;
 
 // Objects that can be safely copied with memcpy.
 template<typename T>
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <concepts>
+#include <utility>
+#include <bit>
+#include "base/containers/vector.hpp"
+#include "base/types.hpp"
+
+namespace minote::base {
+
+// Dynamically sized vector of bits, packed into 64-bit words. Iteration
+// over set bits skips whole words of zeroes.
+struct bitvector {
+	
+	static constexpr auto WordBits = usize(64);
+	
+	// Proxy for a single bit
+	struct reference {
+		
+		u64& word;
+		u64 mask;
+		
+		operator bool() const { return (word & mask) != 0; }
+		
+		auto operator=(bool val) -> reference& {
+			
+			if (val)
+				word |= mask;
+			else
+				word &= ~mask;
+			return *this;
+			
+		}
+		
+		auto operator=(reference const& other) -> reference& { return *this = bool(other); }
+		
+	};
+	
+	[[nodiscard]]
+	auto size() const -> usize { return m_size; }
+	
+	[[nodiscard]]
+	auto empty() const -> bool { return m_size == 0; }
+	
+	[[nodiscard]]
+	auto operator[](usize idx) -> reference { return reference{m_words[idx / WordBits], bitMask(idx)}; }
+	
+	[[nodiscard]]
+	auto operator[](usize idx) const -> bool { return (m_words[idx / WordBits] & bitMask(idx)) != 0; }
+	
+	void push_back(bool val) {
+		
+		if (m_size % WordBits == 0)
+			m_words.push_back(0);
+		m_size += 1;
+		(*this)[m_size - 1] = val;
+		
+	}
+	
+	void pop_back() {
+		
+		m_size -= 1;
+		(*this)[m_size] = false; // Unused bits are kept clear
+		if (m_size % WordBits == 0)
+			m_words.pop_back();
+		
+	}
+	
+	void resize(usize size, bool val = false) {
+		
+		// Fill the unused tail of the last word before appending whole ones
+		if (val && size > m_size && m_size % WordBits != 0)
+			m_words.back() |= ~u64(0) << (m_size % WordBits);
+		
+		m_words.resize((size + WordBits - 1) / WordBits, val? ~u64(0) : u64(0));
+		m_size = size;
+		
+		// Unused bits are kept clear
+		if (m_size % WordBits != 0)
+			m_words.back() &= ~u64(0) >> (WordBits - m_size % WordBits);
+		
+	}
+	
+	void clear() {
+		
+		m_words.clear();
+		m_size = 0;
+		
+	}
+	
+	// Raw storage. Bits past size() are always clear.
+	[[nodiscard]]
+	auto words() const -> pvector<u64> const& { return m_words; }
+	
+	// Number of set bits.
+	[[nodiscard]]
+	auto count() const -> usize {
+		
+		auto result = usize(0);
+		for (auto word: m_words)
+			result += std::popcount(word);
+		return result;
+		
+	}
+	
+	// Number of set bits in [begin, end).
+	[[nodiscard]]
+	auto count(usize begin, usize end) const -> usize {
+		
+		if (begin >= end) return 0;
+		
+		auto result = usize(0);
+		auto firstWord = begin / WordBits;
+		auto lastWord = (end - 1) / WordBits;
+		for (auto w = firstWord; w <= lastWord; w += 1) {
+			
+			auto word = m_words[w];
+			if (w == firstWord)
+				word &= ~u64(0) << (begin % WordBits);
+			if (w == lastWord && end % WordBits != 0)
+				word &= ~u64(0) >> (WordBits - end % WordBits);
+			result += std::popcount(word);
+			
+		}
+		return result;
+		
+	}
+	
+	// Set every bit in [begin, end) to val, a word at a time.
+	void fill(usize begin, usize end, bool val) {
+		
+		if (begin >= end) return;
+		
+		auto firstWord = begin / WordBits;
+		auto lastWord = (end - 1) / WordBits;
+		for (auto w = firstWord; w <= lastWord; w += 1) {
+			
+			auto mask = ~u64(0);
+			if (w == firstWord)
+				mask &= ~u64(0) << (begin % WordBits);
+			if (w == lastWord && end % WordBits != 0)
+				mask &= ~u64(0) >> (WordBits - end % WordBits);
+			if (val)
+				m_words[w] |= mask;
+			else
+				m_words[w] &= ~mask;
+			
+		}
+		
+	}
+	
+	// Call func with the index of every set bit in [begin, end), in order.
+	template<typename F>
+	requires std::invocable<F, usize>
+	void forEachSet(usize begin, usize end, F&& func) const {
+		
+		if (begin >= end) return;
+		
+		auto firstWord = begin / WordBits;
+		auto lastWord = (end - 1) / WordBits;
+		for (auto w = firstWord; w <= lastWord; w += 1) {
+			
+			auto word = m_words[w];
+			if (w == firstWord)
+				word &= ~u64(0) << (begin % WordBits);
+			if (w == lastWord && end % WordBits != 0)
+				word &= ~u64(0) >> (WordBits - end % WordBits);
+			
+			while (word) {
+				
+				auto bit = std::countr_zero(word);
+				func(w * WordBits + bit);
+				word &= word - 1; // Clear lowest set bit
+				
+			}
+			
+		}
+		
+	}
+	
+	template<typename F>
+	requires std::invocable<F, usize>
+	void forEachSet(F&& func) const { forEachSet(0, m_size, std::forward<F>(func)); }
+	
+private:
+	
+	static constexpr auto bitMask(usize idx) -> u64 { return u64(1) << (idx % WordBits); }
+	
+	pvector<u64> m_words;
+	usize m_size = 0;
+	
+};
+
+}
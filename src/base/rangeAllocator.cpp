@@ -0,0 +1,85 @@
+#include "base/rangeAllocator.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace minote::base {
+
+RangeAllocator::RangeAllocator(u32 _capacity):
+	m_capacity(0),
+	m_used(0) {
+	
+	grow(_capacity);
+	
+}
+
+auto RangeAllocator::allocate(u32 _count) -> std::optional<u32> {
+	
+	if (_count == 0) return 0u;
+	
+	auto it = std::find_if(m_free.begin(), m_free.end(), [_count](Range const& _range) {
+		return _range.count >= _count;
+	});
+	if (it == m_free.end()) return std::nullopt;
+	
+	auto offset = it->offset;
+	it->offset += _count;
+	it->count -= _count;
+	if (it->count == 0)
+		m_free.erase(it);
+	m_used += _count;
+	return offset;
+	
+}
+
+void RangeAllocator::free(u32 _offset, u32 _count) {
+	
+	if (_count == 0) return;
+	assert(u64(_offset) + _count <= m_capacity);
+	assert(m_used >= _count);
+	m_used -= _count;
+	
+	// Find the neighbors, and merge with whichever ones touch the range
+	
+	auto next = std::lower_bound(m_free.begin(), m_free.end(), _offset, [](Range const& _range, u32 _value) {
+		return _range.offset < _value;
+	});
+	auto mergePrev = next != m_free.begin() && (next - 1)->offset + (next - 1)->count == _offset;
+	auto mergeNext = next != m_free.end() && _offset + _count == next->offset;
+	
+	if (mergePrev && mergeNext) {
+		
+		(next - 1)->count += _count + next->count;
+		m_free.erase(next);
+		
+	} else if (mergePrev) {
+		
+		(next - 1)->count += _count;
+		
+	} else if (mergeNext) {
+		
+		next->offset = _offset;
+		next->count += _count;
+		
+	} else {
+		
+		m_free.insert(next, Range{_offset, _count});
+		
+	}
+	
+}
+
+void RangeAllocator::grow(u32 _capacity) {
+	
+	if (_capacity <= m_capacity) return;
+	
+	auto added = _capacity - m_capacity;
+	if (!m_free.empty() && m_free.back().offset + m_free.back().count == m_capacity)
+		m_free.back().count += added;
+	else
+		m_free.push_back(Range{m_capacity, added});
+	m_capacity = _capacity;
+	
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <optional>
+#include "base/containers/vector.hpp"
+#include "base/types.hpp"
+
+namespace minote::base {
+
+// Sub-allocator of contiguous ranges within [0, capacity). Free ranges are
+// kept sorted by offset and merged with their neighbors, and allocations take
+// the first free range that fits. Only offsets are tracked; the storage
+// itself is up to the user.
+struct RangeAllocator {
+	
+	// Create an allocator with the given number of elements, all free.
+	explicit RangeAllocator(u32 capacity = 0);
+	
+	// Allocate count contiguous elements and return the offset of the first
+	// one, or nothing if no free range is large enough. Empty ranges always
+	// succeed, and don't need to be freed.
+	auto allocate(u32 count) -> std::optional<u32>;
+	
+	// Return a range that was previously allocated.
+	void free(u32 offset, u32 count);
+	
+	// Extend the capacity. The new elements are free.
+	void grow(u32 capacity);
+	
+	[[nodiscard]]
+	auto capacity() const -> u32 { return m_capacity; }
+	
+	// Number of elements currently allocated.
+	[[nodiscard]]
+	auto used() const -> u32 { return m_used; }
+	
+private:
+	
+	struct Range {
+		u32 offset;
+		u32 count;
+	};
+	
+	pvector<Range> m_free; // Sorted by offset, never adjacent
+	u32 m_capacity;
+	u32 m_used;
+	
+};
+
+}
@@ -0,0 +1,137 @@
+#include "base/threadPool.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include "base/util.hpp"
+
+namespace minote::base {
+
+// Set while the thread is executing indices of a job
+static thread_local bool t_inJob = false;
+
+ThreadPool::ThreadPool(u32 _workers):
+	m_jobCounter(0),
+	m_quitting(false) {
+	
+	if (_workers == 0)
+		_workers = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+	
+	m_workers.reserve(_workers);
+	while (m_workers.size() < _workers)
+		m_workers.emplace_back([this] { workerLoop(); });
+	
+}
+
+ThreadPool::~ThreadPool() {
+	
+	{
+		
+		auto lock = std::lock_guard(m_jobLock);
+		m_quitting = true;
+		
+	}
+	m_jobReady.notify_all();
+	m_workers.clear(); // Joins the threads
+	
+}
+
+void ThreadPool::parallelFor(usize _count, std::function<void(usize)> const& _func) {
+	
+	if (_count == 0) return;
+	
+	// The submit lock isn't recursive
+	assert(!t_inJob && "parallelFor() can't be called from inside a job");
+	
+	auto submitLock = std::lock_guard(m_submitLock);
+	
+	auto job = std::make_shared<Job>();
+	job->func = &_func;
+	job->count = _count;
+	job->next = 0;
+	job->finished = 0;
+	
+	{
+		
+		auto lock = std::lock_guard(m_jobLock);
+		m_job = job;
+		m_jobCounter += 1;
+		
+	}
+	m_jobReady.notify_all();
+	
+	work(*job);
+	
+	// Wait for workers to finish their last indices
+	
+	{
+		
+		auto lock = std::unique_lock(m_jobLock);
+		m_jobDone.wait(lock, [&job] { return job->finished.load() == job->count; });
+		m_job.reset();
+		
+	}
+	
+	if (job->error)
+		std::rethrow_exception(job->error);
+	
+}
+
+void ThreadPool::workerLoop() {
+	
+	auto lastJob = u64(0);
+	while (true) {
+		
+		auto job = std::shared_ptr<Job>();
+		{
+			
+			auto lock = std::unique_lock(m_jobLock);
+			m_jobReady.wait(lock, [this, lastJob] {
+				return m_quitting || (m_job && m_jobCounter != lastJob);
+			});
+			if (m_quitting) return;
+			
+			job = m_job;
+			lastJob = m_jobCounter;
+			
+		}
+		
+		work(*job);
+		
+	}
+	
+}
+
+void ThreadPool::work(Job& _job) {
+	
+	t_inJob = true;
+	defer { t_inJob = false; };
+	
+	while (true) {
+		
+		auto idx = _job.next.fetch_add(1);
+		if (idx >= _job.count) return;
+		
+		try {
+			
+			(*_job.func)(idx);
+			
+		} catch (...) {
+			
+			auto lock = std::lock_guard(_job.errorLock);
+			if (!_job.error)
+				_job.error = std::current_exception();
+			
+		}
+		
+		if (_job.finished.fetch_add(1) + 1 == _job.count) {
+			
+			auto lock = std::lock_guard(m_jobLock);
+			m_jobDone.notify_all();
+			
+		}
+		
+	}
+	
+}
+
+}
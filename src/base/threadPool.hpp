@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include "base/containers/vector.hpp"
+#include "base/types.hpp"
+
+namespace minote::base {
+
+// Fixed set of worker threads for data-parallel work. Only one job runs at
+// a time; the thread that submits a job participates in its execution.
+struct ThreadPool {
+	
+	// Create a pool with the given number of worker threads. With 0,
+	// one thread per hardware thread is created, minus the caller's.
+	explicit ThreadPool(u32 workers = 0);
+	~ThreadPool();
+	
+	// Call func once for every index in [0, count), spreading the calls across
+	// all threads. Blocks until all calls have finished. If any call throws,
+	// the first exception is rethrown after the job is finished. Must not be
+	// called from inside func, which would deadlock.
+	void parallelFor(usize count, std::function<void(usize)> const& func);
+	
+	// Number of threads participating in a job, including the caller.
+	[[nodiscard]]
+	auto concurrency() const -> u32 { return u32(m_workers.size()) + 1; }
+	
+	// Not copyable, not movable
+	ThreadPool(ThreadPool const&) = delete;
+	auto operator=(ThreadPool const&) -> ThreadPool& = delete;
+	ThreadPool(ThreadPool&&) = delete;
+	auto operator=(ThreadPool&&) -> ThreadPool& = delete;
+	
+private:
+	
+	struct Job {
+		
+		std::function<void(usize)> const* func;
+		usize count;
+		std::atomic<usize> next;
+		std::atomic<usize> finished;
+		
+		std::mutex errorLock;
+		std::exception_ptr error;
+		
+	};
+	
+	ivector<std::jthread> m_workers;
+	
+	std::mutex m_submitLock; // Held for the duration of a job
+	std::mutex m_jobLock;
+	std::condition_variable m_jobReady;
+	std::condition_variable m_jobDone;
+	std::shared_ptr<Job> m_job;
+	u64 m_jobCounter;
+	bool m_quitting;
+	
+	void workerLoop();
+	
+	// Execute indices of the job until there are none left.
+	void work(Job&);
+	
+};
+
+}
@@ -3,6 +3,7 @@
 #include "config.hpp"
 
 #include <exception>
+#include <array>
 #include "backends/imgui_impl_sdl.h"
 #include "imgui.h"
 #include "base/containers/vector.hpp"
@@ -30,17 +31,18 @@ void game(GameParams const& _params) try {
 	
 	// Load assets
 	
-	auto modelList = gfx::ModelList();
+	// Models are only cataloged here, and streamed in once objects use them
 	auto assets = Assets(Assets_p);
-	assets.loadModels([&modelList](auto name, auto data) {
+	assets.loadModels([&engine](auto name, auto size, auto const& read) {
 		
-		modelList.addModel(name, data);
+		// Large, simple shapes make good occluders
+		engine.models().addModel(name, size, read, name == "block");
 		
 	});
 	
 	// Initialize the engine
 	
-	engine.init(std::move(modelList));
+	engine.init();
 	
 	engine.camera() = gfx::Camera{
 		.position = {8.57_m, -16.07_m, 69.20_m},
@@ -63,10 +65,11 @@ void game(GameParams const& _params) try {
 	// Keep track of the spinning cubes so that we can rotate them each frame
 	auto dynamicObjects = ivector<gfx::ObjectID>();
 	defer {
-		for (auto id: dynamicObjects)
-			engine.objects().destroy(id);
+		engine.objects().destroyBatch(std::span(dynamicObjects.data(), dynamicObjects.size()));
 	};
 	
+	auto sceneStart = sys::System::getTime();
+	
 	constexpr auto prescale = vec3{1_m, 1_m, 1_m};
 	constexpr auto Expand = 0u;
 	constexpr auto Spacing = 25_m;
@@ -78,9 +81,8 @@ void game(GameParams const& _params) try {
 		constexpr auto TestSpacing = 80_m;
 		auto offset = vec3{x * 80_m, y * 80_m, 0.0f};
 		
-		auto testscene_id = engine.objects().create();
+		auto testscene_id = engine.objects().create("balls"_id);
 		auto testscene = engine.objects().get(testscene_id);
-		testscene.modelID = "balls"_id;
 		testscene.transform.position = vec3{0_m, 0_m, 64_m} + offset;
 		testscene.transform.scale = prescale;
 		
@@ -93,69 +95,59 @@ void game(GameParams const& _params) try {
 		
 		auto offset = vec3{x, y, 32_m};
 		
-		auto block1_id = engine.objects().create();
+		auto block1_id = engine.objects().create("block"_id);
 		auto block1 = engine.objects().get(block1_id);
-		block1.modelID = "block"_id;
 		block1.color = {0.9f, 0.9f, 1.0f, 1.0f};
 		block1.transform.position = offset;
 		block1.transform.scale = vec3{12.0f, 12.0f, 1.0f} * prescale;
 		
-		auto block2_id = engine.objects().create();
+		auto block2_id = engine.objects().create("block"_id);
 		auto block2 = engine.objects().get(block2_id);
-		block2.modelID = "block"_id;
 		block2.color = {0.9f, 0.1f, 0.1f, 1.0f};
 		block2.transform.position = vec3{-4_m, -4_m, 2_m} + offset;
 		block2.transform.scale = prescale;
 		
-		auto block3_id = engine.objects().create();
+		auto block3_id = engine.objects().create("block"_id);
 		auto block3 = engine.objects().get(block3_id);
-		block3.modelID = "block"_id;
 		block3.color = {0.9f, 0.1f, 0.1f, 1.0f};
 		block3.transform.position = vec3{4_m, -4_m, 2_m} + offset;
 		block3.transform.scale = prescale;
 		
-		auto block4_id = engine.objects().create();
+		auto block4_id = engine.objects().create("block"_id);
 		auto block4 = engine.objects().get(block4_id);
-		block4.modelID = "block"_id;
 		block4.color = {0.9f, 0.1f, 0.1f, 1.0f};
 		block4.transform.position = vec3{-4_m, 4_m, 2_m} + offset;
 		block4.transform.scale = prescale;
 		
-		auto block5_id = engine.objects().create();
+		auto block5_id = engine.objects().create("block"_id);
 		auto block5 = engine.objects().get(block5_id);
-		block5.modelID = "block"_id;
 		block5.color = {0.9f, 0.1f, 0.1f, 1.0f};
 		block5.transform.position = vec3{4_m, 4_m, 2_m} + offset;
 		block5.transform.scale = prescale;
 		
-		auto block6_id = engine.objects().create();
+		auto block6_id = engine.objects().create("block"_id);
 		auto block6 = engine.objects().get(block6_id);
-		block6.modelID = "block"_id;
 		block6.color = {0.1f, 0.1f, 0.9f, 1.0f};
 		block6.transform.position = vec3{7_m, 0_m, 2_m} + offset;
 		block6.transform.scale = prescale;
 		
-		auto block7_id = engine.objects().create();
+		auto block7_id = engine.objects().create("block"_id);
 		auto block7 = engine.objects().get(block7_id);
 		dynamicObjects.emplace_back(block7_id);
-		block7.modelID = "block"_id;
 		block7.color = {0.2f, 0.9f, 0.5f, 1.0f};
 		block7.transform.position = vec3{0_m, 0_m, 2.5_m} + offset;
 		block7.transform.scale = vec3{1.5f, 1.5f, 1.5f} * prescale;
 		
+		auto spheres = engine.objects().createBatch("sphere"_id, 18);
 		for (auto i: iota(0, 9)) {
 			
 			auto offset2 = offset + vec3{f32(i - 4) / 4.0f * 8_m, 0_m, 0_m};
 			
-			auto sphere1_id = engine.objects().create();
-			auto sphere1 = engine.objects().get(sphere1_id);
-			sphere1.modelID = "sphere"_id;
+			auto sphere1 = engine.objects().get(spheres[i * 2]);
 			sphere1.transform.position = vec3{0_m, 8_m, 2_m} + offset2;
 			sphere1.transform.scale = prescale;
 			
-			auto sphere2_id = engine.objects().create();
-			auto sphere2 = engine.objects().get(sphere2_id);
-			sphere2.modelID = "sphere"_id;
+			auto sphere2 = engine.objects().get(spheres[i * 2 + 1]);
 			sphere2.transform.position = vec3{0_m, -8_m, 2_m} + offset2;
 			sphere2.transform.scale = prescale;
 			
@@ -163,8 +155,13 @@ void game(GameParams const& _params) try {
 		
 	}
 	
+	L_DEBUG("Test scene created in {:.3f} ms", ratio<f64>(sys::System::getTime() - sceneStart, 1_ms));
 	L_INFO("Game initialized");
 	
+	// Results of the object pool benchmark, in ms
+	auto batchedTime = 0.0;
+	auto singleTime = 0.0;
+	
 	// Main loop
 	
 	auto nextUpdate = sys::System::getTime();
@@ -263,6 +260,42 @@ void game(GameParams const& _params) try {
 			
 		}
 		
+		// Object pool benchmark. Creates and destroys the same objects in
+		// batches and one by one, spread across two models
+		if (ImGui::Button("Benchmark object pool")) {
+			
+			constexpr auto BenchmarkObjects = 100'000_zu;
+			constexpr auto BenchmarkModels = std::array{"block"_id, "sphere"_id};
+			auto& objects = engine.objects();
+			
+			auto batchedStart = sys::System::getTime();
+			for (auto model: BenchmarkModels) {
+				
+				auto batch = objects.createBatch(model, BenchmarkObjects);
+				objects.destroyBatch(std::span(batch.data(), batch.size()));
+				
+			}
+			batchedTime = ratio<f64>(sys::System::getTime() - batchedStart, 1_ms);
+			
+			auto singleStart = sys::System::getTime();
+			for (auto model: BenchmarkModels) {
+				
+				auto single = ivector<gfx::ObjectID>();
+				single.reserve(BenchmarkObjects);
+				while (single.size() < BenchmarkObjects)
+					single.emplace_back(objects.create(model));
+				for (auto id: single)
+					objects.destroy(id);
+				
+			}
+			singleTime = ratio<f64>(sys::System::getTime() - singleStart, 1_ms);
+			
+			L_DEBUG("Object pool benchmark: {:.3f} ms batched, {:.3f} ms one by one", batchedTime, singleTime);
+			
+		}
+		if (batchedTime > 0.0)
+			ImGui::Text("Object pool: %.3f ms batched, %.3f ms one by one", batchedTime, singleTime);
+		
 		engine.render();
 		
 	}
@@ -17,9 +17,10 @@ void BVH::compile(vuk::PerThreadContext& _ptc) {
 	
 }
 
-void BVH::debugDrawAABBs(Frame& _frame, Texture2D _target, InstanceList _instances) {
+void BVH::debugDrawAABBs(Frame& _frame, Texture2D _target, TriangleList _triangles) {
 	
-	auto aabbs = Buffer<AABB>::make(_frame.permPool, "AABBs",
+	// Meshlet count changes as models are streamed, so the copy is made every frame
+	auto aabbs = Buffer<AABB>::make(_frame.framePool, "AABBs",
 		vuk::BufferUsageFlagBits::eStorageBuffer,
 		_frame.models.cpu_meshletAABBs);
 	aabbs.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
@@ -28,10 +29,11 @@ void BVH::debugDrawAABBs(Frame& _frame, Texture2D _target, InstanceList _instanc
 		.name = nameAppend(_target.name, "bvh/debugAABB"),
 		.resources = {
 			aabbs.resource(vuk::eVertexRead),
-			_instances.instances.resource(vuk::eVertexRead),
-			_instances.transforms.resource(vuk::eVertexRead),
+			_triangles.instances.resource(vuk::eVertexRead),
+			_triangles.instanceCount.resource(vuk::eVertexRead),
+			_triangles.transforms.resource(vuk::eVertexRead),
 			_target.resource(vuk::eColorWrite) },
-		.execute = [_target, _instances, aabbs, &_frame](vuk::CommandBuffer& cmd) {
+		.execute = [_target, _triangles, aabbs, &_frame](vuk::CommandBuffer& cmd) {
 			
 			cmd.set_viewport(0, vuk::Rect2D::framebuffer());
 			cmd.set_scissor(0, vuk::Rect2D::framebuffer());
@@ -42,11 +44,13 @@ void BVH::debugDrawAABBs(Frame& _frame, Texture2D _target, InstanceList _instanc
 			
 			cmd.bind_uniform_buffer(0, 0, _frame.world)
 			   .bind_storage_buffer(0, 1, aabbs)
-			   .bind_storage_buffer(0, 2, _instances.instances)
-			   .bind_storage_buffer(0, 3, _instances.transforms)
+			   .bind_storage_buffer(0, 2, _triangles.instances)
+			   .bind_storage_buffer(0, 3, _triangles.transforms)
+			   .bind_storage_buffer(0, 4, _triangles.instanceCount)
 			   .bind_graphics_pipeline("bvh/debugAABB");
 			
-			cmd.draw(12 * 2, _instances.size(), 0, 0);
+			// The instance count is only known on the GPU; excess instances are discarded
+			cmd.draw(12 * 2, _triangles.instances.length(), 0, 0);
 			
 		}});
 	
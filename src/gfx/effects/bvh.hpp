@@ -13,7 +13,9 @@ struct BVH {
 	
 	static void compile(vuk::PerThreadContext&);
 	
-	static void debugDrawAABBs(Frame&, Texture2D target, InstanceList);
+	// Draw the bounds of every meshlet instance that survived culling,
+	// in both phases.
+	static void debugDrawAABBs(Frame&, Texture2D target, TriangleList);
 	
 };
 
@@ -1,9 +1,13 @@
 #include "gfx/effects/instanceList.hpp"
 
+#include <functional>
+#include <algorithm>
 #include <cassert>
 #include <span>
 #include "base/containers/vector.hpp"
+#include "base/format.hpp"
 #include "base/util.hpp"
+#include "base/log.hpp"
 #include "gfx/samplers.hpp"
 #include "gfx/util.hpp"
 #include "tools/modelSchema.hpp"
@@ -11,114 +15,180 @@
 namespace minote::gfx {
 
 using namespace base;
+using namespace base::literals;
 
-constexpr auto encodeTransform(ObjectPool::Transform _in) -> InstanceList::Transform {
-	
-	auto rw = _in.rotation.w();
-	auto rx = _in.rotation.x();
-	auto ry = _in.rotation.y();
-	auto rz = _in.rotation.z();
-	
-	auto rotationMat = mat3{
-		1.0f - 2.0f * (ry * ry + rz * rz),        2.0f * (rx * ry - rw * rz),        2.0f * (rx * rz + rw * ry),
-		       2.0f * (rx * ry + rw * rz), 1.0f - 2.0f * (rx * rx + rz * rz),        2.0f * (ry * rz - rw * rx),
-		       2.0f * (rx * rz - rw * ry),        2.0f * (ry * rz + rw * rx), 1.0f - 2.0f * (rx * rx + ry * ry)};
-	
-	rotationMat[0] *= _in.scale.x();
-	rotationMat[1] *= _in.scale.y();
-	rotationMat[2] *= _in.scale.z();
-	
-	return to_array({
-		vec4(rotationMat[0], _in.position.x()),
-		vec4(rotationMat[1], _in.position.y()),
-		vec4(rotationMat[2], _in.position.z())});
-	
-}
+// Workgroup size of the culling shaders
+constexpr auto CullGroupSize = 64u;
 
 auto InstanceList::upload(Pool& _pool, Frame& _frame, vuk::Name _name,
-	ObjectPool const& _objects) -> InstanceList {
+	ObjectPool const& _objects, bitvector const& _visible,
+	ObjectBuffer const& _objectBuffer, bool _parallel) -> InstanceList {
 	
 	auto result = InstanceList();
+	result.colors = _objectBuffer.colors;
+	result.transforms = _objectBuffer.transforms;
+	result.prevTransforms = _objectBuffer.prevTransforms;
 	
-	// Precalculate instance count
+	// Objects are processed in fixed-size chunks. Each chunk writes
+	// into its own range of the object list, so the result is the same
+	// regardless of how the chunks are scheduled
 	
-	auto modelCount = 0u;
-	auto instanceCount = 0u;
-	for (auto idx: iota(ObjectID(0), _objects.size())) {
-		
-		auto& metadata = _objects.metadata[idx];
-		if (!metadata.exists || !metadata.visible)
-			continue;
+	struct Chunk {
+		u32 objectOffset;
+		u32 objectCount;
+		u32 groupCount;
+		u32 instanceCount;
+		u64 triangleCount; // Wide enough to detect overflow
+		bool dropped; // Past the triangle limit, so its objects are skipped
+	};
+	
+	auto chunkCount = (_objects.size() + InstanceChunkSize - 1) / InstanceChunkSize;
+	auto chunks = pvector<Chunk>(chunkCount);
+	
+	// Objects are grouped by model, so the model only needs to be looked up
+	// once per bucket rather than once per object
+	
+	auto& buckets = _objects.buckets();
+	auto bucketModels = pvector<u32>(buckets.size());
+	for (auto i: iota(0_zu, buckets.size())) {
 		
-		auto id = _objects.modelIDs[idx];
-		auto modelIdx = _frame.models.cpu_modelIndices.at(id);
-		modelCount += 1;
-		instanceCount += _frame.models.cpu_models[modelIdx].meshletCount;
+		if (buckets[i].begin != buckets[i].end)
+			bucketModels[i] = _frame.models.cpu_modelIndices.at(buckets[i].modelID);
 		
 	}
 	
-	// Queue up all valid objects
+	// Call func for each part of a bucket that overlaps [begin, end),
+	// in order of position
+	auto forEachRun = [&buckets, &bucketModels](usize _begin, usize _end, auto&& _func) {
+		
+		auto first = std::partition_point(buckets.begin(), buckets.end(), [_begin](auto const& _bucket) {
+			return _bucket.end <= _begin;
+		});
+		for (auto it = first; it != buckets.end() && it->begin < _end; ++it) {
+			
+			if (it->begin == it->end) continue;
+			_func(max(usize(it->begin), _begin), min(usize(it->end), _end),
+				bucketModels[it - buckets.begin()]);
+			
+		}
+		
+	};
 	
-	auto instances = pvector<Instance>();
-	instances.reserve(instanceCount);
-	auto transforms = pvector<Transform>();
-	transforms.reserve(modelCount);
-	auto prevTransforms = pvector<Transform>();
-	prevTransforms.reserve(modelCount);
-	auto colors = pvector<vec4>();
-	colors.reserve(modelCount);
+	auto forEachChunk = [&_frame, _parallel, chunkCount](std::function<void(usize)> const& _func) {
+		
+		if (_parallel) {
+			
+			_frame.threadPool.parallelFor(chunkCount, _func);
+			
+		} else {
+			
+			for (auto i: iota(0_zu, chunkCount))
+				_func(i);
+			
+		}
+		
+	};
 	
-	result.triangleCount = 0;
+	// Count visible objects, and the worst case of their groups and meshlets,
+	// in each chunk. Models without any meshlets are skipped
 	
-	for (auto idx: iota(ObjectID(0), _objects.size())) {
+	forEachChunk([&](usize _chunkIdx) {
 		
-		auto& metadata = _objects.metadata[idx];
-		if (!metadata.exists || !metadata.visible)
-			continue;
+		auto& chunk = chunks[_chunkIdx];
+		chunk.objectCount = 0;
+		chunk.groupCount = 0;
+		chunk.instanceCount = 0;
+		chunk.triangleCount = 0;
+		chunk.dropped = false;
 		
-		auto id = _objects.modelIDs[idx];
-		auto modelIdx = _frame.models.cpu_modelIndices.at(id);
-		auto& model = _frame.models.cpu_models[modelIdx];
+		auto begin = _chunkIdx * InstanceChunkSize;
+		auto end = min(begin + InstanceChunkSize, _objects.size());
+		forEachRun(begin, end, [&](usize _runBegin, usize _runEnd, u32 _modelIdx) {
+			
+			auto& model = _frame.models.cpu_models[_modelIdx];
+			if (model.groupCount == 0) return;
+			auto visibleCount = u32(_visible.count(_runBegin, _runEnd));
+			chunk.objectCount += visibleCount;
+			chunk.groupCount += visibleCount * model.groupCount;
+			chunk.instanceCount += visibleCount * model.meshletCount;
+			chunk.triangleCount += u64(visibleCount) * _frame.models.cpu_modelTriangles[_modelIdx];
+			
+		});
 		
-		// Add meshlet instances
+	});
+	
+	// Assign ranges. Instances never have more triangles than the triangle
+	// bound, so keeping that under MaxTriangles covers instance indices
+	// as well. Chunks that would go over it are skipped entirely, rather
+	// than failing the frame
+	
+	auto objectCount = 0u;
+	auto triangleCount = u64(0);
+	auto droppedObjects = 0_zu;
+	result.groupCapacity = 0;
+	result.instanceCapacity = 0;
+	for (auto& chunk: chunks) {
 		
-		for (auto i: iota(0u, model.meshletCount)) {
-			
-			instances.push_back(Instance{
-				.objectIdx = u32(transforms.size()),
-				.meshletIdx = model.meshletOffset + i });
+		if (triangleCount + chunk.triangleCount > MaxTriangles) {
 			
-			result.triangleCount += divRoundUp(_frame.models.cpu_meshlets[model.meshletOffset + i].indexCount, 3u);
+			chunk.dropped = true;
+			droppedObjects += chunk.objectCount;
+			chunk.objectCount = 0;
+			continue;
 			
 		}
 		
-		// Add model details
+		chunk.objectOffset = objectCount;
+		objectCount += chunk.objectCount;
+		result.groupCapacity += chunk.groupCount;
+		result.instanceCapacity += chunk.instanceCount;
+		triangleCount += chunk.triangleCount;
 		
-		transforms.emplace_back(encodeTransform(_objects.transforms[idx]));
-		prevTransforms.emplace_back(encodeTransform(_objects.prevTransforms[idx]));
-		colors.emplace_back(_objects.colors[idx]);
+	}
+	
+	static auto warnedDropped = false;
+	if (droppedObjects > 0 && !warnedDropped) {
+		
+		L_WARN("Skipped drawing {} objects that would go over the limit of {} triangles",
+			droppedObjects, MaxTriangles);
+		warnedDropped = true;
 		
 	}
+	result.triangleCount = triangleCount;
 	
-	// Upload data to GPU
+	// Write each visible object, directly into GPU-visible memory
 	
-	result.colors = Buffer<vec4>::make(_pool, nameAppend(_name, "colors"),
-		vuk::BufferUsageFlagBits::eStorageBuffer,
-		colors);
-	result.transforms = Buffer<Transform>::make(_pool, nameAppend(_name, "transforms"),
-		vuk::BufferUsageFlagBits::eStorageBuffer,
-		transforms);
-	result.prevTransforms = Buffer<Transform>::make(_pool, nameAppend(_name, "prevTransforms"),
+	result.objects = Buffer<ObjectInstance>::makeMapped(_pool, nameAppend(_name, "objects"),
 		vuk::BufferUsageFlagBits::eStorageBuffer,
-		prevTransforms);
-	result.instances = Buffer<Instance>::make(_pool, nameAppend(_name, "instances"),
-		vuk::BufferUsageFlagBits::eStorageBuffer,
-		instances);
+		objectCount);
+	auto objects = result.objects.mappedSpan();
 	
-	result.colors.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
-	result.transforms.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
-	result.prevTransforms.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
-	result.instances.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	forEachChunk([&](usize _chunkIdx) {
+		
+		auto& chunk = chunks[_chunkIdx];
+		if (chunk.dropped) return;
+		auto outIdx = chunk.objectOffset;
+		
+		auto begin = _chunkIdx * InstanceChunkSize;
+		auto end = min(begin + InstanceChunkSize, _objects.size());
+		forEachRun(begin, end, [&](usize _runBegin, usize _runEnd, u32 _modelIdx) {
+			
+			auto& model = _frame.models.cpu_models[_modelIdx];
+			if (model.groupCount == 0) return;
+			_visible.forEachSet(_runBegin, _runEnd, [&](usize idx) {
+				
+				objects[outIdx] = ObjectInstance{
+					.objectIdx = u32(idx),
+					.modelIdx = _modelIdx };
+				outIdx += 1;
+				
+			});
+			
+		});
+		
+	});
+	
+	result.objects.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
 	
 	return result;
 	
@@ -126,6 +196,18 @@ auto InstanceList::upload(Pool& _pool, Frame& _frame, vuk::Name _name,
 
 void TriangleList::compile(vuk::PerThreadContext& _ptc) {
 	
+	auto cullObjectsPci = vuk::ComputePipelineBaseCreateInfo();
+	cullObjectsPci.add_spirv(std::vector<u32>{
+#include "spv/instanceList/cullObjects.comp.spv"
+	}, "instanceList/cullObjects.comp");
+	_ptc.ctx.create_named_pipeline("instanceList/cullObjects", cullObjectsPci);
+	
+	auto cullGroupsPci = vuk::ComputePipelineBaseCreateInfo();
+	cullGroupsPci.add_spirv(std::vector<u32>{
+#include "spv/instanceList/cullGroups.comp.spv"
+	}, "instanceList/cullGroups.comp");
+	_ptc.ctx.create_named_pipeline("instanceList/cullGroups", cullGroupsPci);
+	
 	auto genIndicesPci = vuk::ComputePipelineBaseCreateInfo();
 	genIndicesPci.add_spirv(std::vector<u32>{
 #include "spv/instanceList/genIndices.comp.spv"
@@ -140,131 +222,451 @@ void TriangleList::compile(vuk::PerThreadContext& _ptc) {
 	
 }
 
-auto TriangleList::fromInstances(InstanceList _instances, Pool& _pool, Frame& _frame, vuk::Name _name,
-	Texture2D _hiZ, uvec2 _hiZInnerSize, mat4 _view, mat4 _projection) -> TriangleList {
+// Culling parameters, shared by group and meshlet culling
+struct CullingData {
+	mat4 view;
+	vec4 frustum;
+	f32 P00;
+	f32 P11;
+	vec2 pad0;
+	vec3 cameraPos;
+};
+
+static auto makeCullingData(mat4 _view, mat4 _projection) -> CullingData {
 	
-	auto result = TriangleList();
-	result.colors = _instances.colors;
-	result.transforms = _instances.transforms;
-	result.prevTransforms = _instances.prevTransforms;
+	auto invView = inverse(_view);
+	return CullingData{
+		.view = _view,
+		.frustum = [_projection] {
+			
+			auto projectionT = transpose(_projection);
+			vec4 frustumX = projectionT[3] + projectionT[0];
+			vec4 frustumY = projectionT[3] + projectionT[1];
+			frustumX /= length(vec3(frustumX));
+			frustumY /= length(vec3(frustumY));
+			return vec4{frustumX.x(), frustumX.z(), frustumY.y(), frustumY.z()};
+			
+		}(),
+		.P00 = _projection[0][0],
+		.P11 = _projection[1][1],
+		.cameraPos = vec3{invView[3][0], invView[3][1], invView[3][2]} };
 	
-	result.instances = Buffer<Instance>::make(_pool, nameAppend(_name, "instances"),
-		vuk::BufferUsageFlagBits::eStorageBuffer,
-		_instances.size());
-	result.instances.attach(_frame.rg, vuk::eNone, vuk::eNone);
+}
+
+// Record one culling phase into the list: traverse group hierarchies starting
+// from groups, cull the meshlets they lead to along with the ones already
+// in meshlets, and generate indices of the survivors. Counts hold a dispatch
+// size in x, and the number of elements in w.
+static void recordCulling(TriangleList& _list, Pool& _pool, Frame& _frame, vuk::Name _name,
+	Buffer<TriangleList::GroupInstance> _groups, Buffer<uvec4> _groupCounts,
+	Buffer<TriangleList::Instance> _meshlets, Buffer<uvec4> _meshletCount,
+	Texture2D _hiZ, uvec2 _hiZInnerSize, mat4 _view, mat4 _projection) {
 	
-	auto instanceCountData = uvec4{0, 1, 1, 0};
-	result.instanceCount = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "instanceCount"),
-		vuk::BufferUsageFlagBits::eIndirectBuffer |
+	using GroupInstance = TriangleList::GroupInstance;
+	
+	auto cullingData = makeCullingData(_view, _projection);
+	auto late = _list.late;
+	auto phase = late? 1u : 0u;
+	
+	// Traverse meshlet group hierarchies, one level per pass. Children of visible
+	// groups are pushed to the next level, and meshlets of visible leaf groups
+	// are pushed to the meshlet instance list. Each level's count is written
+	// by the previous pass, so passes past the deepest visible level are empty.
+	// Rejected groups of the late phase can start at any level, but they still
+	// reach their leaves within the same number of passes
+	
+	auto levels = _frame.models.cpu_groupDepth;
+	
+	auto groupCountersData = pvector<u32>(max(levels, 1u), 0u);
+	auto groupCounters = Buffer<u32>::make(_frame.framePool, nameAppend(_name, "groupCounters"),
 		vuk::BufferUsageFlagBits::eStorageBuffer,
-		std::span(&instanceCountData, 1));
-	result.instanceCount.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+		groupCountersData);
+	
+	// Levels alternate between two lists
+	auto groupLists = to_array({
+		Buffer<GroupInstance>::make(_pool, nameAppend(_name, "groups0"),
+			vuk::BufferUsageFlagBits::eStorageBuffer,
+			_list.groupCapacity),
+		Buffer<GroupInstance>::make(_pool, nameAppend(_name, "groups1"),
+			vuk::BufferUsageFlagBits::eStorageBuffer,
+			_list.groupCapacity) });
+	for (auto& list: groupLists)
+		list.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	for (auto level: iota(0u, levels)) {
+		
+		auto inGroups = level == 0? _groups : groupLists[(level - 1) % 2];
+		auto outGroups = groupLists[level % 2];
+		
+		auto resources = std::vector<vuk::Resource>{
+			inGroups.resource(vuk::eComputeRead),
+			_list.transforms.resource(vuk::eComputeRead),
+			_hiZ.resource(vuk::eComputeSampled),
+			_groupCounts.resource(vuk::eComputeRW),
+			outGroups.resource(vuk::eComputeWrite),
+			_meshletCount.resource(vuk::eComputeRW),
+			_meshlets.resource(vuk::eComputeWrite) };
+		if (!late) {
+			
+			resources.push_back(_list.rejectedGroups.resource(vuk::eComputeWrite));
+			resources.push_back(_list.lateGroupCounts.resource(vuk::eComputeRW));
+			
+		}
+		
+		_frame.rg.add_pass({
+			.name = nameAppend(_name, fmt::format("instanceList/cullGroups{}", level)),
+			.resources = std::move(resources),
+			.execute = [&_frame, _list, inGroups, outGroups, _groupCounts, groupCounters,
+				_meshlets, _meshletCount, cullingData, level, late,
+				_hiZ, _hiZInnerSize, _projection](vuk::CommandBuffer& cmd) {
+				
+				cmd.bind_storage_buffer(0, 1, _frame.models.groups)
+				   .bind_storage_buffer(0, 2, _list.transforms)
+				   .bind_sampled_image(0, 3, _hiZ, MinClamp)
+				   .bind_storage_buffer(0, 4, inGroups)
+				   .bind_storage_buffer(0, 5, outGroups)
+				   .bind_storage_buffer(0, 6, _groupCounts)
+				   .bind_storage_buffer(0, 7, _meshlets)
+				   .bind_storage_buffer(0, 8, _meshletCount)
+				   .bind_storage_buffer(0, 9, groupCounters)
+				   .bind_storage_buffer(0, 10, _list.rejectedGroups)
+				   .bind_storage_buffer(0, 11, _list.lateGroupCounts)
+				   .bind_compute_pipeline("instanceList/cullGroups");
+				
+				*cmd.map_scratch_uniform_binding<CullingData>(0, 0) = cullingData;
+				
+				cmd.specialize_constants(0, _projection[3][2]);
+				cmd.specialize_constants(1, u32Fromu16(_hiZ.size()));
+				cmd.specialize_constants(2, u32Fromu16(_hiZInnerSize));
+				cmd.specialize_constants(3, u32(late));
+				cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, level);
+				
+				cmd.dispatch_indirect(_groupCounts.offsetView(level));
+				
+			}});
+		
+	}
+	
+	// Cull meshlets individually
 	
 	auto groupCounterData = 0u;
 	auto groupCounter = Buffer<u32>::make(_frame.framePool, nameAppend(_name, "groupCounter"),
 		vuk::BufferUsageFlagBits::eStorageBuffer,
 		std::span(&groupCounterData, 1));
 	
-	auto invView = inverse(_view);
-	auto cameraPos = vec3{invView[3][0], invView[3][1], invView[3][2]};
+	auto resources = std::vector<vuk::Resource>{
+		_meshlets.resource(vuk::eComputeRead),
+		_meshletCount.resource(vuk::eIndirectRead),
+		_list.transforms.resource(vuk::eComputeRead),
+		_hiZ.resource(vuk::eComputeSampled),
+		_list.instanceCount.resource(vuk::eComputeRW),
+		_list.instances.resource(vuk::eComputeWrite) };
+	if (!late) {
+		
+		resources.push_back(_list.rejectedInstances.resource(vuk::eComputeWrite));
+		resources.push_back(_list.rejectedInstanceCount.resource(vuk::eComputeRW));
+		
+	}
 	
 	_frame.rg.add_pass({
 		.name = nameAppend(_name, "instanceList/cullMeshlets"),
-		.resources = {
-			_instances.instances.resource(vuk::eComputeRead),
-			_instances.transforms.resource(vuk::eComputeRead),
-			_hiZ.resource(vuk::eComputeSampled),
-			result.instanceCount.resource(vuk::eComputeRW),
-			result.instances.resource(vuk::eComputeWrite) },
-		.execute = [&_frame, _instances, result, groupCounter, _view,
-			_hiZ, _hiZInnerSize, _projection](vuk::CommandBuffer& cmd) {
+		.resources = std::move(resources),
+		.execute = [&_frame, _list, groupCounter, _meshlets, _meshletCount,
+			cullingData, late, _hiZ, _hiZInnerSize, _projection](vuk::CommandBuffer& cmd) {
 			
 			cmd.bind_storage_buffer(0, 1, _frame.models.meshlets)
-			   .bind_storage_buffer(0, 2, _instances.instances)
-			   .bind_storage_buffer(0, 3, _instances.transforms)
+			   .bind_storage_buffer(0, 2, _meshlets)
+			   .bind_storage_buffer(0, 3, _list.transforms)
 			   .bind_sampled_image(0, 4, _hiZ, MinClamp)
-			   .bind_storage_buffer(0, 5, result.instanceCount)
-			   .bind_storage_buffer(0, 6, result.instances)
+			   .bind_storage_buffer(0, 5, _list.instanceCount)
+			   .bind_storage_buffer(0, 6, _list.instances)
 			   .bind_storage_buffer(0, 7, groupCounter)
+			   .bind_storage_buffer(0, 8, _meshletCount)
+			   .bind_storage_buffer(0, 9, _list.rejectedInstances)
+			   .bind_storage_buffer(0, 10, _list.rejectedInstanceCount)
 			   .bind_compute_pipeline("instanceList/cullMeshlets");
 			
-			struct CullingData {
-				mat4 view;
-				vec4 frustum;
-				f32 P00;
-				f32 P11;
-			};
-			*cmd.map_scratch_uniform_binding<CullingData>(0, 0) = CullingData{
-				.view = _view,
-				.frustum = [_projection] {
-					
-					auto projectionT = transpose(_projection);
-					vec4 frustumX = projectionT[3] + projectionT[0];
-					vec4 frustumY = projectionT[3] + projectionT[1];
-					frustumX /= length(vec3(frustumX));
-					frustumY /= length(vec3(frustumY));
-					return vec4{frustumX.x(), frustumX.z(), frustumY.y(), frustumY.z()};
-					
-				}(),
-				.P00 = _projection[0][0],
-				.P11 = _projection[1][1] };
+			*cmd.map_scratch_uniform_binding<CullingData>(0, 0) = cullingData;
 			
 			cmd.specialize_constants(0, tools::MeshletMaxTris);
 			cmd.specialize_constants(1, _projection[3][2]);
 			cmd.specialize_constants(2, u32Fromu16(_hiZ.size()));
 			cmd.specialize_constants(3, u32Fromu16(_hiZInnerSize));
-			cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, u32(_instances.size()));
+			cmd.specialize_constants(4, u32(late));
+			
+			cmd.dispatch_indirect(_meshletCount);
+			
+		}});
+	
+	// Generate the list of visible triangles
+	
+	_frame.rg.add_pass({
+		.name = nameAppend(_name, "instanceList/genIndices"),
+		.resources = {
+			_list.instanceCount.resource(vuk::eIndirectRead),
+			_list.instances.resource(vuk::eComputeRead),
+			_list.transforms.resource(vuk::eComputeRead),
+			_list.command.resource(vuk::eComputeRW),
+			_list.triangles.resource(vuk::eComputeWrite) },
+		.execute = [_list, &_frame, cullingData, late, phase](vuk::CommandBuffer& cmd) {
+			
+			cmd.bind_storage_buffer(0, 0, _frame.models.meshlets)
+			   .bind_storage_buffer(0, 1, _list.instances)
+			   .bind_storage_buffer(0, 2, _list.instanceCount)
+			   .bind_storage_buffer(0, 3, _list.transforms)
+			   .bind_storage_buffer(0, 4, _frame.models.triIndices)
+			   .bind_storage_buffer(0, 5, _frame.models.vertIndices)
+			   .bind_storage_buffer(0, 6, _frame.models.vertices)
+			   .bind_storage_buffer(0, 7, _list.command)
+			   .bind_storage_buffer(0, 8, _list.triangles)
+			   .bind_compute_pipeline("instanceList/genIndices");
+			
+			cmd.specialize_constants(0, tools::MeshletMaxTris);
+			cmd.specialize_constants(1, u32(late));
+			cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, cullingData.cameraPos);
 			
-			cmd.dispatch_invocations(_instances.size());
+			cmd.dispatch_indirect(_list.instanceCount.offsetView(phase));
 			
 		}});
 	
+}
+
+auto TriangleList::fromInstances(InstanceList _instances, Pool& _pool, Frame& _frame, vuk::Name _name,
+	Texture2D _hiZ, uvec2 _hiZInnerSize, mat4 _view, mat4 _projection) -> TriangleList {
+	
+	auto result = TriangleList();
+	result.colors = _instances.colors;
+	result.transforms = _instances.transforms;
+	result.prevTransforms = _instances.prevTransforms;
+	result.late = false;
+	result.groupCapacity = _instances.groupCapacity;
+	
+	// Buffers shared by both phases. Every group and meshlet instance
+	// is tested in at most one of them, so capacities don't grow
+	
+	result.instances = Buffer<Instance>::make(_pool, nameAppend(_name, "instances"),
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		_instances.instanceCapacity);
+	result.instances.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	auto instanceCountData = to_array({uvec4{0, 1, 1, 0}, uvec4{0, 1, 1, 0}});
+	result.instanceCount = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "instanceCount"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		instanceCountData);
+	result.instanceCount.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
 	auto commandData = Command({
-		.indexCount = 0, // Calculated at runtime
+		.vertexCount = 0, // Calculated at runtime
 		.instanceCount = 1,
-		.firstIndex = 0,
-		.vertexOffset = 0,
+		.firstVertex = 0, // Late phase starts after the early phase, calculated at runtime
 		.firstInstance = 0 });
+	auto commandsData = to_array({commandData, commandData});
 	result.command = Buffer<Command>::make(_frame.framePool, nameAppend(_name, "command"),
 		vuk::BufferUsageFlagBits::eIndirectBuffer |
 		vuk::BufferUsageFlagBits::eStorageBuffer,
-		std::span(&commandData, 1));
+		commandsData);
 	result.command.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
 	
-	result.indices = Buffer<u32>::make(_pool, _name,
-		vuk::BufferUsageFlagBits::eIndexBuffer |
+	result.triangles = Buffer<uvec2>::make(_pool, _name,
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		_instances.triangleCount);
+	result.triangles.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	// Late phase inputs, filled in by the early phase
+	
+	auto levels = _frame.models.cpu_groupDepth;
+	auto emptyCountsData = pvector<uvec4>(levels + 1, uvec4{0, 1, 1, 0});
+	
+	result.rejectedGroups = Buffer<GroupInstance>::make(_pool, nameAppend(_name, "rejectedGroups"),
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		_instances.groupCapacity);
+	result.rejectedGroups.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	result.lateGroupCounts = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "lateGroupCounts"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		emptyCountsData);
+	result.lateGroupCounts.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	result.rejectedInstances = Buffer<Instance>::make(_pool, nameAppend(_name, "rejectedInstances"),
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		_instances.instanceCapacity);
+	result.rejectedInstances.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	result.rejectedInstanceCount = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "rejectedInstanceCount"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		std::span(&emptyCountsData[0], 1));
+	result.rejectedInstanceCount.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	// Early phase inputs. Traversal starts at the root groups of objects
+	// that survive object culling
+	
+	auto objectCount = u32(_instances.size());
+	auto groupCounts = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "groupCounts"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		emptyCountsData);
+	groupCounts.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	auto roots = Buffer<GroupInstance>::make(_pool, nameAppend(_name, "roots"),
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		objectCount);
+	roots.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	auto meshletInstances = Buffer<Instance>::make(_pool, nameAppend(_name, "meshletInstances"),
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		_instances.instanceCapacity);
+	meshletInstances.attach(_frame.rg, vuk::eNone, vuk::eNone);
+	
+	auto meshletInstanceCount = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "meshletInstanceCount"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		std::span(&emptyCountsData[0], 1));
+	meshletInstanceCount.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	// Cull whole objects first, so that hierarchies of objects that are
+	// entirely off-screen or occluded are never traversed
+	
+	auto cullingData = makeCullingData(_view, _projection);
+	
+	auto objectCounterData = 0u;
+	auto objectCounter = Buffer<u32>::make(_frame.framePool, nameAppend(_name, "objectCounter"),
 		vuk::BufferUsageFlagBits::eStorageBuffer,
-		_instances.triangleCount * 3);
-	result.indices.attach(_frame.rg, vuk::eNone, vuk::eNone);
+		std::span(&objectCounterData, 1));
 	
 	_frame.rg.add_pass({
-		.name = nameAppend(_name, "instanceList/genIndices"),
+		.name = nameAppend(_name, "instanceList/cullObjects"),
 		.resources = {
-			result.instanceCount.resource(vuk::eIndirectRead),
-			result.instances.resource(vuk::eComputeRead),
+			_instances.objects.resource(vuk::eComputeRead),
 			result.transforms.resource(vuk::eComputeRead),
-			result.command.resource(vuk::eComputeRW),
-			result.indices.resource(vuk::eComputeWrite) },
-		.execute = [result, &_frame, _view, cameraPos](vuk::CommandBuffer& cmd) {
+			_hiZ.resource(vuk::eComputeSampled),
+			roots.resource(vuk::eComputeWrite),
+			groupCounts.resource(vuk::eComputeRW),
+			result.rejectedGroups.resource(vuk::eComputeWrite),
+			result.lateGroupCounts.resource(vuk::eComputeRW) },
+		.execute = [&_frame, result, _instances, roots, groupCounts, objectCounter, objectCount,
+			cullingData, _hiZ, _hiZInnerSize, _projection](vuk::CommandBuffer& cmd) {
 			
-			cmd.bind_storage_buffer(0, 0, _frame.models.meshlets)
-			   .bind_storage_buffer(0, 1, result.instances)
-			   .bind_storage_buffer(0, 2, result.instanceCount)
-			   .bind_storage_buffer(0, 3, result.transforms)
-			   .bind_storage_buffer(0, 4, _frame.models.triIndices)
-			   .bind_storage_buffer(0, 5, _frame.models.vertIndices)
-			   .bind_storage_buffer(0, 6, _frame.models.vertices)
-			   .bind_storage_buffer(0, 7, result.command)
-			   .bind_storage_buffer(0, 8, result.indices)
-			   .bind_compute_pipeline("instanceList/genIndices");
+			cmd.bind_storage_buffer(0, 1, _frame.models.groups)
+			   .bind_storage_buffer(0, 2, result.transforms)
+			   .bind_sampled_image(0, 3, _hiZ, MinClamp)
+			   .bind_storage_buffer(0, 4, _instances.objects)
+			   .bind_storage_buffer(0, 5, roots)
+			   .bind_storage_buffer(0, 6, groupCounts)
+			   .bind_storage_buffer(0, 7, objectCounter)
+			   .bind_storage_buffer(0, 8, result.rejectedGroups)
+			   .bind_storage_buffer(0, 9, result.lateGroupCounts)
+			   .bind_storage_buffer(0, 10, _frame.models.models)
+			   .bind_storage_buffer(0, 11, _frame.models.lods)
+			   .bind_compute_pipeline("instanceList/cullObjects");
 			
-			cmd.specialize_constants(0, tools::MeshletMaxTris);
-			cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, cameraPos);
+			*cmd.map_scratch_uniform_binding<CullingData>(0, 0) = cullingData;
+			
+			cmd.specialize_constants(0, _projection[3][2]);
+			cmd.specialize_constants(1, u32Fromu16(_hiZ.size()));
+			cmd.specialize_constants(2, u32Fromu16(_hiZInnerSize));
+			cmd.specialize_constants(3, LodMaxScreenError);
+			cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, objectCount);
 			
-			cmd.dispatch_indirect(result.instanceCount);
+			cmd.dispatch_invocations(objectCount);
 			
 		}});
 	
+	recordCulling(result, _pool, _frame, _name,
+		roots, groupCounts, meshletInstances, meshletInstanceCount,
+		_hiZ, _hiZInnerSize, _view, _projection);
+	
+	return result;
+	
+}
+
+auto TriangleList::fromRejected(TriangleList _early, Pool& _pool, Frame& _frame, vuk::Name _name,
+	Texture2D _hiZ, uvec2 _hiZInnerSize, mat4 _view, mat4 _projection) -> TriangleList {
+	
+	auto result = _early;
+	result.late = true;
+	
+	recordCulling(result, _pool, _frame, _name,
+		result.rejectedGroups, result.lateGroupCounts, result.rejectedInstances, result.rejectedInstanceCount,
+		_hiZ, _hiZInnerSize, _view, _projection);
+	
+	return result;
+	
+}
+
+auto TriangleList::fromCulled(Pool& _pool, Frame& _frame, vuk::Name _name,
+	ObjectBuffer const& _objectBuffer, MeshletCuller const& _culler) -> TriangleList {
+	
+	auto result = TriangleList();
+	result.colors = _objectBuffer.colors;
+	result.transforms = _objectBuffer.transforms;
+	result.prevTransforms = _objectBuffer.prevTransforms;
+	result.late = false;
+	result.groupCapacity = 0;
+	
+	auto culledInstances = _culler.instances();
+	auto culledTriangles = _culler.triangles();
+	if (culledTriangles.size() > InstanceList::MaxTriangles) {
+		
+		static auto warnedClamped = false;
+		if (!warnedClamped) {
+			
+			L_WARN("CPU culling produced {} triangles, only drawing the first {}",
+				culledTriangles.size(), InstanceList::MaxTriangles);
+			warnedClamped = true;
+			
+		}
+		culledTriangles = culledTriangles.first(InstanceList::MaxTriangles);
+		
+	}
+	auto instanceCount = u32(culledInstances.size());
+	auto triangleCount = u32(culledTriangles.size());
+	
+	result.instances = Buffer<Instance>::makeMapped(_pool, nameAppend(_name, "instances"),
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		instanceCount);
+	std::transform(culledInstances.begin(), culledInstances.end(), result.instances.mappedSpan().begin(),
+		[](auto const& _instance) {
+			
+			return Instance{
+				.objectIdx = _instance.objectIdx,
+				.meshletIdx = _instance.meshletIdx };
+			
+		});
+	result.instances.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	auto instanceCountData = to_array({uvec4{0, 1, 1, instanceCount}, uvec4{0, 1, 1, 0}});
+	result.instanceCount = Buffer<uvec4>::make(_frame.framePool, nameAppend(_name, "instanceCount"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		instanceCountData);
+	result.instanceCount.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	auto commandsData = to_array({
+		Command({
+			.vertexCount = triangleCount * 3,
+			.instanceCount = 1,
+			.firstVertex = 0,
+			.firstInstance = 0 }),
+		Command({
+			.vertexCount = 0,
+			.instanceCount = 1,
+			.firstVertex = triangleCount * 3,
+			.firstInstance = 0 })});
+	result.command = Buffer<Command>::make(_frame.framePool, nameAppend(_name, "command"),
+		vuk::BufferUsageFlagBits::eIndirectBuffer |
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		commandsData);
+	result.command.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
+	result.triangles = Buffer<uvec2>::makeMapped(_pool, _name,
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		triangleCount);
+	std::copy(culledTriangles.begin(), culledTriangles.end(), result.triangles.mappedSpan().begin());
+	result.triangles.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+	
 	return result;
 	
 }
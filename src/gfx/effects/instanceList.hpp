@@ -4,6 +4,8 @@
 #include "base/types.hpp"
 #include "base/math.hpp"
 #include "gfx/resources/buffer.hpp"
+#include "gfx/effects/objectBuffer.hpp"
+#include "gfx/meshletCuller.hpp"
 #include "gfx/objects.hpp"
 #include "gfx/frame.hpp"
 
@@ -14,48 +16,113 @@ using namespace base::literals;
 
 struct InstanceList {
 	
-	using Transform = array<vec4, 3>;
+	using Transform = ObjectBuffer::Transform;
+	
+	// Number of objects processed by a single thread at a time. Multiple of
+	// the visibility bitvector's word size, so that chunks never share a word
+	static constexpr auto InstanceChunkSize = 4096_zu;
+	static_assert(InstanceChunkSize % bitvector::WordBits == 0);
+	
+	// Visible triangles are drawn without an index buffer, so the vertex IDs
+	// of a whole frame's worth must fit in 32 bits
+	static constexpr auto MaxTriangles = ~0u / 3;
 	
 	struct Instance {
 		u32 objectIdx;
 		u32 meshletIdx;
 	};
 	
+	struct GroupInstance {
+		u32 objectIdx;
+		u32 groupIdx;
+	};
+	
+	struct ObjectInstance {
+		u32 objectIdx;
+		u32 modelIdx;
+	};
+	
 	Buffer<vec4> colors;
 	Buffer<Transform> transforms;
 	Buffer<Transform> prevTransforms;
 	
-	Buffer<Instance> instances;
+	// Each visible object with its model. A LOD is picked for each during
+	// culling, and its group hierarchy is traversed into meshlet instances
+	Buffer<ObjectInstance> objects;
 	
-	u32 triangleCount;
+	u32 groupCapacity; // Upper bound of group instances in a single hierarchy level
+	u32 instanceCapacity; // Upper bound of meshlet instances
+	u32 triangleCount; // Upper bound of triangles
 	
-	static auto upload(Pool&, Frame&, vuk::Name, ObjectPool const&) -> InstanceList;
+	// Build the list of objects set in the visible bitvector, which has
+	// the same size as the pool. Objects of the same model are contiguous,
+	// following the ObjectPool's buckets. Object properties are referenced
+	// from the ObjectBuffer. With parallel set, the work is spread across
+	// the frame's thread pool; the result is identical either way. Chunks of
+	// objects that would take the triangle bound over MaxTriangles are left
+	// out, with a warning the first time it happens.
+	static auto upload(Pool&, Frame&, vuk::Name, ObjectPool const&, bitvector const& visible,
+		ObjectBuffer const&, bool parallel = true) -> InstanceList;
 	
-	auto size() const -> usize { return instances.length(); }
+	auto size() const -> usize { return objects.length(); }
 	
 };
 
+// Culling runs in two phases. The early phase tests against the HiZ of
+// the previous frame, and keeps whatever it finds occluded. Once its triangles
+// are drawn and the HiZ is rebuilt, the late phase tests only those again.
+// Both phases write into the same instance and triangle buffers.
 struct TriangleList {
 	
-	using Command = VkDrawIndexedIndirectCommand;
+	using Command = VkDrawIndirectCommand;
 	using Transform = InstanceList::Transform;
 	using Instance = InstanceList::Instance;
+	using GroupInstance = InstanceList::GroupInstance;
+	using ObjectInstance = InstanceList::ObjectInstance;
 	
 	Buffer<vec4> colors;
 	Buffer<Transform> transforms;
 	Buffer<Transform> prevTransforms;
 	
 	Buffer<Instance> instances;
-	Buffer<uvec4> instanceCount;
+	Buffer<uvec4> instanceCount; // Early and late phase. x holds the index generation group count
+	
+	Buffer<Command> command; // Early and late phase
+	
+	// Visible triangles, as their meshlet instance and packed meshlet-local
+	// vertex indices (see instanceList/indices.glsl). A triangle's index
+	// in this buffer is what the visibility buffer stores
+	Buffer<uvec2> triangles;
+	
+	bool late; // Which command belongs to this list
 	
-	Buffer<Command> command;
-	Buffer<u32> indices;
+	// Work left for the late phase
+	Buffer<GroupInstance> rejectedGroups;
+	Buffer<uvec4> lateGroupCounts; // One per hierarchy level, the first counts rejectedGroups
+	Buffer<Instance> rejectedInstances;
+	Buffer<uvec4> rejectedInstanceCount;
+	u32 groupCapacity;
 	
 	static void compile(vuk::PerThreadContext&);
 	
+	// Early phase. Cull whole objects and compact the survivors, pick a LOD
+	// for each from its projected error, traverse the LODs' meshlet group
+	// hierarchies, then cull the remaining meshlets
+	// individually and generate triangle indices. Everything is tested
+	// against the frustum and the HiZ of the previous frame.
 	static auto fromInstances(InstanceList, Pool&, Frame&, vuk::Name,
 		Texture2D hiZ, uvec2 hiZInnerSize, mat4 view, mat4 projection) -> TriangleList;
 	
+	// Late phase. Test groups and meshlets rejected by the early phase's
+	// HiZ test again, against a HiZ rebuilt from the early phase's depth.
+	// The result draws only the triangles that weren't drawn already.
+	static auto fromRejected(TriangleList, Pool&, Frame&, vuk::Name,
+		Texture2D hiZ, uvec2 hiZInnerSize, mat4 view, mat4 projection) -> TriangleList;
+	
+	// Upload the result of culling on the CPU, skipping the GPU pipeline.
+	// Everything is in the early phase, and there is no late phase.
+	static auto fromCulled(Pool&, Frame&, vuk::Name, ObjectBuffer const&, MeshletCuller const&) -> TriangleList;
+	
 };
 
 }
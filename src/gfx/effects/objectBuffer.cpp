@@ -0,0 +1,214 @@
+#include "gfx/effects/objectBuffer.hpp"
+
+#include "vuk/CommandBuffer.hpp"
+#include "base/containers/vector.hpp"
+#include "base/util.hpp"
+#include "gfx/util.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+
+// Properties of a single object, written into place by the scatter shader
+struct ObjectUpdate {
+	ObjectBuffer::Transform transform;
+	ObjectBuffer::Transform prevTransform;
+	vec4 color;
+	u32 objectIdx;
+	u32 pad0;
+	u32 pad1;
+	u32 pad2;
+};
+
+// Quantized alternative to ObjectUpdate
+struct CompactObjectUpdate {
+	vec3 position;
+	u32 objectIdx;
+	array<u16, 4> rotation; // snorm16, xyzw
+	array<u16, 3> scale; // half
+	u16 flags;
+	array<u16, 4> color; // half
+};
+static_assert(sizeof(CompactObjectUpdate) == 40);
+
+// Copy the object's previous transform from the GPU instead of uploading it
+constexpr auto CompactFlagKeepPrev = 1u << 0;
+
+constexpr auto encodeCompact(ObjectPool::Transform _transform, vec4 _color,
+	u32 _objectIdx, u32 _flags) -> CompactObjectUpdate {
+	
+	// A zero quaternion has no orientation to normalize, so it's sent as identity
+	auto rotation = _transform.rotation;
+	auto rotationLength = sqrt(
+		rotation.w() * rotation.w() + rotation.x() * rotation.x() +
+		rotation.y() * rotation.y() + rotation.z() * rotation.z());
+	if (rotationLength == 0.0f) {
+		
+		rotation = quat::identity();
+		rotationLength = 1.0f;
+		
+	}
+	
+	return CompactObjectUpdate{
+		.position = _transform.position,
+		.objectIdx = _objectIdx,
+		.rotation = {
+			packSnorm16(rotation.x() / rotationLength),
+			packSnorm16(rotation.y() / rotationLength),
+			packSnorm16(rotation.z() / rotationLength),
+			packSnorm16(rotation.w() / rotationLength)},
+		.scale = {
+			packHalf(_transform.scale.x()),
+			packHalf(_transform.scale.y()),
+			packHalf(_transform.scale.z())},
+		.flags = u16(_flags),
+		.color = {
+			packHalf(_color.r()),
+			packHalf(_color.g()),
+			packHalf(_color.b()),
+			packHalf(_color.a())}};
+	
+}
+
+void ObjectBuffer::compile(vuk::PerThreadContext& _ptc) {
+	
+	auto scatterPci = vuk::ComputePipelineBaseCreateInfo();
+	scatterPci.add_spirv(std::vector<u32>{
+#include "spv/objectBuffer/scatter.comp.spv"
+	}, "objectBuffer/scatter.comp");
+	_ptc.ctx.create_named_pipeline("objectBuffer/scatter", scatterPci);
+	
+}
+
+auto ObjectBuffer::update(Pool& _pool, Frame& _frame, vuk::Name _name,
+	ObjectPool const& _objects, UpdateFormat _format) -> ObjectBuffer {
+	
+	auto colorsName = nameAppend(_name, "colors");
+	auto transformsName = nameAppend(_name, "transforms");
+	auto prevTransformsName = nameAppend(_name, "prevTransforms");
+	
+	// Recreate the buffers if the objects don't fit. New buffers have
+	// undefined contents, so everything needs to be uploaded again
+	
+	auto fullUpload = false;
+	if (!_pool.contains(colorsName) ||
+		_pool.get<vuk::Unique<vuk::Buffer>>(colorsName)->size < _objects.size() * sizeof(vec4)) {
+		
+		_pool.erase(colorsName);
+		_pool.erase(transformsName);
+		_pool.erase(prevTransformsName);
+		fullUpload = true;
+		
+	}
+	
+	auto capacity = max(nextPOT(u32(_objects.size())), MinCapacity);
+	
+	auto result = ObjectBuffer();
+	result.colors = Buffer<vec4>::make(_pool, colorsName,
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		capacity);
+	result.transforms = Buffer<Transform>::make(_pool, transformsName,
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		capacity);
+	result.prevTransforms = Buffer<Transform>::make(_pool, prevTransformsName,
+		vuk::BufferUsageFlagBits::eStorageBuffer,
+		capacity);
+	
+	result.colors.attach(_frame.rg, vuk::eComputeRead, vuk::eComputeRead);
+	result.transforms.attach(_frame.rg, vuk::eComputeRead, vuk::eComputeRead);
+	result.prevTransforms.attach(_frame.rg, vuk::eComputeRead, vuk::eComputeRead);
+	
+	// Gather modified objects
+	
+	auto indices = ivector<u32>();
+	if (fullUpload) {
+		
+		indices.reserve(_objects.size());
+		for (auto idx: iota(0u, u32(_objects.size())))
+			indices.push_back(idx);
+		
+	} else {
+		
+		indices = _objects.dirtyIndices();
+		
+	}
+	
+	if (indices.empty())
+		return result;
+	
+	// Encode updates directly into GPU-visible memory
+	
+	auto compact = (_format == UpdateFormat::Compact);
+	auto updateCount = u32(indices.size());
+	auto updatesName = nameAppend(_name, "updates");
+	auto updatesBuf = vuk::Buffer();
+	
+	if (compact) {
+		
+		auto buffer = Buffer<CompactObjectUpdate>::makeMapped(_frame.framePool, updatesName,
+			vuk::BufferUsageFlagBits::eStorageBuffer,
+			updateCount);
+		auto updates = buffer.mappedSpan();
+		for (auto i: iota(0u, updateCount)) {
+			
+			// An object that stayed in place has its previous transform
+			// already on the GPU, unless the buffers were just recreated
+			auto idx = indices[i];
+			auto keepPrev = !fullUpload && !_objects.wasRelocated(idx);
+			updates[i] = encodeCompact(_objects.transforms[idx], _objects.colors[idx],
+				idx, keepPrev? CompactFlagKeepPrev : 0u);
+			
+		}
+		buffer.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+		updatesBuf = buffer;
+		
+	} else {
+		
+		auto buffer = Buffer<ObjectUpdate>::makeMapped(_frame.framePool, updatesName,
+			vuk::BufferUsageFlagBits::eStorageBuffer,
+			updateCount);
+		auto updates = buffer.mappedSpan();
+		for (auto i: iota(0u, updateCount)) {
+			
+			auto idx = indices[i];
+			updates[i] = ObjectUpdate{
+				.transform = encodeTransform(_objects.transforms[idx]),
+				.prevTransform = encodeTransform(_objects.prevTransforms[idx]),
+				.color = _objects.colors[idx],
+				.objectIdx = idx };
+			
+		}
+		buffer.attach(_frame.rg, vuk::eHostWrite, vuk::eNone);
+		updatesBuf = buffer;
+		
+	}
+	
+	// Write the updates into place
+	
+	_frame.rg.add_pass({
+		.name = nameAppend(_name, "objectBuffer/scatter"),
+		.resources = {
+			vuk::Resource(updatesName, vuk::Resource::Type::eBuffer, vuk::eComputeRead),
+			result.colors.resource(vuk::eComputeWrite),
+			result.transforms.resource(vuk::eComputeRW),
+			result.prevTransforms.resource(vuk::eComputeWrite) },
+		.execute = [result, updatesBuf, updateCount, compact](vuk::CommandBuffer& cmd) {
+			
+			cmd.bind_storage_buffer(0, 0, updatesBuf)
+			   .bind_storage_buffer(0, 1, result.colors)
+			   .bind_storage_buffer(0, 2, result.transforms)
+			   .bind_storage_buffer(0, 3, result.prevTransforms)
+			   .bind_compute_pipeline("objectBuffer/scatter");
+			
+			cmd.specialize_constants(0, u32(compact));
+			cmd.push_constants(vuk::ShaderStageFlagBits::eCompute, 0, updateCount);
+			
+			cmd.dispatch_invocations(updateCount);
+			
+		}});
+	
+	return result;
+	
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "vuk/Context.hpp"
+#include "vuk/Name.hpp"
+#include "base/containers/array.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "gfx/resources/buffer.hpp"
+#include "gfx/resources/pool.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/frame.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+
+// Persistent GPU-side copy of object properties, indexed by position
+// in the ObjectPool. Only objects marked as dirty are uploaded each frame.
+struct ObjectBuffer {
+	
+	using Transform = array<vec4, 3>;
+	
+	// Encoding of uploaded object properties
+	enum struct UpdateFormat {
+		Full, // Float matrices and color, 128 bytes per object
+		Compact, // Quantized rotation, scale and color, 40 bytes per object. prevTransform
+		         // is derived from the existing GPU copy
+	};
+	
+	// Smallest possible buffer size, in objects
+	static constexpr auto MinCapacity = 1024u;
+	
+	Buffer<vec4> colors;
+	Buffer<Transform> transforms;
+	Buffer<Transform> prevTransforms;
+	
+	static void compile(vuk::PerThreadContext&);
+	
+	// Retrieve the buffers from the pool, and record the upload of all dirty
+	// objects. If the buffers are too small, they are recreated and filled
+	// with all objects.
+	static auto update(Pool&, Frame&, vuk::Name, ObjectPool const&,
+		UpdateFormat = UpdateFormat::Compact) -> ObjectBuffer;
+	
+};
+
+// Matrix rows of an object transform, in the layout of ObjectBuffer::transforms
+constexpr auto encodeTransform(ObjectPool::Transform _in) -> ObjectBuffer::Transform {
+	
+	auto rw = _in.rotation.w();
+	auto rx = _in.rotation.x();
+	auto ry = _in.rotation.y();
+	auto rz = _in.rotation.z();
+	
+	auto rotationMat = mat3{
+		1.0f - 2.0f * (ry * ry + rz * rz),        2.0f * (rx * ry - rw * rz),        2.0f * (rx * rz + rw * ry),
+		       2.0f * (rx * ry + rw * rz), 1.0f - 2.0f * (rx * rx + rz * rz),        2.0f * (ry * rz - rw * rx),
+		       2.0f * (rx * rz - rw * ry),        2.0f * (ry * rz + rw * rx), 1.0f - 2.0f * (rx * rx + ry * ry)};
+	
+	rotationMat[0] *= _in.scale.x();
+	rotationMat[1] *= _in.scale.y();
+	rotationMat[2] *= _in.scale.z();
+	
+	return to_array({
+		vec4(rotationMat[0], _in.position.x()),
+		vec4(rotationMat[1], _in.position.y()),
+		vec4(rotationMat[2], _in.position.z())});
+	
+}
+
+}
@@ -27,7 +27,7 @@ void PBR::apply(Frame& _frame, QuadBuffer& _quadbuf, Worklist _worklist,
 		.resources = {
 			_worklist.counts.resource(vuk::eIndirectRead),
 			_worklist.lists.resource(vuk::eComputeRead),
-			_triangles.indices.resource(vuk::eComputeRead),
+			_triangles.triangles.resource(vuk::eComputeRead),
 			_triangles.instances.resource(vuk::eComputeRead),
 			_triangles.colors.resource(vuk::eComputeRead),
 			_sunLuminance.resource(vuk::eComputeRead),
@@ -44,7 +44,7 @@ void PBR::apply(Frame& _frame, QuadBuffer& _quadbuf, Worklist _worklist,
 			
 			cmd.bind_uniform_buffer(0, 0, _frame.world)
 			   .bind_storage_buffer(0, 1, _frame.models.meshlets)
-			   .bind_storage_buffer(0, 2, _triangles.indices)
+			   .bind_storage_buffer(0, 2, _triangles.triangles)
 			   .bind_storage_buffer(0, 3, _triangles.instances)
 			   .bind_storage_buffer(0, 4, _triangles.colors)
 			   .bind_storage_buffer(0, 5, _frame.models.materials)
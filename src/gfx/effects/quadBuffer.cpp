@@ -180,7 +180,7 @@ void QuadBuffer::genBuffers(Frame& _frame, QuadBuffer& _quadbuf, TriangleList _t
 		
 		.name = nameAppend(_quadbuf.name, "quad/genBuffers"),
 		.resources = {
-			_triangles.indices.resource(vuk::eComputeRead),
+			_triangles.triangles.resource(vuk::eComputeRead),
 			_triangles.instances.resource(vuk::eComputeRead),
 			_triangles.transforms.resource(vuk::eComputeRead),
 			_triangles.prevTransforms.resource(vuk::eComputeRead),
@@ -199,7 +199,7 @@ void QuadBuffer::genBuffers(Frame& _frame, QuadBuffer& _quadbuf, TriangleList _t
 			   .bind_storage_buffer(0, 2, _triangles.instances)
 			   .bind_storage_buffer(0, 3, _triangles.transforms)
 			   .bind_storage_buffer(0, 4, _triangles.prevTransforms)
-			   .bind_storage_buffer(0, 5, _triangles.indices)
+			   .bind_storage_buffer(0, 5, _triangles.triangles)
 			   .bind_storage_buffer(0, 6, _frame.models.vertIndices)
 			   .bind_storage_buffer(0, 7, _frame.models.vertices)
 			   .bind_storage_buffer(0, 8, _frame.models.normals)
@@ -31,7 +31,7 @@ void Visibility::apply(Frame& _frame, Texture2DMS _visbuf, Texture2DMS _depth,
 		.name = nameAppend(_visbuf.name, "visibility/visbuf"),
 		.resources = {
 			_triangles.command.resource(vuk::eIndirectRead),
-			_triangles.indices.resource(vuk::eIndexRead),
+			_triangles.triangles.resource(vuk::eVertexRead),
 			_triangles.instances.resource(vuk::eVertexRead),
 			_triangles.transforms.resource(vuk::eVertexRead),
 			_visbuf.resource(vuk::eColorWrite),
@@ -49,16 +49,16 @@ void Visibility::apply(Frame& _frame, Texture2DMS _visbuf, Texture2DMS _depth,
 				.depthWriteEnable = true,
 				.depthCompareOp = vuk::CompareOp::eGreater });
 			
-			cmd.bind_index_buffer(_triangles.indices, vuk::IndexType::eUint32)
-			   .bind_uniform_buffer(0, 0, _frame.world)
+			cmd.bind_uniform_buffer(0, 0, _frame.world)
 			   .bind_storage_buffer(0, 1, _frame.models.vertIndices)
 			   .bind_storage_buffer(0, 2, _frame.models.vertices)
 			   .bind_storage_buffer(0, 3, _frame.models.meshlets)
 			   .bind_storage_buffer(0, 4, _triangles.instances)
 			   .bind_storage_buffer(0, 5, _triangles.transforms)
+			   .bind_storage_buffer(0, 6, _triangles.triangles)
 			   .bind_graphics_pipeline("visibility/visbuf");
 			
-			cmd.draw_indexed_indirect(1, _triangles.command);
+			cmd.draw_indirect(1, _triangles.command.offsetView(_triangles.late? 1 : 0));
 			
 		}});
 	
@@ -107,13 +107,14 @@ auto Worklist::create(Pool& _pool, Frame& _frame, vuk::Name _name,
 		.name = nameAppend(_name, "visibility/worklist"),
 		.resources = {
 			_visbuf.resource(vuk::eComputeSampled),
+			_triangles.triangles.resource(vuk::eComputeRead),
 			_triangles.instances.resource(vuk::eComputeRead),
 			result.counts.resource(vuk::eComputeRW),
 			result.lists.resource(vuk::eComputeWrite) },
 		.execute = [result, _visbuf, _triangles, &_frame](vuk::CommandBuffer& cmd) {
 			
 			cmd.bind_sampled_image(0, 0, _visbuf, NearestClamp)
-			   .bind_storage_buffer(0, 1, _triangles.indices)
+			   .bind_storage_buffer(0, 1, _triangles.triangles)
 			   .bind_storage_buffer(0, 2, _triangles.instances)
 			   .bind_storage_buffer(0, 3, _frame.models.meshlets)
 			   .bind_storage_buffer(0, 4, _frame.models.materials)
@@ -22,6 +22,8 @@ struct Visibility {
 	// Build the shader.
 	static void compile(vuk::PerThreadContext&);
 	
+	// Draw the list's triangles into the visibility buffer. Only the triangles
+	// of the list's own culling phase are drawn.
 	static void apply(Frame&, Texture2DMS visbuf, Texture2DMS depth, TriangleList);
 	
 };
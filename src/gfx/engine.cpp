@@ -11,6 +11,7 @@
 #include "base/log.hpp"
 #include "sys/system.hpp"
 #include "gfx/resources/texture2d.hpp"
+#include "gfx/effects/objectBuffer.hpp"
 #include "gfx/effects/instanceList.hpp"
 #include "gfx/effects/quadbuffer.hpp"
 #include "gfx/effects/cubeFilter.hpp"
@@ -48,12 +49,13 @@ Engine::~Engine() {
 	
 }
 
-void Engine::init(ModelList&& _modelList) {
+void Engine::init() {
 	
 	auto ifc = m_vk.context->begin();
 	auto ptc = ifc.begin();
 	m_permPool.setPtc(ptc);
 	
+	ObjectBuffer::compile(ptc);
 	TriangleList::compile(ptc);
 	QuadBuffer::compile(ptc);
 	CubeFilter::compile(ptc);
@@ -77,7 +79,7 @@ void Engine::init(ModelList&& _modelList) {
 	// Begin imgui frame so that first-frame calls succeed
 	ImGui::NewFrame();
 	
-	m_models = std::move(_modelList).upload(m_permPool, "models");
+	m_models = ModelBuffer::make(m_permPool, "models");
 	
 	// Finalize
 	
@@ -112,6 +114,8 @@ void Engine::render() {
 	}
 	
 	ImGui::Text("FPS: %.1f", m_framerate);
+	ImGui::Text("Models: %.1f / %.1f MiB",
+		f64(m_residency.residentSize()) / 1_mb, f64(m_residency.budget()) / 1_mb);
 	
 	// Prepare per-frame data
 	
@@ -166,6 +170,12 @@ void Engine::render() {
 	
 	// Draw frame
 	
+	m_objects.applyCommands(); // Frame boundary for queued object changes
+	
+	// Stream models in and out, following what the objects use
+	m_residency.update(m_objects, m_models, m_permPool);
+	m_models.flush(m_permPool);
+	
 	auto frame = Frame(*this, rg);
 	frame.draw(screen, m_objects, m_flushTemporalResources);
 	
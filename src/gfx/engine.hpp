@@ -3,10 +3,15 @@
 #include <optional>
 #include <mutex>
 #include "base/math.hpp"
+#include "base/threadPool.hpp"
 #include "base/time.hpp"
 #include "sys/vulkan.hpp"
 #include "gfx/resources/cubemap.hpp"
 #include "gfx/resources/pool.hpp"
+#include "gfx/occlusionCuller.hpp"
+#include "gfx/meshletCuller.hpp"
+#include "gfx/modelResidency.hpp"
+#include "gfx/objectBvh.hpp"
 #include "gfx/objects.hpp"
 #include "gfx/models.hpp"
 #include "gfx/camera.hpp"
@@ -23,16 +28,20 @@ struct Engine {
 	
 	static constexpr auto VerticalFov = 50_deg;
 	static constexpr auto NearPlane = 0.1_m;
+	static constexpr auto ModelBudget = 256_mb; // GPU memory for model data
 	
-	// Create the engine in uninitialized state.
-	Engine(sys::Vulkan& vk):
+	// Create the engine in uninitialized state. The thread pool is used
+	// for parallelizable CPU-side work.
+	Engine(sys::Vulkan& vk, ThreadPool& threadPool):
 		m_vk(vk),
+		m_threadPool(threadPool),
 		m_framerate(60.0f),
 		m_lastFramerateCheck(0),
-		m_framesSinceLastCheck(0) {}
+		m_framesSinceLastCheck(0),
+		m_residency(ModelBudget) {}
 	~Engine();
 	
-	void init(ModelList&&);
+	void init();
 	
 	// Render all objects to the screen. If repaint is false, the function will
 	// only render it no other thread is currently rendering. Otherwise it will
@@ -45,9 +54,18 @@ struct Engine {
 	
 	// Subcomponent access
 	
-	// Use freely to add/remove/modify objects for drawing
+	// Catalog of models that objects can use. Models are streamed in once
+	// an object uses them. Use from the thread calling render()
+	auto models() -> ModelResidency& { return m_residency; }
+	
+	// Use freely to add/remove/modify objects for drawing from the thread
+	// calling render(). Other threads need to go through a command queue
 	auto objects() -> ObjectPool& { return m_objects; }
 	
+	// Spatial queries over objects, as of the last rendered frame. Don't use
+	// while render() is running
+	auto objectBvh() const -> ObjectBVH const& { return m_objectBvh; }
+	
 	// Use freely to modify the rendering camera
 	auto camera() -> Camera& { return m_camera; }
 	
@@ -62,6 +80,7 @@ struct Engine {
 private:
 	
 	sys::Vulkan& m_vk;
+	ThreadPool& m_threadPool;
 	
 	std::mutex m_renderLock;
 	bool m_swapchainDirty;
@@ -72,8 +91,12 @@ private:
 	u32 m_framesSinceLastCheck;
 	
 	ImguiData m_imguiData;
+	ModelResidency m_residency;
 	ModelBuffer m_models;
 	ObjectPool m_objects;
+	ObjectBVH m_objectBvh;
+	OcclusionCuller m_occlusionCuller; // Cullers are kept between frames, to reuse allocations
+	MeshletCuller m_meshletCuller;
 	World m_world;
 	Camera m_camera;
 	
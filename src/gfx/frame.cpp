@@ -1,5 +1,6 @@
 #include "gfx/frame.hpp"
 
+#include "gfx/effects/objectBuffer.hpp"
 #include "gfx/effects/instanceList.hpp"
 #include "gfx/effects/quadbuffer.hpp"
 #include "gfx/effects/cubeFilter.hpp"
@@ -11,7 +12,12 @@
 #include "gfx/effects/pbr.hpp"
 #include "gfx/effects/sky.hpp"
 #include "gfx/effects/hiz.hpp"
+#include "gfx/occlusionCuller.hpp"
+#include "gfx/meshletCuller.hpp"
 #include "base/math.hpp"
+#include "base/time.hpp"
+#include "sys/system.hpp"
+#include "imgui.h"
 
 namespace minote::gfx {
 
@@ -24,17 +30,69 @@ Frame::Frame(Engine& _engine, vuk::RenderGraph& _rg):
 	swapchainPool(_engine.m_swapchainPool),
 	permPool(_engine.m_permPool),
 	models(_engine.m_models),
-	cpu_world(_engine.m_world) {}
+	objectBvh(_engine.m_objectBvh),
+	occlusionCuller(_engine.m_occlusionCuller),
+	meshletCuller(_engine.m_meshletCuller),
+	cpu_world(_engine.m_world),
+	threadPool(_engine.m_threadPool) {}
 
 void Frame::draw(Texture2D _target, ObjectPool& _objects, bool _flush) {
 	
 	// Upload resources
 	
 	world = cpu_world.upload(framePool, "world");
-	auto instances = InstanceList::upload(framePool, *this, "instances", _objects);
-	auto atmosphere = Atmosphere::create(permPool, *this, "earth", Atmosphere::Params::earth());
+	static auto compactObjects = true;
+	ImGui::Checkbox("Compact object updates", &compactObjects);
+	auto objects = ObjectBuffer::update(permPool, *this, "objects", _objects,
+		compactObjects? ObjectBuffer::UpdateFormat::Compact : ObjectBuffer::UpdateFormat::Full);
+	
+	// Skip objects that can't be on screen before they reach the GPU
+	static auto cpuCulling = true;
+	ImGui::Checkbox("CPU frustum culling", &cpuCulling);
+	objectBvh.update(_objects, models);
+	auto visibleObjects = cpuCulling?
+		objectBvh.cullFrustum(_objects, cpu_world.viewProjection) :
+		_objects.visible;
+	
+	// Drop objects hidden behind large occluders
+	static auto cpuOcclusion = true;
+	ImGui::Checkbox("CPU occlusion culling", &cpuOcclusion);
+	if (cpuCulling && cpuOcclusion) {
+		
+		auto occlusionStart = sys::System::getTime();
+		occlusionCuller.cull(threadPool, _objects, objectBvh, models, cpu_world.viewProjection, visibleObjects);
+		ImGui::Text("Occlusion culling: %.3f ms", ratio<f64>(sys::System::getTime() - occlusionStart, 1_ms));
+		
+	}
+	
+	// Meshlet culling can run on the CPU instead, for devices where the GPU
+	// path is too slow. There is no HiZ on the CPU, so it relies on CPU
+	// occlusion culling, and there is no late phase
+	static auto cpuMeshletCulling = false;
+	ImGui::Checkbox("CPU meshlet culling", &cpuMeshletCulling);
 	// Even size simplifies quad-based effects
 	auto viewport = uvec2{u32(alignPOT(_target.size().x(), 2u)), u32(alignPOT(_target.size().y(), 2u))};
+	auto instances = InstanceList();
+	if (cpuMeshletCulling) {
+		
+		auto cullStart = sys::System::getTime();
+		meshletCuller.cull(threadPool, _objects, visibleObjects, models,
+			cpu_world.view, cpu_world.projection, viewport);
+		ImGui::Text("Meshlet culling: %.3f ms", ratio<f64>(sys::System::getTime() - cullStart, 1_ms));
+		
+	} else {
+		
+		// Instance list build can be switched to serial for comparison
+		static auto parallelInstances = true;
+		ImGui::Checkbox("Parallel instance list", &parallelInstances);
+		auto instancesStart = sys::System::getTime();
+		instances = InstanceList::upload(framePool, *this, "instances", _objects, visibleObjects,
+			objects, parallelInstances);
+		ImGui::Text("Instance list: %.3f ms", ratio<f64>(sys::System::getTime() - instancesStart, 1_ms));
+		
+	}
+	
+	auto atmosphere = Atmosphere::create(permPool, *this, "earth", Atmosphere::Params::earth());
 	
 	// Create textures
 	
@@ -91,8 +149,10 @@ void Frame::draw(Texture2D _target, ObjectPool& _objects, bool _flush) {
 	// Create rendering passes
 	
 	// Instance list processing
-	auto screenTriangles = TriangleList::fromInstances(instances, framePool, *this, "screenTriangles",
-		hiz, depth.size(), cpu_world.view, cpu_world.projection);
+	auto screenTriangles = cpuMeshletCulling?
+		TriangleList::fromCulled(framePool, *this, "screenTriangles", objects, meshletCuller) :
+		TriangleList::fromInstances(instances, framePool, *this, "screenTriangles",
+			hiz, depth.size(), cpu_world.view, cpu_world.projection);
 	
 	// Sky generation
 	auto cameraSky = Sky::createView(permPool, *this, "cameraSky", cpu_world.cameraPos, atmosphere);
@@ -107,6 +167,20 @@ void Frame::draw(Texture2D _target, ObjectPool& _objects, bool _flush) {
 	
 	// Drawing
 	Visibility::apply(*this, visbuf, depth, screenTriangles);
+	
+	// Occlusion culling, late phase. Objects rejected against last frame's HiZ
+	// are tested again with one built from what was just drawn
+	if (!cpuMeshletCulling) {
+		
+		auto lateHiz = HiZ::make(framePool, "lateHiz", depth);
+		lateHiz.attach(rg, vuk::eNone, vuk::eNone);
+		HiZ::fill(*this, lateHiz, depth);
+		auto lateTriangles = TriangleList::fromRejected(screenTriangles, framePool, *this, "lateTriangles",
+			lateHiz, depth.size(), cpu_world.view, cpu_world.projection);
+		Visibility::apply(*this, visbuf, depth, lateTriangles);
+		
+	}
+	
 	QuadBuffer::clusterize(*this, quadbuf, visbuf);
 	QuadBuffer::genBuffers(*this, quadbuf, screenTriangles);
 	auto worklist = Worklist::create(swapchainPool, *this, "worklist", quadbuf.visbuf, screenTriangles);
@@ -118,7 +192,7 @@ void Frame::draw(Texture2D _target, ObjectPool& _objects, bool _flush) {
 	// Postprocessing
 	Bloom::apply(*this, swapchainPool, color);
 	Tonemap::apply(*this, color, _target);
-	// BVH::debugDrawAABBs(*this, _target, instances);
+	// BVH::debugDrawAABBs(*this, _target, screenTriangles);
 	
 	// Next-frame tasks
 	HiZ::fill(*this, hiz, depth);
@@ -5,10 +5,14 @@
 #include "gfx/resources/texture2d.hpp"
 #include "gfx/resources/buffer.hpp"
 #include "gfx/resources/pool.hpp"
+#include "gfx/occlusionCuller.hpp"
+#include "gfx/meshletCuller.hpp"
+#include "gfx/objectBvh.hpp"
 #include "gfx/objects.hpp"
 #include "gfx/engine.hpp"
 #include "gfx/models.hpp"
 #include "gfx/world.hpp"
+#include "base/threadPool.hpp"
 #include "base/types.hpp"
 #include "base/math.hpp"
 
@@ -27,7 +31,11 @@ struct Frame {
 	Pool& swapchainPool;
 	Pool& permPool;
 	ModelBuffer& models;
+	ObjectBVH& objectBvh;
+	OcclusionCuller& occlusionCuller;
+	MeshletCuller& meshletCuller;
 	World& cpu_world;
+	ThreadPool& threadPool;
 	Buffer<World> world;
 	
 };
@@ -0,0 +1,453 @@
+#include "gfx/meshletCuller.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include "base/containers/array.hpp"
+#include "base/util.hpp"
+#include "gfx/effects/objectBuffer.hpp"
+#include "gfx/util.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+using namespace base::literals;
+
+// Culling parameters, same as CullingData of the culling shaders
+struct CullingData {
+	mat4 view;
+	vec4 frustum;
+	f32 P00;
+	f32 P11;
+	f32 zNear;
+	vec3 cameraPos;
+	uvec2 viewport;
+	MeshletCuller::HiZ const* hiz;
+};
+
+static auto makeCullingData(mat4 _view, mat4 _projection, uvec2 _viewport,
+	MeshletCuller::HiZ const* _hiz) -> CullingData {
+	
+	auto invView = inverse(_view);
+	auto projectionT = transpose(_projection);
+	auto frustumX = projectionT[3] + projectionT[0];
+	auto frustumY = projectionT[3] + projectionT[1];
+	frustumX = frustumX / length(vec3(frustumX));
+	frustumY = frustumY / length(vec3(frustumY));
+	
+	return CullingData{
+		.view = _view,
+		.frustum = vec4{frustumX.x(), frustumX.z(), frustumY.y(), frustumY.z()},
+		.P00 = _projection[0][0],
+		.P11 = _projection[1][1],
+		.zNear = _projection[3][2],
+		.cameraPos = vec3{invView[3][0], invView[3][1], invView[3][2]},
+		.viewport = _viewport,
+		.hiz = _hiz };
+	
+}
+
+// Functions below mirror their namesakes in the shaders
+
+// From instanceList/indices.glsl
+static auto packTriangle(array<u32, 3> const& _indices) -> u32 {
+	
+	return _indices[0] | (_indices[1] << 8) | (_indices[2] << 16);
+	
+}
+
+// Object transform as a matrix, like getTransform() in types.glsl
+static auto getTransform(ObjectBuffer::Transform const& _t) -> mat4 {
+	
+	return mat4{
+		_t[0].x(), _t[1].x(), _t[2].x(), 0.0f,
+		_t[0].y(), _t[1].y(), _t[2].y(), 0.0f,
+		_t[0].z(), _t[1].z(), _t[2].z(), 0.0f,
+		_t[0].w(), _t[1].w(), _t[2].w(), 1.0f};
+	
+}
+
+// 2D Polyhedral Bounds of a Clipped, Perspective-Projected 3D Sphere. Michael Mara, Morgan McGuire. 2013
+static auto projectSphere(vec3 _c, f32 _r, f32 _znear, f32 _P00, f32 _P11, vec4& _aabb) -> bool {
+	
+	if (_c.z() < _r + _znear)
+		return false;
+	
+	auto cx = vec2{-_c.x(), -_c.z()};
+	auto vx = vec2{std::sqrt(dot(cx, cx) - _r * _r), _r};
+	auto minx = vec2{vx.x() * cx.x() - vx.y() * cx.y(), vx.y() * cx.x() + vx.x() * cx.y()};
+	auto maxx = vec2{vx.x() * cx.x() + vx.y() * cx.y(), -vx.y() * cx.x() + vx.x() * cx.y()};
+	
+	auto cy = vec2{-_c.y(), -_c.z()};
+	auto vy = vec2{std::sqrt(dot(cy, cy) - _r * _r), _r};
+	auto miny = vec2{vy.x() * cy.x() - vy.y() * cy.y(), vy.y() * cy.x() + vy.x() * cy.y()};
+	auto maxy = vec2{vy.x() * cy.x() + vy.y() * cy.y(), -vy.y() * cy.x() + vy.x() * cy.y()};
+	
+	auto clip = vec4{
+		minx.x() / minx.y() * _P00, miny.x() / miny.y() * _P11,
+		maxx.x() / maxx.y() * _P00, maxy.x() / maxy.y() * _P11};
+	_aabb = vec4{ // clip space -> uv space
+		clip.x() * 0.5f + 0.5f, clip.w() * -0.5f + 0.5f,
+		clip.z() * 0.5f + 0.5f, clip.y() * -0.5f + 0.5f};
+	
+	return true;
+	
+}
+
+static auto transformScale(mat4 const& _transform) -> f32 {
+	
+	return std::max({
+		length(vec3(_transform[0])),
+		length(vec3(_transform[1])),
+		length(vec3(_transform[2]))});
+	
+}
+
+static void transformSphere(mat4 const& _transform, vec3& _center, f32& _radius) {
+	
+	_center = vec3(_transform * vec4(_center, 1.0f));
+	_radius *= transformScale(_transform);
+	
+}
+
+// From instanceList/cullObjects
+static auto selectLod(CullingData const& _data, ModelBuffer const& _models, Model const& _model,
+	vec3 _center, f32 _radius, f32 _scale) -> u32 {
+	
+	auto viewCenter = vec3(_data.view * vec4(_center, 1.0f));
+	auto distance = std::max(length(viewCenter) - _radius, _data.zNear);
+	auto pixelsPerUnit = _data.P11 * f32(_data.viewport.y()) * 0.5f / distance;
+	
+	auto lodIdx = _model.lodOffset;
+	for (auto i: iota(1u, _model.lodCount)) {
+		
+		if (_models.cpu_lods[_model.lodOffset + i].error * _scale * pixelsPerUnit > LodMaxScreenError)
+			break;
+		lodIdx = _model.lodOffset + i;
+		
+	}
+	return lodIdx;
+	
+}
+
+static auto isSphereInFrustum(CullingData const& _data, vec3 _center, f32 _radius) -> bool {
+	
+	auto viewCenter = vec3(_data.view * vec4(_center, 1.0f));
+	return
+		(viewCenter.z() * _data.frustum[1] - std::abs(viewCenter.x()) * _data.frustum[0] > -_radius) &&
+		(viewCenter.z() * _data.frustum[3] - std::abs(viewCenter.y()) * _data.frustum[2] > -_radius);
+	
+}
+
+static auto isSphereOccluded(CullingData const& _data, vec3 _center, f32 _radius) -> bool {
+	
+	if (!_data.hiz) return false;
+	auto& hiz = *_data.hiz;
+	
+	auto viewCenter = vec3(_data.view * vec4(_center, 1.0f));
+	viewCenter.y() *= -1.0f;
+	
+	auto aabb = vec4();
+	if (!projectSphere(viewCenter, _radius, _data.zNear, _data.P00, _data.P11, aabb))
+		return false;
+	
+	auto width = (aabb.z() - aabb.x()) * f32(hiz.innerSize.x());
+	auto height = (aabb.w() - aabb.y()) * f32(hiz.innerSize.y());
+	
+	auto level = std::floor(std::log2(std::max(width, height)));
+	auto size = vec2{f32(hiz.size.x()), f32(hiz.size.y())};
+	auto inner = vec2{f32(hiz.innerSize.x()), f32(hiz.innerSize.y())};
+	auto offset = vec2{f32(hiz.size.x() - hiz.innerSize.x()), f32(hiz.size.y() - hiz.innerSize.y())} / 2.0f / size;
+	auto scale = inner / size;
+	
+	auto center = vec2{(aabb.x() + aabb.z()) * 0.5f, (aabb.y() + aabb.w()) * 0.5f};
+	center = vec2{std::clamp(center.x(), 0.0f, 1.0f), std::clamp(center.y(), 0.0f, 1.0f)};
+	auto depth = hiz.sample(center * scale + offset, level);
+	auto depthSphere = _data.zNear / (viewCenter.z() - _radius);
+	
+	return depthSphere <= depth;
+	
+}
+
+auto MeshletCuller::HiZ::make(std::span<f32 const> _depth, uvec2 _depthSize) -> HiZ {
+	
+	auto dim = max(nextPOT(_depthSize.x()), nextPOT(_depthSize.y()));
+	auto result = HiZ{
+		.size = uvec2(dim),
+		.innerSize = _depthSize };
+	result.mips.resize(mipmapCount(dim));
+	
+	// First mip. The depth buffer is placed with the same rounding as
+	// in hiz/first, which works on 32x32 tiles. Texels outside of it
+	// are at the near plane, so they never occlude anything
+	
+	auto shift = [dim](u32 _depthSize) {
+		
+		auto aligned = i32(alignPOT(_depthSize, 32u));
+		auto depthOffset = (i32(_depthSize) - aligned) / 2;
+		auto hizOffset = (i32(dim) - aligned) / 2;
+		return hizOffset - depthOffset;
+		
+	};
+	auto shiftX = shift(_depthSize.x());
+	auto shiftY = shift(_depthSize.y());
+	
+	auto& first = result.mips[0];
+	first.resize(dim * dim);
+	std::fill(first.begin(), first.end(), 1.0f);
+	for (auto y: iota(0u, _depthSize.y()))
+	for (auto x: iota(0u, _depthSize.x())) {
+		
+		auto hizX = i32(x) + shiftX;
+		auto hizY = i32(y) + shiftY;
+		if (hizX < 0 || hizY < 0 || hizX >= i32(dim) || hizY >= i32(dim)) continue;
+		first[hizY * dim + hizX] = _depth[y * _depthSize.x() + x];
+		
+	}
+	
+	// Each following mip keeps the farthest depth of 2x2 texels
+	
+	for (auto mip: iota(1_zu, result.mips.size())) {
+		
+		auto& prev = result.mips[mip - 1];
+		auto& next = result.mips[mip];
+		auto prevDim = dim >> (mip - 1);
+		auto nextDim = dim >> mip;
+		next.resize(nextDim * nextDim);
+		
+		for (auto y: iota(0u, nextDim))
+		for (auto x: iota(0u, nextDim)) {
+			
+			auto* topLeft = &prev[y * 2 * prevDim + x * 2];
+			next[y * nextDim + x] = std::min({
+				topLeft[0], topLeft[1],
+				topLeft[prevDim], topLeft[prevDim + 1]});
+			
+		}
+		
+	}
+	
+	return result;
+	
+}
+
+auto MeshletCuller::HiZ::sample(vec2 _uv, f32 _level) const -> f32 {
+	
+	// Level is clamped to the mip chain, like textureLod() does. Empty
+	// bounds give a level of negative infinity
+	auto mip = _level > 0.0f? u32(std::min(_level, f32(mips.size() - 1))) : 0u;
+	auto dim = i32(max(size.x() >> mip, 1u));
+	auto& texels = mips[mip];
+	
+	auto x = i32(std::floor(_uv.x() * f32(dim) - 0.5f));
+	auto y = i32(std::floor(_uv.y() * f32(dim) - 0.5f));
+	auto x0 = std::clamp(x, 0, dim - 1);
+	auto x1 = std::clamp(x + 1, 0, dim - 1);
+	auto y0 = std::clamp(y, 0, dim - 1);
+	auto y1 = std::clamp(y + 1, 0, dim - 1);
+	
+	return std::min({
+		texels[y0 * dim + x0], texels[y0 * dim + x1],
+		texels[y1 * dim + x0], texels[y1 * dim + x1]});
+	
+}
+
+void MeshletCuller::cull(ThreadPool& _threadPool, ObjectPool const& _objects, bitvector const& _visible,
+	ModelBuffer const& _models, mat4 _view, mat4 _projection, uvec2 _viewport, HiZ const* _hiz) {
+	
+	auto data = makeCullingData(_view, _projection, _viewport, _hiz);
+	auto& buckets = _objects.buckets();
+	
+	auto chunkCount = (_objects.size() + ChunkSize - 1) / ChunkSize;
+	m_chunks.resize(chunkCount);
+	
+	// Call func for each part of a bucket that overlaps [begin, end), with
+	// the bucket's model
+	auto forEachRun = [&](usize _begin, usize _end, auto&& _func) {
+		
+		auto first = std::partition_point(buckets.begin(), buckets.end(), [_begin](auto const& _bucket) {
+			return _bucket.end <= _begin;
+		});
+		for (auto it = first; it != buckets.end() && it->begin < _end; ++it) {
+			
+			if (it->begin == it->end) continue;
+			auto& model = _models.cpu_models[_models.cpu_modelIndices.at(it->modelID)];
+			_func(max(usize(it->begin), _begin), min(usize(it->end), _end), model);
+			
+		}
+		
+	};
+	
+	// Cull objects, pick their LODs, traverse the LODs' group hierarchies,
+	// and cull the meshlets of visible leaves. Same as instanceList/cullObjects,
+	// cullGroups and cullMeshlets
+	
+	_threadPool.parallelFor(chunkCount, [&](usize _chunkIdx) {
+		
+		auto& chunk = m_chunks[_chunkIdx];
+		chunk.instances.clear();
+		auto stack = pvector<u32>();
+		
+		auto begin = _chunkIdx * ChunkSize;
+		auto end = min(begin + ChunkSize, _objects.size());
+		forEachRun(begin, end, [&](usize _runBegin, usize _runEnd, Model const& _model) {
+			
+			if (_model.groupCount == 0) return;
+			
+			_visible.forEachSet(_runBegin, _runEnd, [&](usize idx) {
+				
+				auto transform = getTransform(encodeTransform(_objects.transforms[idx]));
+				auto cameraPos = inverse(mat3(transform)) * (data.cameraPos - vec3(transform[3]));
+				
+				// The object's bounds are those of its most detailed LOD
+				
+				auto& root = _models.cpu_groups[_model.groupOffset];
+				auto rootCenter = root.boundingSphereCenter;
+				auto rootRadius = root.boundingSphereRadius;
+				transformSphere(transform, rootCenter, rootRadius);
+				if (!isSphereInFrustum(data, rootCenter, rootRadius)) return;
+				if (isSphereOccluded(data, rootCenter, rootRadius)) return;
+				
+				auto lodIdx = selectLod(data, _models, _model, rootCenter, rootRadius, transformScale(transform));
+				
+				// The LOD's root is covered by the object's test, like the first
+				// hierarchy level of the early phase
+				
+				stack.clear();
+				stack.push_back(_models.cpu_lods[lodIdx].groupOffset);
+				auto pretested = true;
+				while (!stack.empty()) {
+					
+					auto& group = _models.cpu_groups[stack.back()];
+					stack.pop_back();
+					
+					auto center = group.boundingSphereCenter;
+					auto radius = group.boundingSphereRadius;
+					transformSphere(transform, center, radius);
+					if (!std::exchange(pretested, false)) {
+						
+						if (!isSphereInFrustum(data, center, radius)) continue;
+						if (isSphereOccluded(data, center, radius)) continue;
+						
+					}
+					
+					// Children are pushed in reverse, so that meshlets come out in order
+					
+					if (group.childCount > 0) {
+						
+						for (auto i = group.childCount; i > 0; i -= 1)
+							stack.push_back(group.childOffset + i - 1);
+						continue;
+						
+					}
+					
+					for (auto meshletIdx: iota(group.meshletOffset, group.meshletOffset + group.meshletCount)) {
+						
+						auto& meshlet = _models.cpu_meshlets[meshletIdx];
+						
+						auto meshletCenter = meshlet.boundingSphereCenter;
+						auto meshletRadius = meshlet.boundingSphereRadius;
+						transformSphere(transform, meshletCenter, meshletRadius);
+						if (!isSphereInFrustum(data, meshletCenter, meshletRadius)) continue;
+						if (!(dot(normalize(meshlet.coneApex - cameraPos), meshlet.coneAxis) < meshlet.coneCutoff)) continue;
+						if (isSphereOccluded(data, meshletCenter, meshletRadius)) continue;
+						
+						chunk.instances.push_back(Instance{
+							.objectIdx = u32(idx),
+							.meshletIdx = meshletIdx });
+						
+					}
+					
+				}
+				
+			});
+			
+		});
+		
+	});
+	
+	// Concatenate instances, and list their front-facing triangles.
+	// Same as instanceList/genIndices
+	
+	auto instanceOffsets = pvector<u32>(chunkCount);
+	auto instanceCount = 0u;
+	for (auto i: iota(0_zu, chunkCount)) {
+		
+		instanceOffsets[i] = instanceCount;
+		instanceCount += m_chunks[i].instances.size();
+		
+	}
+	m_instances.resize(instanceCount);
+	
+	_threadPool.parallelFor(chunkCount, [&](usize _chunkIdx) {
+		
+		auto& chunk = m_chunks[_chunkIdx];
+		chunk.triangles.clear();
+		std::copy(chunk.instances.begin(), chunk.instances.end(), m_instances.begin() + instanceOffsets[_chunkIdx]);
+		
+		// Instances of the same object are contiguous
+		auto transformIdx = ~0u;
+		auto transform = mat4();
+		
+		for (auto i: iota(0_zu, chunk.instances.size())) {
+			
+			auto& instance = chunk.instances[i];
+			auto& meshlet = _models.cpu_meshlets[instance.meshletIdx];
+			auto instanceIdx = instanceOffsets[_chunkIdx] + u32(i);
+			if (instance.objectIdx != transformIdx) {
+				
+				transformIdx = instance.objectIdx;
+				transform = getTransform(encodeTransform(_objects.transforms[transformIdx]));
+				
+			}
+			
+			for (auto idx = 0u; idx + 2 < meshlet.indexCount; idx += 3) {
+				
+				auto indices = to_array({
+					_models.cpu_triIndices[meshlet.indexOffset + idx + 0],
+					_models.cpu_triIndices[meshlet.indexOffset + idx + 1],
+					_models.cpu_triIndices[meshlet.indexOffset + idx + 2]});
+				
+				auto vertices = array<vec3, 3>();
+				for (auto v: iota(0_zu, 3_zu)) {
+					
+					auto vertIdx = _models.cpu_vertIndices[indices[v] + meshlet.vertexOffset];
+					vertices[v] = vec3(transform * vec4(_models.cpu_vertices[vertIdx], 1.0f));
+					
+				}
+				
+				// Backface check
+				
+				auto viewDirection = vertices[0] - data.cameraPos;
+				auto normal = cross(vertices[1] - vertices[0], vertices[2] - vertices[0]);
+				if (dot(normal, viewDirection) > 0.0f)
+					continue;
+				
+				chunk.triangles.push_back(uvec2{instanceIdx, packTriangle(indices)});
+				
+			}
+			
+		}
+		
+	});
+	
+	auto triangleOffsets = pvector<usize>(chunkCount);
+	auto triangleCount = 0_zu;
+	for (auto i: iota(0_zu, chunkCount)) {
+		
+		triangleOffsets[i] = triangleCount;
+		triangleCount += m_chunks[i].triangles.size();
+		
+	}
+	m_triangles.resize(triangleCount);
+	
+	_threadPool.parallelFor(chunkCount, [&](usize _chunkIdx) {
+		
+		auto& chunk = m_chunks[_chunkIdx];
+		std::copy(chunk.triangles.begin(), chunk.triangles.end(), m_triangles.begin() + triangleOffsets[_chunkIdx]);
+		
+	});
+	
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <span>
+#include "base/containers/bitvector.hpp"
+#include "base/containers/vector.hpp"
+#include "base/threadPool.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/models.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+
+// CPU implementation of the culling pipeline of TriangleList. Objects, meshlet
+// groups and meshlets are tested against the frustum and optionally a HiZ,
+// meshlets against their normal cones, and the front-facing triangles of
+// the survivors are listed. Each object is drawn with its coarsest LOD whose
+// error stays under LodMaxScreenError. Every test follows its shader step
+// by step, so the output can be used in place of the GPU's. It's not an
+// exact reference: float results can differ from the GPU's in the last ulp,
+// which flips tests right on a boundary, and nothing compares the two
+// yet. The HiZ path is only taken when a HiZ copy is passed in, which
+// Frame doesn't do. Unlike on the GPU, output order is deterministic:
+// instances follow the order of objects, and then of meshlets within
+// each object.
+struct MeshletCuller {
+	
+	// Number of objects processed by a single thread at a time
+	static constexpr auto ChunkSize = 256u;
+	
+	struct Instance {
+		u32 objectIdx;
+		u32 meshletIdx;
+	};
+	
+	// CPU copy of a HiZ, with the same layout as the one built by HiZ::fill:
+	// a square power-of-two mip chain, with the depth buffer in the middle
+	// of the first mip. Texels hold the farthest reverse-Z depth they cover.
+	struct HiZ {
+		
+		uvec2 size; // Size of the first mip
+		uvec2 innerSize; // Size of the depth buffer
+		ivector<pvector<f32>> mips;
+		
+		// Build from a single-sampled depth buffer, stored row by row.
+		static auto make(std::span<f32 const> depth, uvec2 depthSize) -> HiZ;
+		
+		// Minimum of the 2x2 texels that a bilinear sample at the given mip
+		// would read, like a lookup with the MinClamp sampler.
+		[[nodiscard]]
+		auto sample(vec2 uv, f32 level) const -> f32;
+		
+	};
+	
+	// Run the whole pipeline over objects set in visible, which has the same
+	// size as the pool. The viewport size scales LOD errors into pixels.
+	// Without a HiZ, occlusion tests are skipped.
+	void cull(ThreadPool&, ObjectPool const&, bitvector const& visible, ModelBuffer const&,
+		mat4 view, mat4 projection, uvec2 viewport, HiZ const* hiz = nullptr);
+	
+	// Surviving meshlet instances of the last cull().
+	[[nodiscard]]
+	auto instances() const -> std::span<Instance const> { return {m_instances.data(), m_instances.size()}; }
+	
+	// Visible triangles of the last cull(), packed like the output of instanceList/genIndices.
+	[[nodiscard]]
+	auto triangles() const -> std::span<uvec2 const> { return {m_triangles.data(), m_triangles.size()}; }
+	
+private:
+	
+	struct Chunk {
+		pvector<Instance> instances;
+		pvector<uvec2> triangles;
+	};
+	
+	ivector<Chunk> m_chunks; // Kept between calls, to reuse allocations
+	pvector<Instance> m_instances;
+	pvector<uvec2> m_triangles;
+	
+};
+
+}
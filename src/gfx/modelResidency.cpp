@@ -0,0 +1,236 @@
+#include "gfx/modelResidency.hpp"
+
+#include <algorithm>
+#include <utility>
+#include "base/error.hpp"
+#include "base/log.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+
+ModelResidency::ModelResidency(usize _budget):
+	m_budget(_budget),
+	m_residentSize(0),
+	m_updateCounter(0),
+	m_placed(0),
+	m_overBudget(false),
+	m_quitting(false),
+	m_decodePool(DecodeWorkers) {
+	
+	m_loader = std::jthread([this] { loaderLoop(); });
+	
+}
+
+ModelResidency::~ModelResidency() {
+	
+	{
+		
+		auto lock = std::lock_guard(m_loadLock);
+		m_quitting = true;
+		
+	}
+	m_loadRequested.notify_all();
+	m_loader.join();
+	
+}
+
+void ModelResidency::addModel(string_view _name, usize _size, ModelReader _read, bool _occluder) {
+	
+	// Queue into a throwaway list, just to validate the header
+	ModelList().addModel(_name, _size, _read, _occluder);
+	
+	if (!m_indices.emplace(_name, m_entries.size()).second) {
+		
+		L_WARN("Model {} is already in the catalog, ignoring", _name);
+		return;
+		
+	}
+	m_entries.emplace_back(Entry{
+		.name = string(_name),
+		.size = _size,
+		.read = std::move(_read),
+		.occluder = _occluder,
+		.state = State::Unloaded,
+		.lastUsed = 0,
+		.dataSize = 0 });
+	
+}
+
+void ModelResidency::update(ObjectPool const& _objects, ModelBuffer& _models, Pool& _pool) {
+	
+	m_updateCounter += 1;
+	
+	// Give new catalog entries their model index
+	
+	for (; m_placed < m_entries.size(); m_placed += 1)
+		_models.addPlaceholder(m_entries[m_placed].name);
+	
+	// Mark models in use, and request the ones that are missing
+	
+	auto requests = ivector<Request>();
+	for (auto& bucket: _objects.buckets()) {
+		
+		if (bucket.begin == bucket.end) continue;
+		
+		auto modelIdx = m_indices.at(bucket.modelID);
+		auto& entry = m_entries[modelIdx];
+		entry.lastUsed = m_updateCounter;
+		if (entry.state != State::Unloaded) continue;
+		
+		entry.state = State::Loading;
+		requests.emplace_back(Request{
+			.modelIdx = modelIdx,
+			.name = entry.name,
+			.size = entry.size,
+			.read = entry.read,
+			.occluder = entry.occluder });
+		
+	}
+	
+	// Hand over new requests, and take in finished loads
+	
+	auto results = ivector<Result>();
+	{
+		
+		auto lock = std::lock_guard(m_loadLock);
+		for (auto& request: requests)
+			m_requests.emplace_back(std::move(request));
+		results = std::exchange(m_results, {});
+		
+	}
+	if (!requests.empty())
+		m_loadRequested.notify_one();
+	
+	for (auto& result: results) {
+		
+		if (!result.data) {
+			
+			for (auto modelIdx: result.modelIdxs) {
+				
+				auto& entry = m_entries[modelIdx];
+				L_ERROR("Failed to load model {}: {}", entry.name, result.error);
+				entry.state = State::Failed;
+				
+			}
+			continue;
+			
+		}
+		
+		_models.addModels(_pool, *result.data);
+		for (auto modelIdx: result.modelIdxs) {
+			
+			auto& entry = m_entries[modelIdx];
+			entry.state = State::Resident;
+			entry.dataSize = result.data->gpuSize(entry.name);
+			m_residentSize += entry.dataSize;
+			
+		}
+		
+	}
+	
+	// Evict the least recently used models until the budget is met
+	
+	if (m_residentSize > m_budget) {
+		
+		auto candidates = ivector<u32>();
+		for (auto i: iota(0u, u32(m_entries.size()))) {
+			
+			auto& entry = m_entries[i];
+			if (entry.state == State::Resident && entry.lastUsed != m_updateCounter)
+				candidates.push_back(i);
+			
+		}
+		std::sort(candidates.begin(), candidates.end(), [this](u32 _left, u32 _right) {
+			return m_entries[_left].lastUsed < m_entries[_right].lastUsed;
+		});
+		
+		for (auto modelIdx: candidates) {
+			
+			if (m_residentSize <= m_budget) break;
+			
+			auto& entry = m_entries[modelIdx];
+			_models.removeModel(entry.name);
+			m_residentSize -= entry.dataSize;
+			entry.dataSize = 0;
+			entry.state = State::Unloaded;
+			L_DEBUG("Evicted model {}", entry.name);
+			
+		}
+		
+	}
+	
+	// Models in use can't be evicted, so the budget might not be met at all
+	
+	auto overBudget = m_residentSize > m_budget;
+	if (overBudget && !m_overBudget)
+		L_WARN("Models in use take {} bytes, over the budget of {} bytes", m_residentSize, m_budget);
+	m_overBudget = overBudget;
+	
+}
+
+void ModelResidency::loaderLoop() {
+	
+	while (true) {
+		
+		auto requests = ivector<Request>();
+		{
+			
+			auto lock = std::unique_lock(m_loadLock);
+			m_loadRequested.wait(lock, [this] { return m_quitting || !m_requests.empty(); });
+			if (m_quitting) return;
+			requests = std::exchange(m_requests, {});
+			
+		}
+		
+		// Everything requested so far is decoded as one batch. If that fails,
+		// the batch is retried one model at a time, so that only the broken
+		// models are marked as failed
+		
+		auto results = ivector<Result>();
+		auto batch = decode({requests.data(), requests.size()});
+		if (batch.data || requests.size() == 1) {
+			
+			results.emplace_back(std::move(batch));
+			
+		} else {
+			
+			for (auto& request: requests)
+				results.emplace_back(decode({&request, 1}));
+			
+		}
+		
+		auto lock = std::lock_guard(m_loadLock);
+		if (m_quitting) return;
+		for (auto& result: results)
+			m_results.emplace_back(std::move(result));
+		
+	}
+	
+}
+
+auto ModelResidency::decode(std::span<Request const> _requests) -> Result {
+	
+	auto result = Result();
+	for (auto& request: _requests)
+		result.modelIdxs.push_back(request.modelIdx);
+	
+	try {
+		
+		result.data = std::make_unique<ModelList>();
+		for (auto& request: _requests)
+			result.data->addModel(request.name, request.size, request.read, request.occluder);
+		result.data->decodeModels(m_decodePool);
+		
+	} catch (std::exception const& e) {
+		
+		result.data.reset();
+		result.error = e.what();
+		
+	}
+	
+	return result;
+	
+}
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <span>
+#include <mutex>
+#include "base/containers/hashmap.hpp"
+#include "base/containers/string.hpp"
+#include "base/containers/vector.hpp"
+#include "base/threadPool.hpp"
+#include "base/types.hpp"
+#include "base/util.hpp"
+#include "base/id.hpp"
+#include "gfx/resources/pool.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/models.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+using namespace base::literals;
+
+// Catalog of models, of which only the ones in use are kept on the GPU.
+// A model is loaded once an object references it, decoded on a background
+// thread together with the other models requested at the same time, and
+// objects using it are skipped until it's ready. Once resident
+// models exceed the memory budget, the least recently used ones are evicted.
+// Every catalog model is a placeholder in the ModelBuffer until it's loaded,
+// so its model index never changes.
+struct ModelResidency {
+	
+	// Start the loading thread, with a budget in bytes of GPU memory.
+	explicit ModelResidency(usize budget);
+	~ModelResidency();
+	
+	// Add a model to the catalog, without loading it yet. The header is read
+	// right away, so that invalid files are caught early.
+	void addModel(string_view name, usize size, ModelReader read, bool occluder = false);
+	
+	// Mark the models of all objects in the pool as used, request the ones
+	// that aren't loaded, and evict models over the budget. Models used by any
+	// object are never evicted. The ModelBuffer is updated with new catalog
+	// entries, finished loads and evictions, one model at a time.
+	void update(ObjectPool const&, ModelBuffer&, Pool&);
+	
+	[[nodiscard]]
+	auto budget() const -> usize { return m_budget; }
+	void setBudget(usize budget) { m_budget = budget; }
+	
+	// GPU memory used by resident models, in bytes.
+	[[nodiscard]]
+	auto residentSize() const -> usize { return m_residentSize; }
+	
+	// Not copyable, not movable
+	ModelResidency(ModelResidency const&) = delete;
+	auto operator=(ModelResidency const&) -> ModelResidency& = delete;
+	ModelResidency(ModelResidency&&) = delete;
+	auto operator=(ModelResidency&&) -> ModelResidency& = delete;
+	
+private:
+	
+	// Threads decoding a batch, besides the loading thread. The frame's pool
+	// is not used, since a job holds its pool until every call is done
+	static constexpr auto DecodeWorkers = 3u;
+	
+	enum struct State {
+		Unloaded,
+		Loading,
+		Resident,
+		Failed, // Never retried
+	};
+	
+	struct Entry {
+		
+		string name;
+		usize size;
+		ModelReader read;
+		bool occluder;
+		
+		State state;
+		u64 lastUsed; // Update counter of the last update() that saw it in use
+		usize dataSize; // GPU memory, while resident
+		
+	};
+	
+	// Entries are only accessed by the thread calling update(), so requests
+	// carry their own copy of what the loading thread needs
+	struct Request {
+		
+		u32 modelIdx;
+		string name;
+		usize size;
+		ModelReader read;
+		bool occluder;
+		
+	};
+	
+	struct Result {
+		
+		ivector<u32> modelIdxs; // Models decoded together into data
+		std::unique_ptr<ModelList> data; // Null if loading failed
+		string error;
+		
+	};
+	
+	ivector<Entry> m_entries;
+	hashmap<ID, u32> m_indices;
+	usize m_budget;
+	usize m_residentSize;
+	u64 m_updateCounter;
+	u32 m_placed; // Number of entries that have a placeholder in the ModelBuffer
+	bool m_overBudget;
+	
+	std::mutex m_loadLock;
+	std::condition_variable m_loadRequested;
+	ivector<Request> m_requests;
+	ivector<Result> m_results;
+	bool m_quitting;
+	ThreadPool m_decodePool;
+	std::jthread m_loader;
+	
+	void loaderLoop();
+	
+	// Decode a batch of requests into a single list, spread across the decode pool.
+	auto decode(std::span<Request const>) -> Result;
+	
+};
+
+}
@@ -1,9 +1,11 @@
 #include "gfx/models.hpp"
 
+#include <algorithm>
 #include <utility>
+#include <limits>
 #include <cassert>
 #include <cstring>
-#include "mpack/mpack.h"
+#include <array>
 #include "gfx/util.hpp"
 #include "base/error.hpp"
 #include "base/util.hpp"
@@ -15,213 +17,737 @@ using namespace base;
 using namespace base::literals;
 using namespace tools;
 
-void ModelList::addModel(string_view _name, std::span<char const> _model) {
+// Check that a section lies within a model file of the given size.
+template<typename T>
+static void checkSection(usize _size, ModelSection _section, string_view _name, string_view _sectionName) {
 	
-	// Load in data
+	if (_section.offset % ModelSectionAlign != 0 ||
+		u64(_section.offset) + u64(_section.count) * sizeof(T) > _size)
+		throw runtime_error_fmt("Invalid {} section of model {}", _sectionName, _name);
 	
-	auto in = mpack_reader_t();
-	mpack_reader_init_data(&in, _model.data(), _model.size_bytes());
+}
+
+// Read a section straight into its destination, which has identical layout.
+template<typename T, typename U>
+static void readSection(ModelReader const& _read, ModelSection _section, U* _dst) {
 	
-	if (auto magic = mpack_expect_u32(&in); magic != ModelMagic)
-		throw runtime_error_fmt("Wrong magic number of model {}: got {}, expected {}", _name, magic, ModelMagic);
+	static_assert(sizeof(U) == sizeof(T));
 	
-	mpack_expect_map_match(&in, 6);
+	if (_section.count)
+		_read(_section.offset, {reinterpret_cast<char*>(_dst), _section.count * sizeof(T)});
 	
-	// Load the materials
+}
+
+// Stream a section through a small buffer, for sections that need to be
+// converted on the way in. The function is called with each chunk of elements
+// and the index of its first element.
+template<typename T, typename F>
+static void readSectionChunked(ModelReader const& _read, ModelSection _section, F&& _func) {
+	
+	constexpr auto ChunkSize = max(usize(ModelReadChunkSize / sizeof(T)), 1_zu);
+	auto chunk = std::array<T, ChunkSize>();
+	for (auto i = 0_zu; i < _section.count; i += ChunkSize) {
+		
+		auto count = min(ChunkSize, _section.count - i);
+		_read(_section.offset + i * sizeof(T), {reinterpret_cast<char*>(chunk.data()), count * sizeof(T)});
+		_func(std::span<T const>(chunk.data(), count), u32(i));
+		
+	}
+	
+}
+
+void ModelList::addModel(string_view _name, usize _size, ModelReader _read, bool _occluder) {
+	
+	// Validate the header and section bounds
+	
+	auto header = ModelHeader();
+	if (_size < sizeof(header))
+		throw runtime_error_fmt("Model {} is too small: {} bytes", _name, _size);
+	_read(0, {reinterpret_cast<char*>(&header), sizeof(header)});
+	
+	if (header.magic != ModelMagic)
+		throw runtime_error_fmt("Wrong magic number of model {}: got {}, expected {}", _name, header.magic, ModelMagic);
+	if (header.version != ModelVersion)
+		throw runtime_error_fmt("Unsupported version of model {}: got {}, expected {}", _name, header.version, ModelVersion);
+	
+	checkSection<ModelMaterial>(_size, header.materials, _name, "materials");
+	checkSection<ModelMeshlet>(_size, header.meshlets, _name, "meshlets");
+	checkSection<ModelAABB>(_size, header.meshletAABBs, _name, "meshletAABBs");
+	checkSection<ModelMeshletGroup>(_size, header.groups, _name, "groups");
+	checkSection<tools::ModelLod>(_size, header.lods, _name, "lods");
+	checkSection<TriIndexType>(_size, header.triIndices, _name, "triIndices");
+	checkSection<VertIndexType>(_size, header.vertIndices, _name, "vertIndices");
+	checkSection<VertexType>(_size, header.vertices, _name, "vertices");
+	checkSection<NormalType>(_size, header.normals, _name, "normals");
+	
+	if (header.meshletAABBs.count != header.meshlets.count || header.normals.count != header.vertices.count)
+		throw runtime_error_fmt("Mismatched section sizes in model {}", _name);
+	if (header.lods.count > ModelMaxLods || (header.lods.count == 0 && header.meshlets.count > 0))
+		throw runtime_error_fmt("Invalid LOD count of model {}: {}", _name, header.lods.count);
+	
+	m_pending.emplace_back(PendingModel{
+		.name = string(_name),
+		.header = header,
+		.read = std::move(_read),
+		.occluder = _occluder });
+	
+}
+
+void ModelList::layoutPending() {
 	
-	auto materialOffset = m_materials.size();
+	auto materialCount = u64(m_materials.size());
+	auto meshletCount = u64(m_meshlets.size());
+	auto groupCount = u64(m_groups.size());
+	auto lodCount = u64(m_lods.size());
+	auto triIndexCount = u64(m_triIndices.size());
+	auto vertIndexCount = u64(m_vertIndices.size());
+	auto vertexCount = u64(m_vertices.size());
 	
-	mpack_expect_cstr_match(&in, "materials");
-	auto materialCount = mpack_expect_array(&in);
-	m_materials.reserve(m_materials.size() + materialCount);
-	for (auto i: iota(0u, materialCount)) {
+	for (auto& pending: m_pending) {
 		
-		auto& material = m_materials.emplace_back();
-		material.id = +MaterialType::PBR;
+		auto& header = pending.header;
+		pending.modelIdx = m_models.size();
 		
-		mpack_expect_map_match(&in, 4);
+		m_modelIndices.emplace(pending.name, m_models.size());
+		m_models.emplace_back(Model{
+			.meshletOffset = u32(meshletCount),
+			.meshletCount = header.meshlets.count,
+			.groupOffset = u32(groupCount),
+			.groupCount = header.groups.count,
+			.lodOffset = u32(lodCount),
+			.lodCount = header.lods.count });
+		m_modelRanges.emplace_back(ModelDataRanges{
+			.materialOffset = u32(materialCount),
+			.materialCount = max(header.materials.count, 1u), // Room for the fallback material
+			.triIndexOffset = u32(triIndexCount),
+			.triIndexCount = header.triIndices.count,
+			.vertIndexOffset = u32(vertIndexCount),
+			.vertIndexCount = header.vertIndices.count,
+			.vertexOffset = u32(vertexCount),
+			.vertexCount = header.vertices.count });
+		m_modelGroupDepths.emplace_back(0);
+		m_occluders.emplace_back();
 		
-		mpack_expect_cstr_match(&in, "color");
-		mpack_expect_array_match(&in, 4);
-		material.color[0] = mpack_expect_float(&in);
-		material.color[1] = mpack_expect_float(&in);
-		material.color[2] = mpack_expect_float(&in);
-		material.color[3] = mpack_expect_float(&in);
-		mpack_done_array(&in);
+		materialCount += max(header.materials.count, 1u);
+		meshletCount += header.meshlets.count;
+		groupCount += header.groups.count;
+		lodCount += header.lods.count;
+		triIndexCount += header.triIndices.count;
+		vertIndexCount += header.vertIndices.count;
+		vertexCount += header.vertices.count;
 		
-		mpack_expect_cstr_match(&in, "emissive");
-		mpack_expect_array_match(&in, 3);
-		material.emissive[0] = mpack_expect_float(&in);
-		material.emissive[1] = mpack_expect_float(&in);
-		material.emissive[2] = mpack_expect_float(&in);
-		mpack_done_array(&in);
+	}
+	
+	// All offsets within the unified buffers are 32-bit
+	constexpr auto Limit = u64(std::numeric_limits<u32>::max());
+	if (materialCount > Limit || meshletCount > Limit || groupCount > Limit || lodCount > Limit ||
+		triIndexCount > Limit || vertIndexCount > Limit || vertexCount > Limit)
+		throw runtime_error_fmt("Models are too large to be stored together");
+	
+	m_materials.resize(materialCount);
+	m_meshlets.resize(meshletCount);
+	m_meshletAABBs.resize(meshletCount);
+	m_groups.resize(groupCount);
+	m_lods.resize(lodCount);
+	m_triIndices.resize(triIndexCount);
+	m_vertIndices.resize(vertIndexCount);
+	m_vertices.resize(vertexCount);
+	m_normals.resize(vertexCount);
+	
+}
+
+void ModelList::decodeModels(ThreadPool& _threadPool) {
+	
+	// Readers are released even if decoding fails
+	defer { m_pending.clear(); };
+	
+	layoutPending();
+	
+	// Decode concurrently. Each model only writes into its own ranges
+	
+	_threadPool.parallelFor(m_pending.size(), [this](usize i) {
 		
-		mpack_expect_cstr_match(&in, "metalness");
-		material.metalness = mpack_expect_float(&in);
-		mpack_expect_cstr_match(&in, "roughness");
-		material.roughness = mpack_expect_float(&in);
+		auto& pending = m_pending[i];
+		m_modelGroupDepths[pending.modelIdx] = decodeModel(pending);
 		
-		mpack_done_map(&in);
+	});
+	
+}
+
+void ModelList::decodeModels() {
+	
+	defer { m_pending.clear(); };
+	
+	layoutPending();
+	for (auto& pending: m_pending)
+		m_modelGroupDepths[pending.modelIdx] = decodeModel(pending);
+	
+}
+
+auto ModelList::gpuSize() const -> usize {
+	
+	return
+		m_materials.size() * sizeof(Material) +
+		m_triIndices.size() * sizeof(u32) +
+		m_vertIndices.size() * sizeof(VertIndexType) +
+		m_vertices.size() * sizeof(VertexType) +
+		m_normals.size() * sizeof(NormalType) +
+		m_meshlets.size() * sizeof(Meshlet) +
+		m_groups.size() * sizeof(MeshletGroup) +
+		m_lods.size() * sizeof(ModelLod) +
+		m_models.size() * sizeof(Model);
+	
+}
+
+auto ModelList::gpuSize(string_view _name) const -> usize {
+	
+	auto modelIdx = m_modelIndices.at(ID(_name));
+	auto& model = m_models[modelIdx];
+	auto& ranges = m_modelRanges[modelIdx];
+	return
+		ranges.materialCount * sizeof(Material) +
+		ranges.triIndexCount * sizeof(u32) +
+		ranges.vertIndexCount * sizeof(VertIndexType) +
+		ranges.vertexCount * sizeof(VertexType) +
+		ranges.vertexCount * sizeof(NormalType) +
+		model.meshletCount * sizeof(Meshlet) +
+		model.groupCount * sizeof(MeshletGroup) +
+		model.lodCount * sizeof(ModelLod) +
+		sizeof(Model);
+	
+}
+
+auto ModelList::decodeModel(PendingModel const& _pending) -> u32 {
+	
+	auto& header = _pending.header;
+	auto& read = _pending.read;
+	auto name = string_view(_pending.name);
+	auto& model = m_models[_pending.modelIdx];
+	auto& ranges = m_modelRanges[_pending.modelIdx];
+	
+	auto materialCount = header.materials.count;
+	auto meshletCount = header.meshlets.count;
+	auto groupCount = header.groups.count;
+	auto triIndexCount = header.triIndices.count;
+	auto vertIndexCount = header.vertIndices.count;
+	auto vertexCount = header.vertices.count;
+	
+	// Load the materials
+	
+	readSectionChunked<ModelMaterial>(read, header.materials, [&](auto _materials, u32 _first) {
 		
-	}
-	mpack_done_array(&in);
+		for (auto i: iota(0_zu, _materials.size())) {
+			
+			auto& src = _materials[i];
+			auto& material = m_materials[ranges.materialOffset + _first + i];
+			material.id = +MaterialType::PBR;
+			material.color = src.color;
+			material.emissive = src.emissive;
+			material.metalness = src.metalness;
+			material.roughness = src.roughness;
+			
+		}
+		
+	});
 	
 	// Safety fallback
 	if (materialCount == 0) {
 		
-		auto& material = m_materials.emplace_back();
+		auto& material = m_materials[ranges.materialOffset];
 		material.id = +MaterialType::PBR;
 		material.color = {1.0f, 1.0f, 1.0f, 1.0f};
 		material.emissive = {0.0f, 0.0f, 0.0f};
 		material.metalness = 0.0f;
 		material.roughness = 0.0f;
-		L_WARN("Model {} has no materials, using defaults", _name);
+		L_WARN("Model {} has no materials, using defaults", name);
 		
 	}
 	
-	// Load the meshlets
+	// Load the meshlets, rebasing all offsets onto the unified buffers
 	
-	m_modelIndices.emplace(_name, m_models.size());
-	auto& model = m_models.emplace_back(Model{
-		.meshletOffset = u32(m_meshlets.size()),
-		.meshletCount = 0 });
+	readSectionChunked<ModelMeshlet>(read, header.meshlets, [&](auto _meshlets, u32 _first) {
+		
+		for (auto i: iota(0_zu, _meshlets.size())) {
+			
+			auto& src = _meshlets[i];
+			if (src.materialIdx >= max(materialCount, 1u) ||
+				u64(src.indexOffset) + src.indexCount > triIndexCount)
+				throw runtime_error_fmt("Invalid meshlet {} of model {}", _first + i, name);
+			
+			m_meshlets[model.meshletOffset + _first + i] = Meshlet{
+				.materialIdx = ranges.materialOffset + src.materialIdx,
+				.indexOffset = ranges.triIndexOffset + src.indexOffset,
+				.indexCount = src.indexCount,
+				.vertexOffset = ranges.vertIndexOffset + src.vertexOffset,
+				.boundingSphereCenter = src.boundingSphereCenter,
+				.boundingSphereRadius = src.boundingSphereRadius,
+				.coneApex = src.coneApex,
+				.coneCutoff = src.coneCutoff,
+				.coneAxis = src.coneAxis };
+			
+		}
+		
+	});
+	
+	readSection<ModelAABB>(read, header.meshletAABBs, m_meshletAABBs.data() + model.meshletOffset);
 	
-	mpack_expect_cstr_match(&in, "meshlets");
-	auto meshletCount = mpack_expect_array(&in);
-	model.meshletCount += meshletCount;
-	for (auto i: iota(0u, meshletCount)) {
+	// Load the meshlet groups
+	
+	auto groupDepth = 0u;
+	auto groupDepths = pvector<u32>(groupCount, 1);
+	readSectionChunked<ModelMeshletGroup>(read, header.groups, [&](auto _groups, u32 _first) {
 		
-		mpack_expect_map_match(&in, 8);
+		for (auto i: iota(0_zu, _groups.size())) {
+			
+			auto& src = _groups[i];
+			auto idx = _first + i;
+			
+			// Children always come after their parent
+			if (src.childCount && (src.childOffset <= idx || u64(src.childOffset) + src.childCount > groupCount))
+				throw runtime_error_fmt("Invalid meshlet group hierarchy in model {}", name);
+			if (u64(src.meshletOffset) + src.meshletCount > meshletCount)
+				throw runtime_error_fmt("Invalid meshlet group {} of model {}", idx, name);
+			for (auto j: iota(src.childOffset, src.childOffset + src.childCount))
+				groupDepths[j] = groupDepths[idx] + 1;
+			groupDepth = max(groupDepth, groupDepths[idx]);
+			
+			m_groups[model.groupOffset + idx] = MeshletGroup{
+				.boundingSphereCenter = src.boundingSphereCenter,
+				.boundingSphereRadius = src.boundingSphereRadius,
+				.childOffset = model.groupOffset + src.childOffset,
+				.childCount = src.childCount,
+				.meshletOffset = model.meshletOffset + src.meshletOffset,
+				.meshletCount = src.meshletCount };
+			
+		}
 		
-		auto& meshlet = m_meshlets.emplace_back();
-		auto& aabb = m_meshletAABBs.emplace_back();
+	});
+	
+	// Load the LODs
+	
+	readSectionChunked<tools::ModelLod>(read, header.lods, [&](auto _lods, u32 _first) {
 		
-		mpack_expect_cstr_match(&in, "materialIdx");
-		auto materialIdx = mpack_expect_u32(&in);
-		meshlet.materialIdx = materialOffset + materialIdx;
+		for (auto i: iota(0_zu, _lods.size())) {
+			
+			// Every LOD has its own hierarchy root
+			auto& src = _lods[i];
+			if (src.groupOffset >= groupCount || groupDepths[src.groupOffset] != 1 ||
+				u64(src.meshletOffset) + src.meshletCount > meshletCount)
+				throw runtime_error_fmt("Invalid LOD {} of model {}", _first + i, name);
+			
+			m_lods[model.lodOffset + _first + i] = ModelLod{
+				.groupOffset = model.groupOffset + src.groupOffset,
+				.meshletOffset = model.meshletOffset + src.meshletOffset,
+				.meshletCount = src.meshletCount,
+				.error = src.error };
+			
+		}
 		
-		mpack_expect_cstr_match(&in, "indexOffset");
-		auto indexOffset = mpack_expect_u32(&in);
-		meshlet.indexOffset = indexOffset + m_triIndices.size();
+	});
+	
+	// Load the index and vertex data. Triangle indices are widened to match
+	// the GPU buffer, and vertex indices are offset for the unified buffer
+	
+	static_assert(sizeof(TriIndexType) == 1);
+	readSectionChunked<TriIndexType>(read, header.triIndices, [&](auto _indices, u32 _first) {
 		
-		mpack_expect_cstr_match(&in, "indexCount");
-		auto indexCount = mpack_expect_u32(&in);
-		meshlet.indexCount = indexCount;
+		std::copy(_indices.begin(), _indices.end(), m_triIndices.begin() + ranges.triIndexOffset + _first);
 		
-		mpack_expect_cstr_match(&in, "vertexOffset");
-		auto vertexOffset = mpack_expect_u32(&in);
-		meshlet.vertexOffset = vertexOffset + m_vertIndices.size();
+	});
+	
+	auto* vertIndices = m_vertIndices.data() + ranges.vertIndexOffset;
+	readSection<VertIndexType>(read, header.vertIndices, vertIndices);
+	for (auto i: iota(0u, vertIndexCount)) {
 		
-		mpack_expect_cstr_match(&in, "boundingSphereCenter");
-		mpack_expect_array_match(&in, 3);
-		for (auto i: iota(0, 3))
-			meshlet.boundingSphereCenter[i] = mpack_expect_float(&in);
-		mpack_done_array(&in);
+		if (vertIndices[i] >= vertexCount)
+			throw runtime_error_fmt("Invalid vertex index {} of model {}", i, name);
+		vertIndices[i] += ranges.vertexOffset;
 		
-		mpack_expect_cstr_match(&in, "boundingSphereRadius");
-		meshlet.boundingSphereRadius = mpack_expect_float(&in);
+	}
+	
+	readSection<VertexType>(read, header.vertices, m_vertices.data() + ranges.vertexOffset);
+	readSection<NormalType>(read, header.normals, m_normals.data() + ranges.vertexOffset);
+	
+	// Triangles can only be checked once both index sections are in
+	for (auto i: iota(model.meshletOffset, model.meshletOffset + meshletCount)) {
 		
-		mpack_expect_cstr_match(&in, "aabbMin");
-		mpack_expect_array_match(&in, 3);
-		for (auto i: iota(0, 3))
-			aabb.min[i] = mpack_expect_float(&in);
-		mpack_done_array(&in);
+		auto& meshlet = m_meshlets[i];
+		for (auto j: iota(meshlet.indexOffset, meshlet.indexOffset + meshlet.indexCount))
+			if (u64(meshlet.vertexOffset) + m_triIndices[j] >= ranges.vertIndexOffset + u64(vertIndexCount))
+				throw runtime_error_fmt("Invalid meshlet {} of model {}", i - model.meshletOffset, name);
 		
-		mpack_expect_cstr_match(&in, "aabbMax");
-		mpack_expect_array_match(&in, 3);
-		for (auto i: iota(0, 3))
-			aabb.max[i] = mpack_expect_float(&in);
-		mpack_done_array(&in);
+	}
+	
+	// Flatten the meshlets into a plain triangle list
+	
+	if (_pending.occluder && model.lodCount) {
 		
-		mpack_done_map(&in);
+		auto& occluder = m_occluders[_pending.modelIdx];
+		auto& lod = m_lods[model.lodOffset];
+		for (auto i: iota(lod.meshletOffset, lod.meshletOffset + lod.meshletCount)) {
+			
+			auto& meshlet = m_meshlets[i];
+			for (auto j: iota(meshlet.indexOffset, meshlet.indexOffset + meshlet.indexCount))
+				occluder.push_back(m_vertices[m_vertIndices[meshlet.vertexOffset + m_triIndices[j]]]);
+			
+		}
 		
 	}
-	mpack_done_array(&in);
-	
-	mpack_expect_cstr_match(&in, "triIndices");
-	auto triIndexCount = mpack_expect_bin(&in) / sizeof(TriIndexType);
-	auto triIndices = pvector<TriIndexType>(triIndexCount);
-	mpack_read_bytes(&in, reinterpret_cast<char*>(triIndices.data()), triIndexCount * sizeof(TriIndexType));
-	m_triIndices.insert(m_triIndices.end(), triIndices.begin(), triIndices.end());
-	mpack_done_bin(&in);
-	
-	mpack_expect_cstr_match(&in, "vertIndices");
-	auto vertIndexCount = mpack_expect_bin(&in) / sizeof(VertIndexType);
-	auto vertIndices = pvector<VertIndexType>(vertIndexCount);
-	mpack_read_bytes(&in, reinterpret_cast<char*>(vertIndices.data()), vertIndexCount * sizeof(VertIndexType));
-	for (auto& v: vertIndices) // Offset values for the unified buffer
-		v += m_vertices.size();
-	m_vertIndices.insert(m_vertIndices.end(), vertIndices.begin(), vertIndices.end());
-	mpack_done_bin(&in);
-	
-	mpack_expect_cstr_match(&in, "vertices");
-	auto vertexCount = mpack_expect_bin(&in) / sizeof(VertexType);
-	auto vertexOffset = m_vertices.size();
-	m_vertices.resize(vertexOffset + vertexCount);
-	auto* verticesIt = &m_vertices[vertexOffset];
-	mpack_read_bytes(&in, reinterpret_cast<char*>(verticesIt), vertexCount * sizeof(VertexType));
-	mpack_done_bin(&in);
-	
-	mpack_expect_cstr_match(&in, "normals");
-	auto normalCount = mpack_expect_bin(&in) / sizeof(NormalType);
-	auto normalOffset = m_normals.size();
-	m_normals.resize(normalOffset + normalCount);
-	auto* normalsIt = &m_normals[normalOffset];
-	mpack_read_bytes(&in, reinterpret_cast<char*>(normalsIt), normalCount * sizeof(NormalType));
-	mpack_done_bin(&in);
-	
-	mpack_done_map(&in);
-	mpack_reader_destroy(&in);
-	
-	L_DEBUG("Loaded model {}: {} materials, {} meshlets", _name, materialCount, model.meshletCount);
+	
+	L_DEBUG("Loaded model {}: {} materials, {} meshlets, {} meshlet groups, {} LODs",
+		name, materialCount, model.meshletCount, model.groupCount, model.lodCount);
+	
+	return groupDepth;
+	
+}
+
+// Storage buffer with the given contents. Buffers can't be empty, so there is
+// always room for at least one element.
+template<typename T>
+static auto makeModelBuffer(Pool& _pool, vuk::Name _name, std::span<T const> _data, usize _capacity = 0) -> Buffer<T> {
+	
+	return Buffer<T>::make(_pool, _name, vuk::BufferUsageFlagBits::eStorageBuffer,
+		_data, max(max(_data.size(), _capacity), 1_zu));
+	
+}
+
+// Replace a buffer with a larger one under the same name, filled from the CPU
+// copy of its contents. Mapped memory is write-combined, so it's never read
+// back. The old buffer is destroyed once no frame in flight can be using it.
+template<typename T, typename C>
+static void growBuffer(Pool& _pool, Buffer<T>& _buffer, C const& _contents, u32 _capacity) {
+	
+	auto name = _buffer.name;
+	_pool.erase(name);
+	_buffer = makeModelBuffer<T>(_pool, name, std::span<T const>(_contents.data(), _contents.size()), _capacity);
+	
+}
+
+// Allocate a range. If no free range fits, the capacity is doubled and grow is
+// called with the new capacity, to resize all storage of the range.
+template<typename F>
+static auto allocateRange(RangeAllocator& _ranges, u32 _count, F&& _grow) -> u32 {
+	
+	if (auto offset = _ranges.allocate(_count)) return *offset;
+	
+	constexpr auto Limit = u64(std::numeric_limits<u32>::max());
+	auto capacity = min(max(u64(_ranges.capacity()) * 2, u64(_ranges.capacity()) + _count), Limit);
+	if (capacity < u64(_ranges.capacity()) + _count)
+		throw runtime_error_fmt("Models are too large to be stored together");
+	
+	_grow(u32(capacity));
+	_ranges.grow(u32(capacity));
+	return *_ranges.allocate(_count);
+	
+}
+
+// Copy elements into a range of a mapped buffer.
+template<typename T>
+static void uploadRange(Buffer<T>& _buffer, u32 _offset, T const* _data, u32 _count) {
+	
+	if (_count == 0) return;
+	std::memcpy(_buffer.mappedPtr() + _offset, _data, _count * sizeof(T));
 	
 }
 
 auto ModelList::upload(Pool& _pool, vuk::Name _name) && -> ModelBuffer {
 	
-	auto result = ModelBuffer{
-		.materials = Buffer<Material>::make(_pool, nameAppend(_name, "materials"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_materials),
-		.triIndices = Buffer<u32>::make(_pool, nameAppend(_name, "triIndices"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_triIndices),
-		.vertIndices = Buffer<VertIndexType>::make(_pool, nameAppend(_name, "vertIndices"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_vertIndices),
-		.vertices = Buffer<VertexType>::make(_pool, nameAppend(_name, "vertices"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_vertices),
-		.normals = Buffer<NormalType>::make(_pool, nameAppend(_name, "normals"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_normals),
-		.meshlets = Buffer<Meshlet>::make(_pool, nameAppend(_name, "meshlets"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_meshlets),
-		.models = Buffer<Model>::make(_pool, nameAppend(_name, "models"),
-			vuk::BufferUsageFlagBits::eStorageBuffer,
-			m_models),
-		.cpu_modelIndices = std::move(m_modelIndices) };
-	result.cpu_meshlets = std::move(m_meshlets); // Must still exist for .meshlets creation
-	result.cpu_meshletAABBs = std::move(m_meshletAABBs);
-	result.cpu_models = std::move(m_models);
+	auto result = ModelBuffer::make(_pool, _name);
+	result.addModels(_pool, *this);
+	result.flush(_pool);
 	
 	// Clean up in case this isn't a temporary
+	*this = ModelList();
+	
+	L_DEBUG("Uploaded all models to GPU");
+	return result;
+	
+}
+
+auto ModelBuffer::make(Pool& _pool, vuk::Name _name) -> ModelBuffer {
+	
+	auto result = ModelBuffer();
 	
-	m_materials.clear();
-	m_materials.shrink_to_fit();
-	m_triIndices.clear();
-	m_triIndices.shrink_to_fit();
-	m_vertIndices.clear();
-	m_vertIndices.shrink_to_fit();
-	m_vertices.clear();
-	m_vertices.shrink_to_fit();
-	m_normals.clear();
-	m_normals.shrink_to_fit();
+	// Start from scratch, even if the pool held buffers by these names
+	auto makeEmpty = [&_pool]<typename T>(Buffer<T>& _buffer, vuk::Name _bufferName) {
+		
+		_pool.erase(_bufferName);
+		_buffer = makeModelBuffer<T>(_pool, _bufferName, {});
+		
+	};
+	makeEmpty(result.materials, nameAppend(_name, "materials"));
+	makeEmpty(result.triIndices, nameAppend(_name, "triIndices"));
+	makeEmpty(result.vertIndices, nameAppend(_name, "vertIndices"));
+	makeEmpty(result.vertices, nameAppend(_name, "vertices"));
+	makeEmpty(result.normals, nameAppend(_name, "normals"));
+	makeEmpty(result.meshlets, nameAppend(_name, "meshlets"));
+	makeEmpty(result.groups, nameAppend(_name, "groups"));
+	makeEmpty(result.lods, nameAppend(_name, "lods"));
+	makeEmpty(result.models, nameAppend(_name, "models"));
+	result.cpu_groupDepth = 0;
 	
 	return result;
 	
-	L_DEBUG("Uploaded all models to GPU");
+}
+
+void ModelBuffer::addModels(Pool& _pool, ModelList const& _list) {
+	
+	if (!_list.m_pending.empty())
+		throw logic_error_fmt("{} models were added, but never decoded", _list.m_pending.size());
+	
+	// Go through the models in the order they were added, so that new ones
+	// get their indices in the same order
+	auto sources = ivector<std::pair<u32, ID>>();
+	sources.reserve(_list.m_modelIndices.size());
+	for (auto& [id, idx]: _list.m_modelIndices)
+		sources.emplace_back(idx, id);
+	std::sort(sources.begin(), sources.end(), [](auto const& _left, auto const& _right) {
+		return _left.first < _right.first;
+	});
+	
+	for (auto [srcIdx, id]: sources) {
+		
+		auto& srcModel = _list.m_models[srcIdx];
+		auto& srcRanges = _list.m_modelRanges[srcIdx];
+		
+		// Replace an existing model, or append a new one
+		
+		auto [it, inserted] = cpu_modelIndices.try_emplace(id, u32(cpu_models.size()));
+		auto modelIdx = it->second;
+		if (inserted)
+			appendEmpty();
+		else
+			freeModel(modelIdx);
+		
+		// Allocate all ranges, growing the buffers if needed
+		
+		auto ranges = ModelDataRanges{
+			.materialCount = srcRanges.materialCount,
+			.triIndexCount = srcRanges.triIndexCount,
+			.vertIndexCount = srcRanges.vertIndexCount,
+			.vertexCount = srcRanges.vertexCount };
+		ranges.materialOffset = allocateRange(m_materialRanges, ranges.materialCount, [&](u32 _capacity) {
+			growBuffer(_pool, materials, m_materials, _capacity);
+			m_materials.resize(_capacity);
+		});
+		ranges.triIndexOffset = allocateRange(m_triIndexRanges, ranges.triIndexCount, [&](u32 _capacity) {
+			growBuffer(_pool, triIndices, cpu_triIndices, _capacity);
+			cpu_triIndices.resize(_capacity);
+		});
+		ranges.vertIndexOffset = allocateRange(m_vertIndexRanges, ranges.vertIndexCount, [&](u32 _capacity) {
+			growBuffer(_pool, vertIndices, cpu_vertIndices, _capacity);
+			cpu_vertIndices.resize(_capacity);
+		});
+		ranges.vertexOffset = allocateRange(m_vertexRanges, ranges.vertexCount, [&](u32 _capacity) {
+			growBuffer(_pool, vertices, cpu_vertices, _capacity);
+			growBuffer(_pool, normals, m_normals, _capacity);
+			cpu_vertices.resize(_capacity);
+			m_normals.resize(_capacity);
+		});
+		
+		auto model = Model{
+			.meshletCount = srcModel.meshletCount,
+			.groupCount = srcModel.groupCount,
+			.lodCount = srcModel.lodCount };
+		model.meshletOffset = allocateRange(m_meshletRanges, model.meshletCount, [&](u32 _capacity) {
+			growBuffer(_pool, meshlets, cpu_meshlets, _capacity);
+			cpu_meshlets.resize(_capacity);
+			cpu_meshletAABBs.resize(_capacity);
+		});
+		model.groupOffset = allocateRange(m_groupRanges, model.groupCount, [&](u32 _capacity) {
+			growBuffer(_pool, groups, cpu_groups, _capacity);
+			cpu_groups.resize(_capacity);
+		});
+		model.lodOffset = allocateRange(m_lodRanges, model.lodCount, [&](u32 _capacity) {
+			growBuffer(_pool, lods, cpu_lods, _capacity);
+			cpu_lods.resize(_capacity);
+		});
+		
+		// Copy the data, rebasing everything that points into the unified buffers
+		
+		std::copy_n(_list.m_materials.data() + srcRanges.materialOffset, ranges.materialCount,
+			m_materials.data() + ranges.materialOffset);
+		uploadRange(materials, ranges.materialOffset,
+			m_materials.data() + ranges.materialOffset, ranges.materialCount);
+		
+		std::copy_n(_list.m_triIndices.data() + srcRanges.triIndexOffset, ranges.triIndexCount,
+			cpu_triIndices.data() + ranges.triIndexOffset);
+		uploadRange(triIndices, ranges.triIndexOffset,
+			cpu_triIndices.data() + ranges.triIndexOffset, ranges.triIndexCount);
+		
+		for (auto i: iota(0u, ranges.vertIndexCount))
+			cpu_vertIndices[ranges.vertIndexOffset + i] =
+				_list.m_vertIndices[srcRanges.vertIndexOffset + i] - srcRanges.vertexOffset + ranges.vertexOffset;
+		uploadRange(vertIndices, ranges.vertIndexOffset,
+			cpu_vertIndices.data() + ranges.vertIndexOffset, ranges.vertIndexCount);
+		
+		std::copy_n(_list.m_vertices.data() + srcRanges.vertexOffset, ranges.vertexCount,
+			cpu_vertices.data() + ranges.vertexOffset);
+		uploadRange(vertices, ranges.vertexOffset,
+			cpu_vertices.data() + ranges.vertexOffset, ranges.vertexCount);
+		std::copy_n(_list.m_normals.data() + srcRanges.vertexOffset, ranges.vertexCount,
+			m_normals.data() + ranges.vertexOffset);
+		uploadRange(normals, ranges.vertexOffset,
+			m_normals.data() + ranges.vertexOffset, ranges.vertexCount);
+		
+		for (auto i: iota(0u, model.meshletCount)) {
+			
+			auto meshlet = _list.m_meshlets[srcModel.meshletOffset + i];
+			meshlet.materialIdx = meshlet.materialIdx - srcRanges.materialOffset + ranges.materialOffset;
+			meshlet.indexOffset = meshlet.indexOffset - srcRanges.triIndexOffset + ranges.triIndexOffset;
+			meshlet.vertexOffset = meshlet.vertexOffset - srcRanges.vertIndexOffset + ranges.vertIndexOffset;
+			cpu_meshlets[model.meshletOffset + i] = meshlet;
+			cpu_meshletAABBs[model.meshletOffset + i] = _list.m_meshletAABBs[srcModel.meshletOffset + i];
+			
+		}
+		uploadRange(meshlets, model.meshletOffset,
+			cpu_meshlets.data() + model.meshletOffset, model.meshletCount);
+		
+		for (auto i: iota(0u, model.groupCount)) {
+			
+			auto group = _list.m_groups[srcModel.groupOffset + i];
+			group.childOffset = group.childOffset - srcModel.groupOffset + model.groupOffset;
+			group.meshletOffset = group.meshletOffset - srcModel.meshletOffset + model.meshletOffset;
+			cpu_groups[model.groupOffset + i] = group;
+			
+		}
+		uploadRange(groups, model.groupOffset,
+			cpu_groups.data() + model.groupOffset, model.groupCount);
+		
+		for (auto i: iota(0u, model.lodCount)) {
+			
+			auto lod = _list.m_lods[srcModel.lodOffset + i];
+			lod.groupOffset = lod.groupOffset - srcModel.groupOffset + model.groupOffset;
+			lod.meshletOffset = lod.meshletOffset - srcModel.meshletOffset + model.meshletOffset;
+			cpu_lods[model.lodOffset + i] = lod;
+			
+		}
+		uploadRange(lods, model.lodOffset,
+			cpu_lods.data() + model.lodOffset, model.lodCount);
+		
+		// Per-model properties
+		
+		auto triangles = 0u;
+		for (auto& lod: std::span(cpu_lods.data() + model.lodOffset, model.lodCount)) {
+			
+			auto lodTriangles = 0u;
+			for (auto i: iota(lod.meshletOffset, lod.meshletOffset + lod.meshletCount))
+				lodTriangles += divRoundUp(cpu_meshlets[i].indexCount, 3u);
+			triangles = max(triangles, lodTriangles);
+			
+		}
+		
+		auto aabb = AABB{
+			.min = vec3(std::numeric_limits<f32>::max()),
+			.max = vec3(std::numeric_limits<f32>::lowest()) };
+		for (auto i: iota(model.meshletOffset, model.meshletOffset + model.meshletCount)) {
+			
+			aabb.min = min(aabb.min, cpu_meshletAABBs[i].min);
+			aabb.max = max(aabb.max, cpu_meshletAABBs[i].max);
+			
+		}
+		if (model.meshletCount == 0)
+			aabb = AABB{vec3(0.0f), vec3(0.0f)};
+		
+		cpu_models[modelIdx] = model;
+		cpu_modelTriangles[modelIdx] = triangles;
+		cpu_modelAABBs[modelIdx] = aabb;
+		cpu_occluders[modelIdx] = _list.m_occluders[srcIdx];
+		m_modelRanges[modelIdx] = ranges;
+		m_modelGroupDepths[modelIdx] = _list.m_modelGroupDepths[srcIdx];
+		cpu_groupDepth = max(cpu_groupDepth, _list.m_modelGroupDepths[srcIdx]);
+		m_modelsChanged = true;
+		
+	}
+	
+}
+
+void ModelBuffer::addPlaceholder(string_view _name) {
+	
+	if (!cpu_modelIndices.try_emplace(ID(_name), u32(cpu_models.size())).second)
+		throw logic_error_fmt("Model {} already exists", _name);
+	appendEmpty();
+	
+}
+
+void ModelBuffer::removeModel(string_view _name) {
+	
+	auto it = cpu_modelIndices.find(ID(_name));
+	if (it == cpu_modelIndices.end())
+		throw logic_error_fmt("Model {} doesn't exist", _name);
+	freeModel(it->second);
+	
+}
+
+void ModelBuffer::flush(Pool& _pool) {
+	
+	m_frame += 1;
+	
+	// Frames are recorded after the flush, and a frame waits for the one FC
+	// frames before it to finish. Keep one more frame of margin
+	auto reclaimed = std::find_if(m_retired.begin(), m_retired.end(), [this](Retired const& _retired) {
+		return m_frame - _retired.frame <= vuk::Context::FC;
+	});
+	for (auto it = m_retired.begin(); it != reclaimed; ++it) {
+		
+		m_materialRanges.free(it->ranges.materialOffset, it->ranges.materialCount);
+		m_triIndexRanges.free(it->ranges.triIndexOffset, it->ranges.triIndexCount);
+		m_vertIndexRanges.free(it->ranges.vertIndexOffset, it->ranges.vertIndexCount);
+		m_vertexRanges.free(it->ranges.vertexOffset, it->ranges.vertexCount);
+		m_meshletRanges.free(it->model.meshletOffset, it->model.meshletCount);
+		m_groupRanges.free(it->model.groupOffset, it->model.groupCount);
+		m_lodRanges.free(it->model.lodOffset, it->model.lodCount);
+		
+	}
+	m_retired.erase(m_retired.begin(), reclaimed);
+	
+	// Descriptors are small, so the whole table is replaced. Frames in flight
+	// keep reading the previous one, which only points at retired ranges
+	if (m_modelsChanged) {
+		
+		auto name = models.name;
+		_pool.erase(name);
+		models = makeModelBuffer<Model>(_pool, name, cpu_models);
+		m_modelsChanged = false;
+		
+	}
+	
+}
+
+void ModelBuffer::appendEmpty() {
+	
+	cpu_models.emplace_back(Model{});
+	cpu_modelTriangles.emplace_back(0);
+	cpu_modelAABBs.emplace_back(AABB{vec3(0.0f), vec3(0.0f)});
+	cpu_occluders.emplace_back();
+	m_modelRanges.emplace_back(ModelDataRanges{});
+	m_modelGroupDepths.emplace_back(0);
+	m_modelsChanged = true;
+	
+}
+
+void ModelBuffer::freeModel(u32 _modelIdx) {
+	
+	m_retired.emplace_back(Retired{
+		.frame = m_frame,
+		.model = cpu_models[_modelIdx],
+		.ranges = m_modelRanges[_modelIdx] });
+	
+	cpu_models[_modelIdx] = Model{};
+	cpu_modelTriangles[_modelIdx] = 0;
+	cpu_modelAABBs[_modelIdx] = AABB{vec3(0.0f), vec3(0.0f)};
+	cpu_occluders[_modelIdx] = {};
+	m_modelRanges[_modelIdx] = ModelDataRanges{};
+	m_modelsChanged = true;
+	
+	// The deepest hierarchy might be gone
+	if (std::exchange(m_modelGroupDepths[_modelIdx], 0) == cpu_groupDepth) {
+		
+		cpu_groupDepth = 0;
+		for (auto depth: m_modelGroupDepths)
+			cpu_groupDepth = max(cpu_groupDepth, depth);
+		
+	}
 	
 }
 
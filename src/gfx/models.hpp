@@ -1,6 +1,7 @@
 #pragma once
 
 #include <type_traits>
+#include <functional>
 #include <span>
 #include "vuk/Context.hpp"
 #include "gfx/resources/buffer.hpp"
@@ -9,14 +10,18 @@
 #include "base/containers/hashmap.hpp"
 #include "base/containers/string.hpp"
 #include "base/containers/vector.hpp"
+#include "base/rangeAllocator.hpp"
+#include "base/threadPool.hpp"
 #include "base/types.hpp"
 #include "base/math.hpp"
+#include "base/util.hpp"
 #include "base/id.hpp"
 #include "tools/modelSchema.hpp"
 
 namespace minote::gfx {
 
 using namespace base;
+using namespace base::literals;
 
 struct Material {
 	
@@ -46,17 +51,99 @@ struct Meshlet {
 	
 	vec3 boundingSphereCenter;
 	f32 boundingSphereRadius;
+	
+	// Normal cone, for culling backfacing meshlets
+	vec3 coneApex;
+	f32 coneCutoff;
+	vec3 coneAxis;
+	f32 pad0;
+};
+
+// Node of a model's bounding sphere hierarchy over its meshlets. Children are
+// contiguous and come after their parent; leaves have a childCount of 0.
+struct MeshletGroup {
+	vec3 boundingSphereCenter;
+	f32 boundingSphereRadius;
+	
+	u32 childOffset;
+	u32 childCount;
+	u32 meshletOffset;
+	u32 meshletCount;
+};
+
+// Level of detail of a model. Each LOD covers its own range of the model's
+// meshlets, with a separate group hierarchy over them.
+struct ModelLod {
+	u32 groupOffset; // Root of the LOD's hierarchy
+	u32 meshletOffset;
+	u32 meshletCount;
+	f32 error; // Geometric deviation from the most detailed LOD, in model space
 };
 
+// Largest LOD error allowed on screen, in pixels. The coarsest LOD under
+// this limit is drawn.
+constexpr auto LodMaxScreenError = 1.0f;
+
+// Meshlet and group ranges span all of the model's LODs. LODs are ordered
+// from the most detailed, whose hierarchy root is at groupOffset.
 struct Model {
 	u32 meshletOffset;
 	u32 meshletCount;
+	u32 groupOffset;
+	u32 groupCount;
+	u32 lodOffset;
+	u32 lodCount;
+};
+
+// Ranges of a model's materials, indices and vertices in the unified buffers.
+// Meshlet, group and LOD ranges are part of Model.
+struct ModelDataRanges {
+	u32 materialOffset;
+	u32 materialCount;
+	u32 triIndexOffset;
+	u32 triIndexCount;
+	u32 vertIndexOffset;
+	u32 vertIndexCount;
+	u32 vertexOffset; // Also for normals
+	u32 vertexCount;
 };
 
+// Reads a range of a model file into dst, starting at offset bytes from
+// the start of the file. Throws on failure.
+using ModelReader = std::function<void(usize offset, std::span<char> dst)>;
+
+// Sections that need converting are read through a buffer of this size.
+constexpr auto ModelReadChunkSize = 16_kb;
+
+struct ModelList;
+
 // A set of buffers storing vertex data for all models, and how to access each
-// model within the buffer.
+// model within the buffer. Every buffer is sub-allocated, so models can be
+// added, replaced and freed one at a time, at a cost proportional to that
+// model only. Buffers grow as needed. A model keeps its index until
+// the ModelBuffer is destroyed.
 struct ModelBuffer {
 	
+	// Create empty buffers, with names derived from the given one.
+	static auto make(Pool&, vuk::Name) -> ModelBuffer;
+	
+	// Copy all models of a fully decoded list into the buffers. A model with
+	// the same name as an existing one replaces it under the same index; others
+	// are appended.
+	void addModels(Pool&, ModelList const&);
+	
+	// Append a model without any geometry, which still gets a model index.
+	// Objects using it are skipped by rendering.
+	void addPlaceholder(string_view name);
+	
+	// Free the geometry of a model, leaving it as a placeholder.
+	void removeModel(string_view name);
+	
+	// Make changes to model descriptors visible to the GPU, and reuse ranges
+	// freed long enough ago that no frame in flight can still be reading them.
+	// Call once per frame, before the frame is recorded.
+	void flush(Pool&);
+	
 	Buffer<Material> materials;
 	Buffer<u32> triIndices;
 	Buffer<tools::VertIndexType> vertIndices;
@@ -64,21 +151,91 @@ struct ModelBuffer {
 	Buffer<tools::NormalType> normals;
 	
 	Buffer<Meshlet> meshlets;
+	Buffer<MeshletGroup> groups;
+	Buffer<ModelLod> lods;
 	Buffer<Model> models;
 	
 	ivector<Meshlet> cpu_meshlets;
-	ivector<AABB> cpu_meshletAABBs;
+	ivector<MeshletGroup> cpu_groups;
+	ivector<ModelLod> cpu_lods;
+	u32 cpu_groupDepth; // Number of levels in the deepest hierarchy
+	ivector<AABB> cpu_meshletAABBs; // Indexed like cpu_meshlets
 	ivector<Model> cpu_models;
+	ivector<u32> cpu_modelTriangles; // Triangle count of each model's largest LOD
+	ivector<AABB> cpu_modelAABBs; // Union of each model's meshlet AABBs
+	ivector<pvector<vec3>> cpu_occluders; // Triangle list of each occluder model, empty for other models
+	pvector<u32> cpu_triIndices; // Copies of index and vertex data, for culling on the CPU
+	pvector<tools::VertIndexType> cpu_vertIndices;
+	pvector<tools::VertexType> cpu_vertices;
 	hashmap<ID, u32> cpu_modelIndices;
 	
+private:
+	
+	// Ranges of a freed model, waiting until no frame can be using them
+	struct Retired {
+		
+		u64 frame;
+		Model model;
+		ModelDataRanges ranges;
+		
+	};
+	
+	RangeAllocator m_materialRanges;
+	RangeAllocator m_triIndexRanges;
+	RangeAllocator m_vertIndexRanges;
+	RangeAllocator m_vertexRanges;
+	RangeAllocator m_meshletRanges;
+	RangeAllocator m_groupRanges;
+	RangeAllocator m_lodRanges;
+	
+	ivector<ModelDataRanges> m_modelRanges;
+	ivector<u32> m_modelGroupDepths;
+	ivector<Retired> m_retired; // In order of frame
+	
+	// CPU copies of the buffers that have no cpu_ counterpart, so that growing
+	// a buffer never needs to read it back
+	pvector<Material> m_materials;
+	pvector<tools::NormalType> m_normals;
+	u64 m_frame = 0;
+	bool m_modelsChanged = false;
+	
+	// Append a placeholder under the next model index.
+	void appendEmpty();
+	
+	// Retire the ranges of a model, and turn it into a placeholder.
+	void freeModel(u32 modelIdx);
+	
 };
 
-// Structure storing model data as they're being loaded. After all models are
-// loaded in, it can be uploaded to GPU by converting it into a ModelBuffer.
+// Structure storing model data as they're being loaded. Models are loaded
+// in two phases: addModel() reads just the headers, then decodeModels() lays
+// out all sections in the unified buffers and fills them in parallel.
+// After all models are loaded in, it can be uploaded to GPU by converting
+// it into a ModelBuffer.
 struct ModelList {
 	
-	// Parse a model file, and append it to the list.
-	void addModel(string_view name, std::span<char const> model);
+	// Validate the header of a model file of the given size, and queue it for
+	// decoding. The reader is kept until decodeModels(). Occluder models also keep
+	// a copy of their most detailed LOD's triangles on the CPU, for software occlusion culling.
+	// Their geometry should be closed and mostly convex, like walls or boxes.
+	void addModel(string_view name, usize size, ModelReader read, bool occluder = false);
+	
+	// Decode all queued models, streaming each file section by section straight
+	// into its final place, so it never needs to be in memory as a whole.
+	// The result is the same as decoding the models one by one in the order they
+	// were added. If any model is invalid, this throws and the list must be discarded.
+	void decodeModels(ThreadPool&);
+	
+	// Decode all queued models on the calling thread.
+	void decodeModels();
+	
+	// Size of the decoded models once uploaded to the GPU, in bytes.
+	[[nodiscard]]
+	auto gpuSize() const -> usize;
+	
+	// Size of a single decoded model once uploaded to the GPU, in bytes.
+	[[nodiscard]]
+	auto gpuSize(string_view name) const -> usize;
 	
 	// Convert into a ModelBuffer. The instance must be moved in,
 	// so all CPU-side resources are freed.
@@ -86,6 +243,22 @@ struct ModelList {
 	
 private:
 	
+	friend struct ModelBuffer;
+	
+	// Model queued by addModel(), and its place in the unified buffers
+	struct PendingModel {
+		
+		string name;
+		tools::ModelHeader header;
+		ModelReader read;
+		bool occluder;
+		
+		u32 modelIdx; // Assigned by decodeModels()
+		
+	};
+	
+	ivector<PendingModel> m_pending;
+	
 	pvector<Material> m_materials;
 	pvector<u32> m_triIndices;
 	pvector<tools::VertIndexType> m_vertIndices;
@@ -94,9 +267,21 @@ private:
 	
 	ivector<Meshlet> m_meshlets; // Meshlet descriptors, for access to index buffers
 	ivector<AABB> m_meshletAABBs;
+	ivector<MeshletGroup> m_groups;
+	ivector<ModelLod> m_lods;
 	ivector<Model> m_models; // Model descriptors, for access to m_modelMeshes
+	ivector<ModelDataRanges> m_modelRanges;
+	ivector<u32> m_modelGroupDepths; // Number of levels in each model's deepest hierarchy
 	hashmap<ID, u32> m_modelIndices; // Mapping of model IDs to their index in m_models
+	ivector<pvector<vec3>> m_occluders; // Occluder triangles, one entry per model
+	
+	// Assign every queued model its ranges in the unified buffers, in the order
+	// they were added, and grow the buffers to fit.
+	void layoutPending();
 	
+	// Decode a single model into its assigned ranges, and return the depth
+	// of its deepest hierarchy.
+	auto decodeModel(PendingModel const&) -> u32;
 	
 };
 
@@ -0,0 +1,715 @@
+#include "gfx/objectBvh.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <cassert>
+#include <cmath>
+#include "base/containers/hashmap.hpp"
+#include "base/containers/array.hpp"
+#include "base/util.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+using namespace base::literals;
+
+// Bounds of an empty set of points
+constexpr auto EmptyAABB = AABB{
+	.min = vec3(std::numeric_limits<f32>::max()),
+	.max = vec3(std::numeric_limits<f32>::lowest()) };
+
+constexpr auto merge(AABB _left, AABB _right) -> AABB {
+	
+	return AABB{
+		.min = min(_left.min, _right.min),
+		.max = max(_left.max, _right.max) };
+	
+}
+
+constexpr auto surfaceArea(AABB _aabb) -> f32 {
+	
+	auto size = _aabb.max - _aabb.min;
+	return 2.0f * (size.x() * size.y() + size.y() * size.z() + size.z() * size.x());
+	
+}
+
+// Squared distance from a point to the nearest point of a box
+constexpr auto distanceSq(AABB _aabb, vec3 _point) -> f32 {
+	
+	auto nearest = max(min(_point, _aabb.max), _aabb.min);
+	auto offset = _point - nearest;
+	return dot(offset, offset);
+	
+}
+
+// Bounds of a model-space box after scaling, rotation and translation
+auto transformAABB(AABB _aabb, ObjectPool::Transform const& _transform) -> AABB {
+	
+	auto rotation = mat3::rotate(_transform.rotation);
+	auto center = (_aabb.min + _aabb.max) * 0.5f * _transform.scale;
+	auto extent = (_aabb.max - _aabb.min) * 0.5f * abs(_transform.scale);
+	
+	auto worldCenter = rotation * center + _transform.position;
+	auto worldExtent = vec3(0.0f);
+	for (auto i: iota(0_zu, 3_zu))
+	for (auto j: iota(0_zu, 3_zu))
+		worldExtent[i] += std::abs(rotation[j][i]) * extent[j];
+	
+	return AABB{
+		.min = worldCenter - worldExtent,
+		.max = worldCenter + worldExtent };
+	
+}
+
+void ObjectBVH::update(ObjectPool const& _objects, ModelBuffer const& _models) {
+	
+	// Any change to model bounds invalidates every object's bounds
+	
+	auto rebuild = _objects.size() == 0 ||
+		m_modelBounds.size() != _models.cpu_modelAABBs.size() ||
+		!std::equal(m_modelBounds.begin(), m_modelBounds.end(), _models.cpu_modelAABBs.begin(),
+			[](auto const& _left, auto const& _right) { return _left.min == _right.min && _left.max == _right.max; });
+	
+	// Objects that changed positions in the pool are followed into
+	// the leaves, unless some of them are new
+	
+	auto dirty = _objects.dirtyIndices();
+	auto moved = m_objectBounds.size() != _objects.size() ||
+		std::any_of(dirty.begin(), dirty.end(), [&](u32 idx) { return _objects.wasRelocated(idx); });
+	if (!rebuild && moved)
+		rebuild = !remap(_objects, dirty);
+	
+	if (rebuild) {
+		
+		updateAllBounds(_objects, _models);
+		build();
+		return;
+		
+	}
+	
+	if (dirty.empty() && !moved) return;
+	
+	// The set of objects is unchanged, so the tree can be refitted in place
+	
+	for (auto idx: dirty) {
+		
+		auto modelIdx = _models.cpu_modelIndices.at(_objects.modelIDs[idx]);
+		m_objectBounds[idx] = transformAABB(m_modelBounds[modelIdx], _objects.transforms[idx]);
+		
+	}
+	refit();
+	
+	if (cost() > m_buildCost * RebuildThreshold)
+		build();
+	
+}
+
+auto ObjectBVH::cullFrustum(ObjectPool const& _objects, mat4 _viewProjection) const -> bitvector {
+	
+	auto result = bitvector();
+	result.resize(_objects.size());
+	if (m_nodes.empty()) return result;
+	
+	// Left, right, bottom, top, near
+	auto rows = transpose(_viewProjection);
+	auto planes = to_array({
+		rows[3] + rows[0],
+		rows[3] - rows[0],
+		rows[3] + rows[1],
+		rows[3] - rows[1],
+		rows[3] - rows[2] });
+	constexpr auto AllPlanes = (1u << planes.size()) - 1;
+	
+	// Test a box against the planes in the mask. Planes that the box is fully
+	// inside of are removed from the mask
+	auto outside = [&planes](AABB const& _bounds, u32& _planeMask) {
+		
+		auto center = (_bounds.min + _bounds.max) * 0.5f;
+		auto extent = (_bounds.max - _bounds.min) * 0.5f;
+		for (auto i: iota(0_zu, planes.size())) {
+			
+			if (!(_planeMask & (1u << i))) continue;
+			
+			auto normal = vec3(planes[i]);
+			auto distance = dot(normal, center) + planes[i].w();
+			auto radius = dot(abs(normal), extent);
+			if (distance < -radius)
+				return true;
+			if (distance > radius)
+				_planeMask &= ~(1u << i);
+			
+		}
+		return false;
+		
+	};
+	
+	// Nodes carry the set of planes they still need to be tested against.
+	// Once a node is fully inside a plane, its children skip that plane
+	
+	struct Entry {
+		u32 node;
+		u32 planeMask;
+	};
+	auto stack = ivector<Entry, 64>();
+	stack.emplace_back(Entry{0, AllPlanes});
+	
+	while (!stack.empty()) {
+		
+		auto entry = stack.back();
+		stack.pop_back();
+		auto& node = m_nodes[entry.node];
+		if (outside(node.bounds, entry.planeMask)) continue;
+		
+		if (node.isLeaf()) {
+			
+			for (auto i: iota(node.first, node.first + node.count)) {
+				
+				auto idx = m_indices[i];
+				if (!_objects.visible[idx]) continue;
+				
+				auto planeMask = entry.planeMask;
+				if (planeMask == 0 || !outside(m_objectBounds[idx], planeMask))
+					result[idx] = true;
+				
+			}
+			
+		} else {
+			
+			stack.emplace_back(Entry{node.first, entry.planeMask});
+			stack.emplace_back(Entry{node.first + 1, entry.planeMask});
+			
+		}
+		
+	}
+	
+	return result;
+	
+}
+
+auto ObjectBVH::raycast(Ray const& _ray) const -> std::optional<RayHit> {
+	
+	if (m_nodes.empty()) return std::nullopt;
+	
+	auto invDir = vec3(1.0f) / _ray.direction; // Infinities are handled correctly by the slab test
+	
+	// Return the distance at which the ray enters the box, or infinity if it misses
+	auto entry = [&](AABB const& _bounds, f32 _maxDistance) {
+		
+		auto t0 = (_bounds.min - _ray.origin) * invDir;
+		auto t1 = (_bounds.max - _ray.origin) * invDir;
+		auto tmin = min(t0, t1);
+		auto tmax = max(t0, t1);
+		auto enter = max(max(tmin.x(), tmin.y()), max(tmin.z(), 0.0f));
+		auto exit = min(min(tmax.x(), tmax.y()), min(tmax.z(), _maxDistance));
+		return enter <= exit? enter : std::numeric_limits<f32>::infinity();
+		
+	};
+	
+	auto result = std::optional<RayHit>();
+	auto closest = _ray.maxDistance;
+	
+	struct Entry {
+		u32 node;
+		f32 distance;
+	};
+	auto stack = ivector<Entry, 64>();
+	stack.emplace_back(Entry{0, entry(m_nodes[0].bounds, closest)});
+	
+	while (!stack.empty()) {
+		
+		auto current = stack.back();
+		stack.pop_back();
+		if (current.distance > closest) continue;
+		
+		auto& node = m_nodes[current.node];
+		if (node.isLeaf()) {
+			
+			for (auto i: iota(node.first, node.first + node.count)) {
+				
+				auto idx = m_indices[i];
+				auto distance = entry(m_objectBounds[idx], closest);
+				if (distance > closest) continue;
+				
+				closest = distance;
+				result = RayHit{
+					.object = m_objectIDs[idx],
+					.distance = distance };
+				
+			}
+			continue;
+			
+		}
+		
+		// Visit the nearer child first by pushing it last
+		
+		auto left = Entry{node.first, entry(m_nodes[node.first].bounds, closest)};
+		auto right = Entry{node.first + 1, entry(m_nodes[node.first + 1].bounds, closest)};
+		if (left.distance < right.distance)
+			std::swap(left, right);
+		if (left.distance <= closest)
+			stack.push_back(left);
+		if (right.distance <= closest)
+			stack.push_back(right);
+		
+	}
+	
+	return result;
+	
+}
+
+void ObjectBVH::overlap(Sphere const& _sphere, ivector<ObjectID>& _out) const {
+	
+	auto radiusSq = _sphere.radius * _sphere.radius;
+	auto intersects = [&](AABB const& _bounds) {
+		return distanceSq(_bounds, _sphere.center) <= radiusSq;
+	};
+	
+	traverse(intersects, [&](u32 _idx) {
+		
+		if (intersects(m_objectBounds[_idx]))
+			_out.push_back(m_objectIDs[_idx]);
+		
+	});
+	
+}
+
+void ObjectBVH::overlap(AABB const& _box, ivector<ObjectID>& _out) const {
+	
+	auto intersects = [&](AABB const& _bounds) {
+		return
+			_bounds.min.x() <= _box.max.x() && _box.min.x() <= _bounds.max.x() &&
+			_bounds.min.y() <= _box.max.y() && _box.min.y() <= _bounds.max.y() &&
+			_bounds.min.z() <= _box.max.z() && _box.min.z() <= _bounds.max.z();
+	};
+	
+	traverse(intersects, [&](u32 _idx) {
+		
+		if (intersects(m_objectBounds[_idx]))
+			_out.push_back(m_objectIDs[_idx]);
+		
+	});
+	
+}
+
+auto ObjectBVH::nearest(vec3 _point, u32 _k) const -> ivector<ObjectID> {
+	
+	if (m_nodes.empty() || _k == 0) return {};
+	
+	// Best-first search. Nodes are visited in order of distance, and the search
+	// ends once the closest unvisited node is farther than the k-th best object
+	
+	struct Candidate {
+		f32 distanceSq;
+		u32 idx; // Node index, or object position
+		
+		auto operator<(Candidate const& other) const -> bool { return distanceSq < other.distanceSq; }
+		auto operator>(Candidate const& other) const -> bool { return distanceSq > other.distanceSq; }
+	};
+	
+	auto nodes = ivector<Candidate, 64>(); // Min-heap
+	auto best = ivector<Candidate, 64>(); // Max-heap of size up to k
+	nodes.emplace_back(Candidate{distanceSq(m_nodes[0].bounds, _point), 0});
+	
+	while (!nodes.empty()) {
+		
+		std::pop_heap(nodes.begin(), nodes.end(), std::greater<>());
+		auto current = nodes.back();
+		nodes.pop_back();
+		if (best.size() == _k && current.distanceSq > best.front().distanceSq)
+			break;
+		
+		auto& node = m_nodes[current.idx];
+		if (node.isLeaf()) {
+			
+			for (auto i: iota(node.first, node.first + node.count)) {
+				
+				auto idx = m_indices[i];
+				auto candidate = Candidate{distanceSq(m_objectBounds[idx], _point), idx};
+				if (best.size() < _k) {
+					
+					best.push_back(candidate);
+					std::push_heap(best.begin(), best.end());
+					
+				} else if (candidate < best.front()) {
+					
+					std::pop_heap(best.begin(), best.end());
+					best.back() = candidate;
+					std::push_heap(best.begin(), best.end());
+					
+				}
+				
+			}
+			continue;
+			
+		}
+		
+		for (auto child: {node.first, node.first + 1}) {
+			
+			nodes.emplace_back(Candidate{distanceSq(m_nodes[child].bounds, _point), child});
+			std::push_heap(nodes.begin(), nodes.end(), std::greater<>());
+			
+		}
+		
+	}
+	
+	std::sort_heap(best.begin(), best.end());
+	auto result = ivector<ObjectID>();
+	result.reserve(best.size());
+	for (auto& candidate: best)
+		result.push_back(m_objectIDs[candidate.idx]);
+	return result;
+	
+}
+
+void ObjectBVH::raycast(ThreadPool& _pool, std::span<Ray const> _rays,
+	std::span<std::optional<RayHit>> _out) const {
+	
+	forEachQuery(_pool, _rays.size(), [&](usize i) { _out[i] = raycast(_rays[i]); });
+	
+}
+
+void ObjectBVH::overlap(ThreadPool& _pool, std::span<Sphere const> _spheres,
+	std::span<ivector<ObjectID>> _out) const {
+	
+	forEachQuery(_pool, _spheres.size(), [&](usize i) {
+		
+		_out[i].clear();
+		overlap(_spheres[i], _out[i]);
+		
+	});
+	
+}
+
+void ObjectBVH::nearest(ThreadPool& _pool, std::span<vec3 const> _points, u32 _k,
+	std::span<ivector<ObjectID>> _out) const {
+	
+	forEachQuery(_pool, _points.size(), [&](usize i) { _out[i] = nearest(_points[i], _k); });
+	
+}
+
+void ObjectBVH::updateAllBounds(ObjectPool const& _objects, ModelBuffer const& _models) {
+	
+	m_modelBounds.assign(_models.cpu_modelAABBs.begin(), _models.cpu_modelAABBs.end());
+	m_objectBounds.resize(_objects.size());
+	m_objectIDs.resize(_objects.size());
+	for (auto idx: iota(0u, u32(_objects.size())))
+		m_objectIDs[idx] = _objects.idAt(idx);
+	
+	// Objects are grouped by model, so each model is only looked up once
+	
+	for (auto& bucket: _objects.buckets()) {
+		
+		if (bucket.begin == bucket.end) continue;
+		
+		auto modelBounds = m_modelBounds[_models.cpu_modelIndices.at(bucket.modelID)];
+		for (auto idx: iota(bucket.begin, bucket.end))
+			m_objectBounds[idx] = transformAABB(modelBounds, _objects.transforms[idx]);
+		
+	}
+	
+}
+
+void ObjectBVH::build() {
+	
+	m_nodes.clear();
+	m_indices.resize(m_objectBounds.size());
+	for (auto i: iota(0_zu, m_indices.size()))
+		m_indices[i] = i;
+	
+	if (m_indices.empty()) {
+		
+		m_buildCost = 0.0f;
+		return;
+		
+	}
+	
+	m_nodes.reserve(m_indices.size() * 2);
+	m_nodes.push_back(Node{});
+	buildNode(0, 0, m_indices.size());
+	
+	// refit() relies on children coming after their parent
+	for (auto i: iota(0_zu, m_nodes.size()))
+		assert(m_nodes[i].isLeaf() || m_nodes[i].first > i);
+	
+	m_buildCost = cost();
+	
+}
+
+void ObjectBVH::buildNode(u32 _node, u32 _begin, u32 _end) {
+	
+	auto bounds = EmptyAABB;
+	auto centroids = EmptyAABB;
+	for (auto i: iota(_begin, _end)) {
+		
+		auto& objectBounds = m_objectBounds[m_indices[i]];
+		bounds = merge(bounds, objectBounds);
+		auto centroid = (objectBounds.min + objectBounds.max) * 0.5f;
+		centroids = merge(centroids, AABB{centroid, centroid});
+		
+	}
+	m_nodes[_node].bounds = bounds;
+	
+	if (_end - _begin <= MaxLeafSize) {
+		
+		m_nodes[_node].first = _begin;
+		m_nodes[_node].count = _end - _begin;
+		return;
+		
+	}
+	
+	// Split along the axis with the largest spread of centroids
+	
+	auto spread = centroids.max - centroids.min;
+	auto axis = 0_zu;
+	if (spread[1] > spread[axis]) axis = 1;
+	if (spread[2] > spread[axis]) axis = 2;
+	
+	auto mid = _begin;
+	if (spread[axis] > 0.0f) {
+		
+		// Bin the centroids, and pick the bin boundary with the lowest
+		// surface area heuristic. The outer bins are never empty, so both
+		// sides of any boundary have objects
+		
+		struct Bin {
+			AABB bounds = EmptyAABB;
+			u32 count = 0;
+		};
+		auto bins = array<Bin, SplitBins>();
+		auto binOf = [&](u32 _idx) {
+			
+			auto& objectBounds = m_objectBounds[_idx];
+			auto centroid = (objectBounds.min[axis] + objectBounds.max[axis]) * 0.5f;
+			auto bin = usize((centroid - centroids.min[axis]) / spread[axis] * f32(SplitBins));
+			return std::min(bin, SplitBins - 1);
+			
+		};
+		
+		for (auto i: iota(_begin, _end)) {
+			
+			auto& bin = bins[binOf(m_indices[i])];
+			bin.bounds = merge(bin.bounds, m_objectBounds[m_indices[i]]);
+			bin.count += 1;
+			
+		}
+		
+		auto rightCost = array<f32, SplitBins>();
+		auto right = Bin();
+		for (auto i = SplitBins - 1; i > 0; i -= 1) {
+			
+			right.bounds = merge(right.bounds, bins[i].bounds);
+			right.count += bins[i].count;
+			rightCost[i] = right.count? surfaceArea(right.bounds) * f32(right.count) : 0.0f;
+			
+		}
+		
+		auto best = 1_zu;
+		auto bestCost = std::numeric_limits<f32>::infinity();
+		auto left = Bin();
+		for (auto i: iota(1_zu, SplitBins)) {
+			
+			left.bounds = merge(left.bounds, bins[i - 1].bounds);
+			left.count += bins[i - 1].count;
+			auto leftCost = left.count? surfaceArea(left.bounds) * f32(left.count) : 0.0f;
+			if (leftCost + rightCost[i] < bestCost) {
+				
+				best = i;
+				bestCost = leftCost + rightCost[i];
+				
+			}
+			
+		}
+		
+		auto split = std::partition(m_indices.begin() + _begin, m_indices.begin() + _end,
+			[&](u32 _idx) { return binOf(_idx) < best; });
+		mid = u32(split - m_indices.begin());
+		
+	}
+	
+	// Objects with identical centroids can't be told apart, so they are
+	// split in half instead
+	
+	if (mid == _begin || mid == _end) {
+		
+		mid = _begin + (_end - _begin) / 2;
+		std::nth_element(m_indices.begin() + _begin, m_indices.begin() + mid, m_indices.begin() + _end,
+			[this, axis](u32 _left, u32 _right) {
+				
+				auto& left = m_objectBounds[_left];
+				auto& right = m_objectBounds[_right];
+				return left.min[axis] + left.max[axis] < right.min[axis] + right.max[axis];
+				
+			});
+		
+	}
+	
+	auto children = u32(m_nodes.size());
+	m_nodes[_node].first = children;
+	m_nodes[_node].count = Internal;
+	m_nodes.push_back(Node{});
+	m_nodes.push_back(Node{});
+	
+	buildNode(children, _begin, mid);
+	buildNode(children + 1, mid, _end);
+	
+}
+
+auto ObjectBVH::remap(ObjectPool const& _objects, ivector<u32> const& _dirty) -> bool {
+	
+	constexpr auto Removed = ~0u;
+	auto oldSize = u32(m_objectIDs.size());
+	auto newSize = u32(_objects.size());
+	
+	// Objects that weren't relocated are still where they were. Objects that
+	// left their position are found again by slot
+	
+	auto positions = pvector<u32>(oldSize); // New position of each object, by old position
+	auto vacated = hashmap<u32, u32>(); // Old position, by slot
+	for (auto old: iota(0u, oldSize)) {
+		
+		auto id = m_objectIDs[old];
+		if (old < newSize && !_objects.wasRelocated(old) && _objects.idAt(old) == id) {
+			
+			positions[old] = old;
+			
+		} else {
+			
+			positions[old] = Removed;
+			vacated.emplace(id.slot, old);
+			
+		}
+		
+	}
+	
+	for (auto idx: _dirty) {
+		
+		if (!_objects.wasRelocated(idx)) continue;
+		
+		auto id = _objects.idAt(idx);
+		auto it = vacated.find(id.slot);
+		if (it == vacated.end() || m_objectIDs[it->second] != id)
+			return false; // Created since the last update
+		positions[it->second] = idx;
+		
+	}
+	
+	// A position nobody moved into holds an object that was never in the tree
+	if (std::count_if(positions.begin(), positions.end(), [](u32 _pos) { return _pos != Removed; }) != newSize)
+		return false;
+	
+	// Patch the leaves in place. Destroyed objects leave a gap at the end
+	// of their leaf's range, and a leaf can end up empty
+	
+	for (auto& node: m_nodes) {
+		
+		if (!node.isLeaf()) continue;
+		
+		auto kept = node.first;
+		for (auto i: iota(node.first, node.first + node.count)) {
+			
+			auto position = positions[m_indices[i]];
+			if (position == Removed) continue;
+			m_indices[kept] = position;
+			kept += 1;
+			
+		}
+		node.count = kept - node.first;
+		
+	}
+	
+	auto bounds = pvector<AABB>(newSize);
+	for (auto old: iota(0u, oldSize))
+		if (positions[old] != Removed)
+			bounds[positions[old]] = m_objectBounds[old];
+	m_objectBounds = std::move(bounds);
+	
+	m_objectIDs.resize(newSize);
+	for (auto idx: _dirty)
+		if (_objects.wasRelocated(idx))
+			m_objectIDs[idx] = _objects.idAt(idx);
+	
+	return true;
+	
+}
+
+void ObjectBVH::refit() {
+	
+	for (auto i = m_nodes.size(); i > 0; i -= 1) {
+		
+		auto& node = m_nodes[i - 1];
+		if (node.isLeaf()) {
+			
+			node.bounds = EmptyAABB;
+			for (auto j: iota(node.first, node.first + node.count))
+				node.bounds = merge(node.bounds, m_objectBounds[m_indices[j]]);
+			
+		} else {
+			
+			node.bounds = merge(m_nodes[node.first].bounds, m_nodes[node.first + 1].bounds);
+			
+		}
+		
+	}
+	
+}
+
+template<typename Pred, typename F>
+void ObjectBVH::traverse(Pred&& _nodeTest, F&& _func) const {
+	
+	if (m_nodes.empty()) return;
+	
+	auto stack = ivector<u32, 64>();
+	stack.push_back(0);
+	while (!stack.empty()) {
+		
+		auto& node = m_nodes[stack.back()];
+		stack.pop_back();
+		if (!_nodeTest(node.bounds)) continue;
+		
+		if (node.isLeaf()) {
+			
+			for (auto i: iota(node.first, node.first + node.count))
+				_func(m_indices[i]);
+			
+		} else {
+			
+			stack.push_back(node.first);
+			stack.push_back(node.first + 1);
+			
+		}
+		
+	}
+	
+}
+
+void ObjectBVH::forEachQuery(ThreadPool& _pool, usize _count, std::function<void(usize)> const& _func) {
+	
+	auto chunks = (_count + QueryChunkSize - 1) / QueryChunkSize;
+	_pool.parallelFor(chunks, [&](usize _chunk) {
+		
+		auto begin = _chunk * QueryChunkSize;
+		auto end = min(begin + QueryChunkSize, _count);
+		for (auto i: iota(begin, end))
+			_func(i);
+		
+	});
+	
+}
+
+auto ObjectBVH::cost() const -> f32 {
+	
+	if (m_nodes.empty()) return 0.0f;
+	
+	auto rootArea = surfaceArea(m_nodes[0].bounds);
+	if (rootArea <= 0.0f) return 0.0f;
+	
+	// Leaves emptied by remap() have inverted bounds, and don't add any area
+	auto result = 0.0f;
+	for (auto& node: m_nodes)
+		if (node.bounds.min.x() <= node.bounds.max.x())
+			result += surfaceArea(node.bounds);
+	return result / rootArea;
+	
+}
+
+}
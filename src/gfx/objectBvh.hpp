@@ -0,0 +1,154 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <span>
+#include "base/containers/bitvector.hpp"
+#include "base/containers/vector.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "base/threadPool.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/models.hpp"
+#include "gfx/util.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+using namespace base::literals;
+
+// Bounding volume hierarchy over the objects of an ObjectPool, for culling
+// and spatial queries on the CPU. The bottom level is a single box per
+// model, built from the model's meshlet bounds; the top level is a binary
+// tree over the world-space bounds of each object, split by a binned surface
+// area heuristic. Moving objects are handled by refitting the tree, and
+// objects that were moved around in the pool or destroyed are patched out
+// of the leaves. It is rebuilt when objects are created, or once refitting
+// has degraded it too much.
+struct ObjectBVH {
+	
+	// Maximum number of objects in a leaf node, as built
+	static constexpr auto MaxLeafSize = 4u;
+	
+	// Number of candidate split positions per node, as built
+	static constexpr auto SplitBins = 16_zu;
+	
+	// Rebuild once the summed surface area of all nodes, relative to the root,
+	// grows by this factor compared to a fresh build
+	static constexpr auto RebuildThreshold = 1.5f;
+	
+	// Number of queries handled by a single thread at a time in batched queries
+	static constexpr auto QueryChunkSize = 64u;
+	
+	struct Ray {
+		vec3 origin;
+		vec3 direction; // Doesn't need to be normalized; distances are in its units
+		f32 maxDistance;
+	};
+	
+	struct RayHit {
+		ObjectID object;
+		f32 distance;
+	};
+	
+	struct Sphere {
+		vec3 center;
+		f32 radius;
+	};
+	
+	// Bring the tree up to date with the pool. Must be called once per frame,
+	// before the pool's copyTransforms().
+	void update(ObjectPool const&, ModelBuffer const&);
+	
+	// Return the set of visible objects whose bounds intersect the frustum
+	// of the given view-projection matrix, with the same size as the pool.
+	// The far plane is ignored, so infinite projections are fine.
+	[[nodiscard]]
+	auto cullFrustum(ObjectPool const&, mat4 viewProjection) const -> bitvector;
+	
+	// Queries below are answered against object bounds, as of the last
+	// update(). They only read the tree, so any number of them can run
+	// concurrently, as long as update() isn't running. Returned handles
+	// can be stale if objects were destroyed since.
+	
+	// Return the closest object whose bounds are hit by the ray, if any.
+	[[nodiscard]]
+	auto raycast(Ray const&) const -> std::optional<RayHit>;
+	
+	// Append all objects whose bounds intersect the sphere or box to out.
+	void overlap(Sphere const&, ivector<ObjectID>& out) const;
+	void overlap(AABB const&, ivector<ObjectID>& out) const;
+	
+	// Return up to k objects with bounds closest to the point, nearest first.
+	// Objects whose bounds contain the point are at distance 0.
+	[[nodiscard]]
+	auto nearest(vec3 point, u32 k) const -> ivector<ObjectID>;
+	
+	// Batched versions of the above, spread across the thread pool. Each
+	// query's result is written at the same index of the output.
+	void raycast(ThreadPool&, std::span<Ray const>, std::span<std::optional<RayHit>> out) const;
+	void overlap(ThreadPool&, std::span<Sphere const>, std::span<ivector<ObjectID>> out) const;
+	void nearest(ThreadPool&, std::span<vec3 const>, u32 k, std::span<ivector<ObjectID>> out) const;
+	
+	// World-space bounds of the object at the given position.
+	[[nodiscard]]
+	auto objectBounds(u32 index) const -> AABB { return m_objectBounds[index]; }
+	
+	[[nodiscard]]
+	auto nodeCount() const -> usize { return m_nodes.size(); }
+	
+private:
+	
+	struct Node {
+		AABB bounds;
+		u32 first; // First child if internal, first element of m_indices if leaf
+		u32 count; // Number of objects if leaf, Internal otherwise
+		
+		[[nodiscard]]
+		auto isLeaf() const -> bool { return count != Internal; }
+	};
+	
+	// Leaves can become empty once their objects are destroyed, so internal
+	// nodes are marked separately
+	static constexpr auto Internal = ~0u;
+	
+	ivector<AABB> m_modelBounds; // Model-space bounds, by model index
+	pvector<AABB> m_objectBounds; // World-space bounds, by object position
+	pvector<ObjectID> m_objectIDs; // Handles, by object position at last update
+	pvector<Node> m_nodes; // Children always come after their parent
+	pvector<u32> m_indices; // Object positions, grouped by leaf
+	f32 m_buildCost = 0.0f;
+	
+	// Recalculate bounds of every object.
+	void updateAllBounds(ObjectPool const&, ModelBuffer const&);
+	
+	// Build the tree from scratch over the current object bounds.
+	void build();
+	
+	// Split a node, and recurse into its children.
+	void buildNode(u32 node, u32 begin, u32 end);
+	
+	// Follow objects that were moved to different positions in the pool,
+	// and drop destroyed ones from the leaves. Returns false if there
+	// are new objects, which need a rebuild to be placed in the tree.
+	[[nodiscard]]
+	auto remap(ObjectPool const&, ivector<u32> const& dirty) -> bool;
+	
+	// Call func with the position of every object in a leaf whose node bounds
+	// satisfy the predicate.
+	template<typename Pred, typename F>
+	void traverse(Pred&& nodeTest, F&& func) const;
+	
+	// Run func for each index in [0, count), in chunks of QueryChunkSize.
+	static void forEachQuery(ThreadPool&, usize count, std::function<void(usize)> const& func);
+	
+	// Recalculate the bounds of all nodes, bottom-up.
+	void refit();
+	
+	// Summed surface area of all nodes, relative to the root.
+	[[nodiscard]]
+	auto cost() const -> f32;
+	
+};
+
+}
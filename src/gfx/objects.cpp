@@ -1,57 +1,454 @@
 #include "gfx/objects.hpp"
 
+#include <algorithm>
+#include "base/error.hpp"
 #include "base/util.hpp"
 
 namespace minote::gfx {
 
 using namespace base::literals;
 
-auto ObjectPool::create() -> ObjectID {
+auto ObjectPool::create(ID _modelID) -> ObjectID {
 	
-	if (m_deletedIDs.empty()) {
-		
-		metadata.emplace_back(Metadata::make_default());
-		modelIDs.emplace_back();
-		colors.emplace_back(1.0f); // Fully opaque
-		transforms.emplace_back(Transform::make_default());
-		prevTransforms.emplace_back(Transform::make_default());
-		
-		return size() - 1;
-		
-	} else {
+	return createAt(acquireSlot(), _modelID);
+	
+}
+
+auto ObjectPool::createBatch(ID _modelID, usize _count) -> ivector<ObjectID> {
+	
+	auto result = ivector<ObjectID>();
+	if (_count == 0) return result;
+	result.reserve(_count);
+	m_slots.reserve(m_slots.size() + _count);
+	m_dirtySlots.reserve(m_dirtySlots.size() + _count);
+	
+	// Open up the whole range at once, and fill each column in one go
+	
+	auto first = insertInto(bucketOf(_modelID), _count);
+	auto last = first + u32(_count);
+	visible.fill(first, last, true);
+	std::fill(modelIDs.begin() + first, modelIDs.begin() + last, _modelID);
+	std::fill(colors.begin() + first, colors.begin() + last, vec4(1.0f)); // Fully opaque
+	std::fill(transforms.begin() + first, transforms.begin() + last, Transform::make_default());
+	std::fill(prevTransforms.begin() + first, prevTransforms.begin() + last, Transform::make_default());
+	
+	for (auto index: iota(first, last)) {
 		
-		auto id = m_deletedIDs.back();
-		m_deletedIDs.pop_back();
-		metadata[id] = Metadata::make_default();
-		colors[id] = vec4(1.0f); // Fully opaque
-		transforms[id] = Transform::make_default();
-		prevTransforms[id] = Transform::make_default();
-		return id;
+		auto slot = acquireSlot();
+		m_denseSlots[index] = slot;
+		m_slots[slot].index = index;
+		m_slots[slot].relocated = true;
+		markDirty(slot);
+		result.emplace_back(ObjectID{
+			.slot = slot,
+			.generation = m_slots[slot].generation });
 		
 	}
 	
+	return result;
+	
 }
 
 void ObjectPool::destroy(ObjectID _id) {
 	
-	metadata[_id].exists = false;
-	m_deletedIDs.push_back(_id);
+	auto index = indexOf(_id);
+	removeFrom(m_bucketIndices.at(modelIDs[index]), index);
+	releaseSlot(_id.slot);
+	
+}
+
+void ObjectPool::destroyBatch(std::span<ObjectID const> _ids) {
+	
+	if (_ids.empty()) return;
+	
+	// Validate everything up front, so that a bad handle leaves the pool intact
+	
+	auto indices = pvector<u32>();
+	indices.reserve(_ids.size());
+	for (auto id: _ids)
+		indices.push_back(indexOf(id));
+	std::sort(indices.begin(), indices.end());
+	if (auto dup = std::adjacent_find(indices.begin(), indices.end()); dup != indices.end()) {
+		
+		auto slot = m_denseSlots[*dup];
+		throw logic_error_fmt("Object handle destroyed twice in a batch: slot {}, generation {}",
+			slot, m_slots[slot].generation);
+		
+	}
+	
+	for (auto index: indices)
+		releaseSlot(m_denseSlots[index]);
+	
+	// Walk the buckets in order. Each one is first compacted in place, then
+	// shifted down by the number of objects removed from earlier buckets
+	
+	auto shift = u32(0);
+	auto it = indices.begin();
+	for (auto& bucket: m_buckets) {
+		
+		auto removedBegin = it;
+		while (it != indices.end() && *it < bucket.end)
+			++it;
+		
+		// Fill holes from the bucket's tail. Going backwards guarantees that
+		// the tail object is never one that is being removed
+		
+		for (auto r = it; r != removedBegin;) {
+			
+			--r;
+			bucket.end -= 1;
+			if (*r != bucket.end)
+				moveObject(bucket.end, *r);
+			
+		}
+		
+		if (shift > 0) {
+			
+			auto moved = min(shift, bucket.end - bucket.begin);
+			for (auto i: iota(0u, moved))
+				moveObject(bucket.end - moved + i, bucket.begin - shift + i);
+			bucket.begin -= shift;
+			bucket.end -= shift;
+			
+		}
+		
+		shift += u32(it - removedBegin);
+		
+	}
+	
+	auto newSize = size() - shift;
+	visible.resize(newSize);
+	modelIDs.resize(newSize);
+	colors.resize(newSize);
+	transforms.resize(newSize);
+	prevTransforms.resize(newSize);
+	m_denseSlots.resize(newSize);
 	
 }
 
 auto ObjectPool::get(ObjectID _id) -> Proxy {
 	
+	auto index = indexOf(_id);
+	markDirty(_id.slot);
 	return Proxy{
-		.metadata = metadata[_id],
-		.modelID = modelIDs[_id],
-		.color = colors[_id],
-		.transform = transforms[_id] };
+		.visible = visible[index],
+		.modelID = modelIDs[index],
+		.color = colors[index],
+		.transform = transforms[index] };
+	
+}
+
+void ObjectPool::setModel(ObjectID _id, ID _modelID) {
+	
+	auto index = indexOf(_id);
+	if (modelIDs[index] == _modelID) {
+		
+		markDirty(_id.slot);
+		return;
+		
+	}
+	
+	// Take the object out of its bucket, and reinsert into the new one
+	
+	auto isVisible = bool(visible[index]);
+	auto color = colors[index];
+	auto transform = transforms[index];
+	auto prevTransform = prevTransforms[index];
+	
+	removeFrom(m_bucketIndices.at(modelIDs[index]), index);
+	auto newIndex = insertInto(bucketOf(_modelID));
+	
+	visible[newIndex] = isVisible;
+	modelIDs[newIndex] = _modelID;
+	colors[newIndex] = color;
+	transforms[newIndex] = transform;
+	prevTransforms[newIndex] = prevTransform;
+	m_denseSlots[newIndex] = _id.slot;
+	
+	m_slots[_id.slot].index = newIndex;
+	m_slots[_id.slot].relocated = true;
+	markDirty(_id.slot);
+	
+}
+
+auto ObjectPool::createCommandQueue() -> CommandQueue& {
+	
+	return *m_queues.emplace_back(std::make_unique<CommandQueue>(*this));
+	
+}
+
+void ObjectPool::applyCommands() {
+	
+	growSlots();
+	
+	for (auto& queue: m_queues) {
+		
+		for (auto& command: queue->m_commands) {
+			
+			std::visit([this](auto const& _cmd) {
+				
+				using T = std::decay_t<decltype(_cmd)>;
+				if constexpr (std::is_same_v<T, CommandQueue::Create>) {
+					
+					createAt(_cmd.id.slot, _cmd.modelID);
+					return;
+					
+				}
+				
+				if (!exists(_cmd.id)) return;
+				
+				if constexpr (std::is_same_v<T, CommandQueue::Destroy>)
+					destroy(_cmd.id);
+				else if constexpr (std::is_same_v<T, CommandQueue::SetVisible>)
+					get(_cmd.id).visible = _cmd.visible;
+				else if constexpr (std::is_same_v<T, CommandQueue::SetModel>)
+					setModel(_cmd.id, _cmd.modelID);
+				else if constexpr (std::is_same_v<T, CommandQueue::SetColor>)
+					get(_cmd.id).color = _cmd.color;
+				else if constexpr (std::is_same_v<T, CommandQueue::SetTransform>)
+					get(_cmd.id).transform = _cmd.transform;
+				
+			}, command);
+			
+		}
+		queue->m_commands.clear();
+		
+	}
+	
+}
+
+auto ObjectPool::exists(ObjectID _id) const -> bool {
+	
+	if (_id.slot >= m_slots.size())
+		return false;
+	auto& slot = m_slots[_id.slot];
+	return slot.generation == _id.generation && slot.index != FreeSlot;
+	
+}
+
+auto ObjectPool::dirtyIndices() const -> ivector<u32> {
+	
+	auto result = ivector<u32>();
+	result.reserve(m_dirtySlots.size());
+	for (auto slot: m_dirtySlots) {
+		
+		auto index = m_slots[slot].index;
+		if (index != FreeSlot)
+			result.push_back(index);
+		
+	}
+	return result;
 	
 }
 
 void ObjectPool::copyTransforms() {
 	
-	prevTransforms = transforms;
+	// Only dirty objects can have a transform different from the previous one
+	
+	auto remaining = usize(0);
+	for (auto slot: m_dirtySlots) {
+		
+		auto& s = m_slots[slot];
+		s.dirtyFrames -= 1;
+		s.relocated = false;
+		if (s.index != FreeSlot)
+			prevTransforms[s.index] = transforms[s.index];
+		
+		if (s.dirtyFrames > 0 && s.index != FreeSlot) {
+			
+			m_dirtySlots[remaining] = slot;
+			remaining += 1;
+			
+		} else {
+			
+			s.dirtyFrames = 0;
+			
+		}
+		
+	}
+	m_dirtySlots.resize(remaining);
+	
+}
+
+auto ObjectPool::CommandQueue::create(ID _modelID) -> ObjectID {
+	
+	// A freshly reserved slot always starts at generation 0
+	auto id = ObjectID{
+		.slot = m_pool.m_reservedSlots.fetch_add(1),
+		.generation = 0 };
+	m_commands.emplace_back(Create{id, _modelID});
+	return id;
+	
+}
+
+auto ObjectPool::indexOf(ObjectID _id) const -> u32 {
+	
+	if (!exists(_id))
+		throw logic_error_fmt("Invalid object handle: slot {}, generation {}", _id.slot, _id.generation);
+	return m_slots[_id.slot].index;
+	
+}
+
+auto ObjectPool::bucketOf(ID _modelID) -> u32 {
+	
+	if (auto it = m_bucketIndices.find(_modelID); it != m_bucketIndices.end())
+		return it->second;
+	
+	auto bucket = u32(m_buckets.size());
+	auto end = u32(size());
+	m_buckets.emplace_back(Bucket{
+		.modelID = _modelID,
+		.begin = end,
+		.end = end });
+	m_bucketIndices.emplace(_modelID, bucket);
+	return bucket;
+	
+}
+
+auto ObjectPool::insertInto(u32 _bucket, u32 _count) -> u32 {
+	
+	auto newSize = size() + _count;
+	visible.resize(newSize);
+	modelIDs.resize(newSize);
+	colors.resize(newSize);
+	transforms.resize(newSize);
+	prevTransforms.resize(newSize);
+	m_denseSlots.resize(newSize);
+	
+	// The unused range starts at the end of the last bucket, and travels
+	// backwards by one bucket at a time. Only objects that would be
+	// overwritten need to move
+	
+	for (auto i = m_buckets.size() - 1; i > _bucket; i -= 1) {
+		
+		auto& bucket = m_buckets[i];
+		auto moved = min(_count, bucket.end - bucket.begin);
+		for (auto j: iota(0u, moved))
+			moveObject(bucket.begin + j, bucket.end + _count - moved + j);
+		bucket.begin += _count;
+		bucket.end += _count;
+		
+	}
+	
+	auto& bucket = m_buckets[_bucket];
+	auto index = bucket.end;
+	bucket.end += _count;
+	return index;
+	
+}
+
+auto ObjectPool::acquireSlot() -> u32 {
+	
+	if (!m_freeSlots.empty()) {
+		
+		auto slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+		return slot;
+		
+	}
+	
+	auto slot = m_reservedSlots.fetch_add(1);
+	growSlots();
+	return slot;
+	
+}
+
+void ObjectPool::growSlots() {
+	
+	auto reserved = m_reservedSlots.load();
+	while (m_slots.size() < reserved) {
+		
+		m_slots.emplace_back(Slot{
+			.index = FreeSlot,
+			.generation = 0,
+			.dirtyFrames = 0,
+			.relocated = false });
+		
+	}
+	
+}
+
+auto ObjectPool::createAt(u32 _slot, ID _modelID) -> ObjectID {
+	
+	// Place the object at the end of its model's bucket
+	
+	auto index = insertInto(bucketOf(_modelID));
+	visible[index] = true;
+	modelIDs[index] = _modelID;
+	colors[index] = vec4(1.0f); // Fully opaque
+	transforms[index] = Transform::make_default();
+	prevTransforms[index] = Transform::make_default();
+	m_denseSlots[index] = _slot;
+	
+	m_slots[_slot].index = index;
+	m_slots[_slot].relocated = true;
+	markDirty(_slot);
+	return ObjectID{
+		.slot = _slot,
+		.generation = m_slots[_slot].generation };
+	
+}
+
+void ObjectPool::releaseSlot(u32 _slot) {
+	
+	auto& slot = m_slots[_slot];
+	slot.index = FreeSlot;
+	slot.generation += 1;
+	m_freeSlots.push_back(_slot);
+	
+}
+
+void ObjectPool::removeFrom(u32 _bucket, u32 _index) {
+	
+	// Fill the hole with the bucket's last object, then carry the hole
+	// forward through the following buckets
+	
+	auto& bucket = m_buckets[_bucket];
+	if (_index != bucket.end - 1)
+		moveObject(bucket.end - 1, _index);
+	bucket.end -= 1;
+	
+	for (auto i = _bucket + 1; i < m_buckets.size(); i += 1) {
+		
+		auto& next = m_buckets[i];
+		if (next.begin != next.end)
+			moveObject(next.end - 1, next.begin - 1);
+		next.begin -= 1;
+		next.end -= 1;
+		
+	}
+	
+	visible.pop_back();
+	modelIDs.pop_back();
+	colors.pop_back();
+	transforms.pop_back();
+	prevTransforms.pop_back();
+	m_denseSlots.pop_back();
+	
+}
+
+void ObjectPool::moveObject(u32 _from, u32 _to) {
+	
+	visible[_to] = visible[_from];
+	modelIDs[_to] = modelIDs[_from];
+	colors[_to] = colors[_from];
+	transforms[_to] = transforms[_from];
+	prevTransforms[_to] = prevTransforms[_from];
+	
+	auto slot = m_denseSlots[_from];
+	m_denseSlots[_to] = slot;
+	m_slots[slot].index = _to;
+	m_slots[slot].relocated = true;
+	markDirty(slot); // GPU copy needs to follow the move
+	
+}
+
+void ObjectPool::markDirty(u32 _slot) {
+	
+	auto& slot = m_slots[_slot];
+	if (slot.dirtyFrames == 0)
+		m_dirtySlots.push_back(_slot);
+	slot.dirtyFrames = DirtyFrames;
 	
 }
 
@@ -1,6 +1,12 @@
 #pragma once
 
 #include <type_traits>
+#include <variant>
+#include <memory>
+#include <atomic>
+#include <span>
+#include "base/containers/bitvector.hpp"
+#include "base/containers/hashmap.hpp"
 #include "base/containers/vector.hpp"
 #include "base/types.hpp"
 #include "base/math.hpp"
@@ -10,20 +16,29 @@ namespace minote::gfx {
 
 using namespace base;
 
-// Pool of renderable objects.
+// Pool of renderable objects. Objects are stored densely in a struct-of-arrays
+// layout, so that iteration over the pool only ever touches live objects.
+// The dense range is kept grouped into contiguous buckets of objects sharing
+// the same model. Creating, destroying or re-modelling an object moves at most
+// one object per bucket to keep the grouping intact.
+// Objects are tracked for changes, so that only modified objects need to be
+// uploaded to the GPU.
 struct ObjectPool {
 	
-	// Stable handle to an object in the pool
-	using ObjectID = usize;
+	// Number of frames an object stays dirty after a modification. The second
+	// frame is needed to bring prevTransform up to date.
+	static constexpr auto DirtyFrames = 2u;
 	
-	// Object state
-	struct Metadata {
+	// Stable handle to an object in the pool. The generation counter allows
+	// detecting handles to objects that were destroyed, even if their slot
+	// has since been reused.
+	struct ObjectID {
 		
-		bool visible; // Invisible objects are temporarily excluded from drawing
-		bool exists; // Do not modify - internal garbage collection
+		u32 slot;
+		u32 generation;
 		
-		// Construct with default values
-		static constexpr auto make_default() -> Metadata { return Metadata{true, true}; }
+		constexpr auto operator==(ObjectID const&) const -> bool = default;
+		constexpr auto operator!=(ObjectID const&) const -> bool = default;
 		
 	};
 	
@@ -48,44 +63,164 @@ struct ObjectPool {
 		
 	};
 	
+	// Contiguous range of objects using the same model
+	struct Bucket {
+		
+		ID modelID;
+		u32 begin;
+		u32 end;
+		
+	};
+	
 	// Convenient access to all properties of a single object
 	struct Proxy {
 		
-		Metadata& metadata;
-		ID& modelID;
+		bitvector::reference visible; // Invisible objects are temporarily excluded from drawing
+		ID const& modelID; // Use setModel() to change
 		vec4& color;
 		Transform& transform;
 		
 	};
 	
+	// Deferred list of modifications to the pool. Each queue can be recorded
+	// into by a single thread at a time, without any locking, while other
+	// threads record into their own queues. Commands take effect once
+	// the pool's applyCommands() is called.
+	struct CommandQueue {
+		
+		// Return a handle to an object that will be created with the given
+		// model and default properties. The handle can be used in further
+		// commands of the same queue right away, and everywhere else once
+		// the commands are applied.
+		[[nodiscard]]
+		auto create(ID modelID) -> ObjectID;
+		
+		void destroy(ObjectID id) { m_commands.emplace_back(Destroy{id}); }
+		void setVisible(ObjectID id, bool visible) { m_commands.emplace_back(SetVisible{id, visible}); }
+		void setModel(ObjectID id, ID modelID) { m_commands.emplace_back(SetModel{id, modelID}); }
+		void setColor(ObjectID id, vec4 color) { m_commands.emplace_back(SetColor{id, color}); }
+		void setTransform(ObjectID id, Transform const& transform) { m_commands.emplace_back(SetTransform{id, transform}); }
+		
+		// Number of commands waiting to be applied.
+		[[nodiscard]]
+		auto size() const -> usize { return m_commands.size(); }
+		
+		explicit CommandQueue(ObjectPool& pool): m_pool(pool) {}
+		
+		// Not copyable, not movable
+		CommandQueue(CommandQueue const&) = delete;
+		auto operator=(CommandQueue const&) -> CommandQueue& = delete;
+	
+	private:
+		
+		friend struct ObjectPool;
+		
+		struct Create { ObjectID id; ID modelID; };
+		struct Destroy { ObjectID id; };
+		struct SetVisible { ObjectID id; bool visible; };
+		struct SetModel { ObjectID id; ID modelID; };
+		struct SetColor { ObjectID id; vec4 color; };
+		struct SetTransform { ObjectID id; Transform transform; };
+		
+		using Command = std::variant<Create, Destroy, SetVisible, SetModel, SetColor, SetTransform>;
+		
+		ObjectPool& m_pool;
+		ivector<Command> m_commands;
+		
+	};
+	
 	// Ensure fast operation in large containers
-	static_assert(std::is_trivially_constructible_v<Metadata>);
 	static_assert(std::is_trivially_constructible_v<Transform>);
+	static_assert(std::is_trivially_constructible_v<ObjectID>);
+	
+	// Return a handle to a new object using the given model, with default
+	// properties. Remember to destroy() the object.
+	[[nodiscard]]
+	auto create(ID modelID) -> ObjectID;
 	
-	// Return a handle to a new, uninitialized object. See above which fields
-	// do not have a default initializer. Remember to destroy() the object.
+	// Create many objects of the same model at once, with default properties.
+	// Much faster than calling create() in a loop, since the containers
+	// are only grown and the buckets only shifted once.
 	[[nodiscard]]
-	auto create() -> ObjectID;
+	auto createBatch(ID modelID, usize count) -> ivector<ObjectID>;
 	
-	// Destroy the object, freeing up the ID for use with objects created
-	// in the future.
+	// Destroy the object, freeing up the slot for use with objects created
+	// in the future. The handle becomes stale, and any further use of it
+	// will throw.
 	void destroy(ObjectID);
 	
+	// Destroy many objects at once. Each bucket is compacted and shifted only
+	// once, regardless of how many objects are destroyed. Throws without
+	// destroying anything if any handle is invalid or repeated.
+	void destroyBatch(std::span<ObjectID const>);
+	
 	// Return a proxy for convenient access to an object's properties. The proxy
 	// can only be considered valid until any other ObjectPool method is called.
+	// The object is marked as dirty.
 	[[nodiscard]]
 	auto get(ObjectID) -> Proxy;
 	
+	// Move the object into the bucket of a different model. The object
+	// is marked as dirty.
+	void setModel(ObjectID, ID modelID);
+	
+	// Return a new command queue, owned by the pool. Creating queues is not
+	// thread-safe; typically each worker thread receives one during setup.
+	[[nodiscard]]
+	auto createCommandQueue() -> CommandQueue&;
+	
+	// Execute and clear the commands of all queues. Queues are processed
+	// in order of creation, and each queue's commands in order of recording,
+	// so the result doesn't depend on thread timing. Commands referring
+	// to objects that no longer exist are skipped, since another thread might
+	// have destroyed the object in the meantime. No queue can be recorded into
+	// while this runs.
+	void applyCommands();
+	
+	// Check whether the handle refers to an object that still exists.
+	[[nodiscard]]
+	auto exists(ObjectID) const -> bool;
+	
+	// Return the positions of all objects that were modified within
+	// the last DirtyFrames frames.
+	[[nodiscard]]
+	auto dirtyIndices() const -> ivector<u32>;
+	
+	// Check whether the object at the given position was created or moved
+	// to it since the last copyTransforms().
+	[[nodiscard]]
+	auto wasRelocated(u32 index) const -> bool { return m_slots[m_denseSlots[index]].relocated; }
+	
+	// Return the handle of the object currently at the given position.
+	[[nodiscard]]
+	auto idAt(u32 index) const -> ObjectID {
+		
+		auto slot = m_denseSlots[index];
+		return ObjectID{
+			.slot = slot,
+			.generation = m_slots[slot].generation };
+		
+	}
+	
+	// Finish the frame. Copies transforms to prevTransforms and ages
+	// the dirty state of modified objects.
 	void copyTransforms();
 	
-	// Return the current size of the pool. This might include nonexistent
-	// objects, so it's only useful for transfers.
+	// Return the number of objects in the pool. All objects in the range
+	// [0, size()) of the property containers are live.
+	[[nodiscard]]
+	auto size() const -> usize { return modelIDs.size(); }
+	
+	// Buckets in order of their position in the property containers. Buckets
+	// never overlap, and cover the range [0, size()). Some can be empty.
 	[[nodiscard]]
-	auto size() const -> usize { return metadata.size(); }
+	auto buckets() const -> ivector<Bucket> const& { return m_buckets; }
 	
 	// Direct access to these is discouraged, unless you're doing a whole
-	// container transfer.
-	ivector<Metadata> metadata;
+	// container transfer. Indices into these are not stable - use ObjectIDs
+	// to keep track of individual objects. Modifications made directly
+	// are not tracked, and might not reach the GPU.
+	bitvector visible; // Use visible.forEachSet() to skip over hidden objects quickly
 	ivector<ID> modelIDs;
 	ivector<vec4> colors;
 	ivector<Transform> transforms;
@@ -93,7 +228,60 @@ struct ObjectPool {
 	
 private:
 	
-	ivector<ObjectID> m_deletedIDs;
+	// Indirection from a handle to the object's current position
+	struct Slot {
+		u32 index; // Position in the property containers, or FreeSlot
+		u32 generation;
+		u32 dirtyFrames; // Frames left until the object is considered clean
+		bool relocated; // Object's position changed within the current frame
+	};
+	
+	static constexpr auto FreeSlot = ~0u;
+	
+	ivector<Slot> m_slots;
+	ivector<u32> m_freeSlots;
+	ivector<u32> m_denseSlots; // Slot of the object at each position
+	ivector<u32> m_dirtySlots; // Slots with dirtyFrames > 0, unordered
+	
+	ivector<Bucket> m_buckets;
+	hashmap<ID, u32> m_bucketIndices; // Bucket of each model ever used
+	
+	ivector<std::unique_ptr<CommandQueue>> m_queues;
+	std::atomic<u32> m_reservedSlots = 0; // Slots handed out so far, possibly more than m_slots.size()
+	
+	// Return the position of an object, throwing if the handle is stale.
+	auto indexOf(ObjectID) const -> u32;
+	
+	// Return the bucket of a model, creating it at the end if needed.
+	auto bucketOf(ID modelID) -> u32;
+	
+	// Open up count unused positions at the end of a bucket, growing
+	// the property containers. Later buckets are shifted by moving up to count
+	// objects from their start to their end. Returns the first position.
+	auto insertInto(u32 bucket, u32 count = 1) -> u32;
+	
+	// Return a free slot, growing the slot list if needed.
+	auto acquireSlot() -> u32;
+	
+	// Add free slots to the list until all reserved slots exist. Slots
+	// reserved by a command queue are not added to the free list.
+	void growSlots();
+	
+	// Create an object in a specific slot.
+	auto createAt(u32 slot, ID modelID) -> ObjectID;
+	
+	// Invalidate all existing handles to the slot, and make it available.
+	void releaseSlot(u32 slot);
+	
+	// Remove the object at a position from a bucket, shrinking the property
+	// containers by one. The object's slot is not freed.
+	void removeFrom(u32 bucket, u32 index);
+	
+	// Move an object to a different position, overwriting the destination.
+	void moveObject(u32 from, u32 to);
+	
+	// Schedule the object in the slot for upload.
+	void markDirty(u32 slot);
 	
 };
 
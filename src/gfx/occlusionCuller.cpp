@@ -0,0 +1,397 @@
+#include "gfx/occlusionCuller.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <limits>
+#include <cmath>
+#include "base/containers/array.hpp"
+#include "base/util.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+using namespace base::literals;
+
+// Number of objects tested by a single thread at a time. Multiple of
+// the bitvector's word size, so that threads never write to the same word
+constexpr auto CullChunkSize = 4096_zu;
+static_assert(CullChunkSize % bitvector::WordBits == 0);
+
+// Pixels written together when rasterizing a span; one AVX2 register of floats
+constexpr auto SpanLanes = 8;
+
+// Coverage mask of a pixel with all samples covered
+constexpr auto FullCoverage = u16((1u << (OcclusionCuller::SampleGrid * OcclusionCuller::SampleGrid)) - 1);
+
+// Signed distance from the near plane in clip space; negative is behind it.
+// Reverse-Z puts the near plane at z == w
+constexpr auto nearDistance(vec4 _v) -> f32 { return _v.w() - _v.z(); }
+
+// Edge function of a triangle, positive inside: A * x + B * y + C. Moving
+// the edge by its slack, the most it can change between a pixel's center
+// and its corners, tells apart pixels the triangle fully covers from ones
+// it only touches
+struct Edge {
+	f32 a;
+	f32 b;
+	f32 c;
+	f32 slack;
+};
+
+constexpr auto makeEdge(vec3 _from, vec3 _to) -> Edge {
+	
+	auto a = -(_to.y() - _from.y());
+	auto b = _to.x() - _from.x();
+	auto c = -(a * _from.x() + b * _from.y());
+	return Edge{a, b, c, 0.5f * (std::abs(a) + std::abs(b))};
+	
+}
+
+// Mask of the samples of a pixel that are inside all three edges
+auto sampleCoverage(array<Edge, 3> const& _edges, u32 _x, u32 _y) -> u16 {
+	
+	auto mask = u16(0);
+	for (auto sy: iota(0u, OcclusionCuller::SampleGrid))
+	for (auto sx: iota(0u, OcclusionCuller::SampleGrid)) {
+		
+		auto sampleX = f32(_x) + (f32(sx) + 0.5f) / f32(OcclusionCuller::SampleGrid);
+		auto sampleY = f32(_y) + (f32(sy) + 0.5f) / f32(OcclusionCuller::SampleGrid);
+		auto inside = std::all_of(_edges.begin(), _edges.end(), [&](Edge const& _edge) {
+			return _edge.a * sampleX + _edge.b * sampleY + _edge.c >= 0.0f;
+		});
+		if (inside)
+			mask |= u16(1u << (sy * OcclusionCuller::SampleGrid + sx));
+		
+	}
+	return mask;
+	
+}
+
+// Clip space to buffer coordinates and depth
+constexpr auto toScreen(vec4 _v) -> vec3 {
+	
+	return vec3{
+		(_v.x() / _v.w() * 0.5f + 0.5f) * f32(OcclusionCuller::Width),
+		(_v.y() / _v.w() * 0.5f + 0.5f) * f32(OcclusionCuller::Height),
+		_v.z() / _v.w()};
+	
+}
+
+void OcclusionCuller::begin(mat4 _viewProjection) {
+	
+	m_viewProjection = _viewProjection;
+	m_depth.resize(Width * Height);
+	m_coverage.resize(Width * Height);
+	m_coverageDepth.resize(Width * Height);
+	m_tileDepth.resize(TilesX * TilesY);
+	std::fill(m_depth.begin(), m_depth.end(), 0.0f);
+	std::fill(m_coverage.begin(), m_coverage.end(), 0);
+	std::fill(m_coverageDepth.begin(), m_coverageDepth.end(), std::numeric_limits<f32>::max());
+	
+}
+
+void OcclusionCuller::drawOccluder(std::span<vec3 const> _triangles, mat4 const& _model) {
+	
+	auto transform = m_viewProjection * _model;
+	
+	for (auto i = 0_zu; i + 2 < _triangles.size(); i += 3) {
+		
+		auto v0 = transform * vec4(_triangles[i + 0], 1.0f);
+		auto v1 = transform * vec4(_triangles[i + 1], 1.0f);
+		auto v2 = transform * vec4(_triangles[i + 2], 1.0f);
+		
+		// Trivially reject triangles fully outside a side plane
+		
+		if ((v0.x() > v0.w() && v1.x() > v1.w() && v2.x() > v2.w()) ||
+			(v0.x() < -v0.w() && v1.x() < -v1.w() && v2.x() < -v2.w()) ||
+			(v0.y() > v0.w() && v1.y() > v1.w() && v2.y() > v2.w()) ||
+			(v0.y() < -v0.w() && v1.y() < -v1.w() && v2.y() < -v2.w()))
+			continue;
+		
+		// Clip against the near plane, which can turn the triangle into a quad
+		
+		auto in = to_array({v0, v1, v2});
+		auto out = svector<vec4, 4>();
+		for (auto j: iota(0_zu, 3_zu)) {
+			
+			auto current = in[j];
+			auto next = in[(j + 1) % 3];
+			auto currentDist = nearDistance(current);
+			auto nextDist = nearDistance(next);
+			
+			if (currentDist >= 0.0f)
+				out.push_back(current);
+			if ((currentDist >= 0.0f) != (nextDist >= 0.0f)) {
+				
+				auto t = currentDist / (currentDist - nextDist);
+				out.push_back(current + (next - current) * t);
+				
+			}
+			
+		}
+		
+		for (auto j = 2_zu; j < out.size(); j += 1)
+			drawTriangle(out[0], out[j - 1], out[j]);
+		
+	}
+	
+}
+
+void OcclusionCuller::finish() {
+	
+	for (auto ty: iota(0u, TilesY))
+	for (auto tx: iota(0u, TilesX)) {
+		
+		auto farthest = std::numeric_limits<f32>::max();
+		for (auto y: iota(ty * TileSize, (ty + 1) * TileSize))
+		for (auto x: iota(tx * TileSize, (tx + 1) * TileSize))
+			farthest = std::min(farthest, m_depth[y * Width + x]);
+		m_tileDepth[ty * TilesX + tx] = farthest;
+		
+	}
+	
+}
+
+auto OcclusionCuller::isOccluded(AABB const& _bounds) const -> bool {
+	
+	// Project the box, and find its screen rectangle and nearest depth
+	
+	auto rectMin = vec2(std::numeric_limits<f32>::max());
+	auto rectMax = vec2(std::numeric_limits<f32>::lowest());
+	auto nearest = 0.0f;
+	for (auto i: iota(0u, 8u)) {
+		
+		auto corner = vec3{
+			(i & 1)? _bounds.max.x() : _bounds.min.x(),
+			(i & 2)? _bounds.max.y() : _bounds.min.y(),
+			(i & 4)? _bounds.max.z() : _bounds.min.z()};
+		auto clip = m_viewProjection * vec4(corner, 1.0f);
+		if (nearDistance(clip) <= 0.0f)
+			return false; // Crosses the near plane, so it's definitely in view
+		
+		auto screen = toScreen(clip);
+		rectMin = min(rectMin, vec2(screen));
+		rectMax = max(rectMax, vec2(screen));
+		nearest = std::max(nearest, screen.z());
+		
+	}
+	
+	// A pixel can be written while a sliver along its border, outside of
+	// its samples, is still uncovered. Growing the rectangle by a sample's
+	// spacing makes a box reaching into such a sliver also test the pixel
+	// next to it
+	
+	auto margin = vec2(1.0f / f32(SampleGrid));
+	rectMin = rectMin - margin;
+	rectMax = rectMax + margin;
+	
+	// Anything partially off-screen is treated as visible
+	
+	if (rectMin.x() < 0.0f || rectMin.y() < 0.0f ||
+		rectMax.x() >= f32(Width) || rectMax.y() >= f32(Height))
+		return false;
+	
+	auto x0 = u32(rectMin.x());
+	auto y0 = u32(rectMin.y());
+	auto x1 = u32(rectMax.x());
+	auto y1 = u32(rectMax.y());
+	
+	// Every covered pixel needs an occluder in front of the box
+	
+	for (auto ty: iota(y0 / TileSize, y1 / TileSize + 1))
+	for (auto tx: iota(x0 / TileSize, x1 / TileSize + 1)) {
+		
+		if (m_tileDepth[ty * TilesX + tx] > nearest) continue;
+		
+		auto yBegin = std::max(y0, ty * TileSize);
+		auto yEnd = std::min(y1 + 1, (ty + 1) * TileSize);
+		auto xBegin = std::max(x0, tx * TileSize);
+		auto xEnd = std::min(x1 + 1, (tx + 1) * TileSize);
+		for (auto y: iota(yBegin, yEnd))
+		for (auto x: iota(xBegin, xEnd))
+			if (m_depth[y * Width + x] <= nearest) return false;
+		
+	}
+	
+	return true;
+	
+}
+
+void OcclusionCuller::cull(ThreadPool& _threadPool, ObjectPool const& _objects, ObjectBVH const& _bvh,
+	ModelBuffer const& _models, mat4 _viewProjection, bitvector& _visible) {
+	
+	begin(_viewProjection);
+	
+	// Draw occluders. They are never culled themselves, since they would
+	// be hidden behind their own depth
+	
+	auto occluders = bitvector();
+	occluders.resize(_objects.size());
+	for (auto& bucket: _objects.buckets()) {
+		
+		if (bucket.begin == bucket.end) continue;
+		
+		auto& triangles = _models.cpu_occluders[_models.cpu_modelIndices.at(bucket.modelID)];
+		if (triangles.empty()) continue;
+		
+		_visible.forEachSet(bucket.begin, bucket.end, [&](usize idx) {
+			
+			auto& transform = _objects.transforms[idx];
+			auto model =
+				mat4::translate(transform.position) *
+				mat4::rotate(transform.rotation) *
+				mat4::scale(transform.scale);
+			drawOccluder({triangles.data(), triangles.size()}, model);
+			occluders[idx] = true;
+			
+		});
+		
+	}
+	finish();
+	
+	// Test everything else
+	
+	auto chunkCount = (_objects.size() + CullChunkSize - 1) / CullChunkSize;
+	_threadPool.parallelFor(chunkCount, [&](usize _chunkIdx) {
+		
+		auto begin = _chunkIdx * CullChunkSize;
+		auto end = std::min(begin + CullChunkSize, _objects.size());
+		_visible.forEachSet(begin, end, [&](usize idx) {
+			
+			if (occluders[idx]) return;
+			if (isOccluded(_bvh.objectBounds(idx)))
+				_visible[idx] = false;
+			
+		});
+		
+	});
+	
+}
+
+void OcclusionCuller::drawTriangle(vec4 _v0, vec4 _v1, vec4 _v2) {
+	
+	auto s0 = toScreen(_v0);
+	auto s1 = toScreen(_v1);
+	auto s2 = toScreen(_v2);
+	
+	// Both windings are drawn; make the triangle counter-clockwise
+	
+	auto area = (s1.x() - s0.x()) * (s2.y() - s0.y()) - (s1.y() - s0.y()) * (s2.x() - s0.x());
+	if (std::abs(area) < 1e-8f) return;
+	if (area < 0.0f) {
+		
+		std::swap(s1, s2);
+		area = -area;
+		
+	}
+	
+	// Depth plane. Each pixel is written with the plane's farthest value
+	// over the pixel's area, but no farther than the triangle itself
+	
+	auto dzdx = ((s1.z() - s0.z()) * (s2.y() - s0.y()) - (s2.z() - s0.z()) * (s1.y() - s0.y())) / area;
+	auto dzdy = ((s2.z() - s0.z()) * (s1.x() - s0.x()) - (s1.z() - s0.z()) * (s2.x() - s0.x())) / area;
+	auto pixelSlack = 0.5f * (std::abs(dzdx) + std::abs(dzdy));
+	auto farthest = std::min({s0.z(), s1.z(), s2.z()});
+	
+	auto edges = to_array({makeEdge(s0, s1), makeEdge(s1, s2), makeEdge(s2, s0)});
+	
+	// Range of pixels in a row whose centers pass all edges, each moved
+	// outwards by its slack times the given factor. Bounds are clamped
+	// as floats, so that they always fit an integer
+	auto rowSpan = [&](f32 _py, f32 _slackFactor) {
+		
+		auto left = 0.0f;
+		auto right = f32(Width);
+		for (auto& edge: edges) {
+			
+			auto rowC = edge.b * _py + edge.c + edge.slack * _slackFactor;
+			if (edge.a > 0.0f)
+				left = std::max(left, -rowC / edge.a);
+			else if (edge.a < 0.0f)
+				right = std::min(right, -rowC / edge.a);
+			else if (rowC < 0.0f)
+				right = -1.0f;
+			
+		}
+		
+		auto begin = i32(std::clamp(std::ceil(left - 0.5f), 0.0f, f32(Width)));
+		auto end = i32(std::clamp(std::floor(right - 0.5f) + 1.0f, 0.0f, f32(Width)));
+		return std::pair{begin, std::max(begin, end)};
+		
+	};
+	
+	auto yMin = std::max(std::floor(std::min({s0.y(), s1.y(), s2.y()})), 0.0f);
+	auto yMax = std::min(std::ceil(std::max({s0.y(), s1.y(), s2.y()})), f32(Height));
+	
+	for (auto y: iota(u32(yMin), u32(yMax))) {
+		
+		auto py = f32(y) + 0.5f;
+		auto [fullBegin, fullEnd] = rowSpan(py, -1.0f);
+		auto [touchedBegin, touchedEnd] = rowSpan(py, 1.0f);
+		if (fullBegin == fullEnd)
+			fullBegin = fullEnd = touchedEnd;
+		
+		auto rowDepth = s0.z() + dzdy * (py - s0.y()) + dzdx * (0.5f - s0.x()) - pixelSlack;
+		auto* row = &m_depth[y * Width];
+		
+		// Fully covered pixels are written in blocks of SpanLanes. A block
+		// has a fixed trip count and no dependencies between lanes, so it
+		// compiles to vector max instructions even where the compiler won't
+		// vectorize a loop that needs a remainder
+		
+		auto x = fullBegin;
+		for (; x + SpanLanes <= fullEnd; x += SpanLanes) {
+			
+			auto* pixels = row + x;
+			for (auto lane = 0; lane < SpanLanes; lane += 1) {
+				
+				auto depth = std::max(rowDepth + dzdx * f32(x + lane), farthest);
+				pixels[lane] = std::max(pixels[lane], depth);
+				
+			}
+			
+		}
+		for (; x < fullEnd; x += 1) {
+			
+			auto depth = std::max(rowDepth + dzdx * f32(x), farthest);
+			row[x] = std::max(row[x], depth);
+			
+		}
+		
+		// Pixels along the edges only add the samples they cover
+		
+		auto addPartial = [&](i32 _x) {
+			
+			auto depth = std::max(rowDepth + dzdx * f32(_x), farthest);
+			addCoverage(u32(_x), y, sampleCoverage(edges, u32(_x), y), depth);
+			
+		};
+		for (auto px: iota(touchedBegin, fullBegin))
+			addPartial(px);
+		for (auto px: iota(fullEnd, touchedEnd))
+			addPartial(px);
+		
+	}
+	
+}
+
+void OcclusionCuller::addCoverage(u32 _x, u32 _y, u16 _mask, f32 _depth) {
+	
+	if (!_mask) return;
+	
+	// The pixel gets a depth once the masks of all triangles touching it
+	// add up to full coverage, so that edges shared by two triangles don't
+	// leave a gap. The depth is the farthest of all these triangles
+	
+	auto idx = _y * Width + _x;
+	m_coverage[idx] |= _mask;
+	m_coverageDepth[idx] = std::min(m_coverageDepth[idx], _depth);
+	if (m_coverage[idx] != FullCoverage) return;
+	
+	m_depth[idx] = std::max(m_depth[idx], m_coverageDepth[idx]);
+	m_coverage[idx] = 0;
+	m_coverageDepth[idx] = std::numeric_limits<f32>::max();
+	
+}
+
+}
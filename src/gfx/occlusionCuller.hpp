@@ -0,0 +1,80 @@
+#pragma once
+
+#include <span>
+#include "base/containers/bitvector.hpp"
+#include "base/containers/vector.hpp"
+#include "base/threadPool.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "gfx/objectBvh.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/models.hpp"
+#include "gfx/util.hpp"
+
+namespace minote::gfx {
+
+using namespace base;
+
+// Software occlusion culling on the CPU. Occluder models are rasterized into
+// a small reverse-Z depth buffer, and object bounds are tested against it.
+// Each pixel stores the farthest depth of the occluder across its area, so
+// an object is only reported as occluded if it's fully behind occluders.
+// Pixels that triangles only partially cover collect a mask of covered
+// samples, and are written once the masks add up to the whole pixel.
+struct OcclusionCuller {
+	
+	static constexpr auto Width = 256u;
+	static constexpr auto Height = 128u;
+	
+	// Tiles store the farthest depth of their pixels, allowing large boxes
+	// to be tested without visiting every pixel
+	static constexpr auto TileSize = 8u;
+	static_assert(Width % TileSize == 0 && Height % TileSize == 0);
+	
+	// Pixels partially covered by triangles are sampled on a grid of this
+	// size along each axis
+	static constexpr auto SampleGrid = 4u;
+	static_assert(SampleGrid * SampleGrid <= 16);
+	
+	// Clear the depth buffer, and set the view for the following calls.
+	void begin(mat4 viewProjection);
+	
+	// Rasterize a triangle list in model space, with the given model matrix.
+	void drawOccluder(std::span<vec3 const> triangles, mat4 const& model);
+	
+	// Finish drawing occluders. Must be called before any tests.
+	void finish();
+	
+	// Check whether a world-space box is fully hidden behind the occluders.
+	[[nodiscard]]
+	auto isOccluded(AABB const&) const -> bool;
+	
+	// Run a whole pass: draw all objects in visible that use occluder models,
+	// then clear the bits of objects that are hidden behind them.
+	void cull(ThreadPool&, ObjectPool const&, ObjectBVH const&, ModelBuffer const&,
+		mat4 viewProjection, bitvector& visible);
+	
+	// Depth buffer contents, row by row.
+	[[nodiscard]]
+	auto depth() const -> std::span<f32 const> { return {m_depth.data(), m_depth.size()}; }
+	
+private:
+	
+	static constexpr auto TilesX = Width / TileSize;
+	static constexpr auto TilesY = Height / TileSize;
+	
+	mat4 m_viewProjection;
+	pvector<f32> m_depth; // Larger values are nearer, 0 is infinitely far
+	pvector<u16> m_coverage; // Samples covered by triangles not yet written to m_depth
+	pvector<f32> m_coverageDepth; // Farthest depth of the triangles in m_coverage
+	pvector<f32> m_tileDepth;
+	
+	// Rasterize a single triangle in clip space, in front of the near plane.
+	void drawTriangle(vec4 v0, vec4 v1, vec4 v2);
+	
+	// Add samples of a pixel covered by a triangle at the given depth.
+	void addCoverage(u32 x, u32 y, u16 mask, f32 depth);
+	
+};
+
+}
@@ -30,6 +30,11 @@ struct Buffer {
 	// still proceeds. Setting elementCapacity allows for a buffer larger than provided data.
 	static auto make(Pool&, vuk::Name, vuk::BufferUsageFlags, std::span<T const> data, usize elementCapacity = 0_zu) -> Buffer<T>;
 	
+	// Construct a host-visible buffer inside a pool, with uninitialized contents. Data can be
+	// written directly into mappedSpan(), avoiding an intermediate copy. If the pool already
+	// contained a buffer under the same name, the existing one is retrieved instead.
+	static auto makeMapped(Pool&, vuk::Name, vuk::BufferUsageFlags, usize elements) -> Buffer<T>;
+	
 	// Create a buffer reference that starts at the specified element count.
 	auto offsetView(usize elements) const -> vuk::Buffer;
 	
@@ -43,6 +48,10 @@ struct Buffer {
 	[[nodiscard]]
 	auto mappedPtr() -> T* { return reinterpret_cast<T*>(handle->mapped_ptr); }
 	
+	// Mapped memory of a host-visible buffer, as a range of elements.
+	[[nodiscard]]
+	auto mappedSpan() -> std::span<T> { return std::span(mappedPtr(), length()); }
+	
 	// Declare as a vuk::Resource.
 	[[nodiscard]]
 	auto resource(vuk::Access) const -> vuk::Resource;
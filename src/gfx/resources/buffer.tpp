@@ -69,6 +69,17 @@ auto Buffer<T>::make(Pool& _pool, vuk::Name _name, vuk::BufferUsageFlags _usage,
 	
 }
 
+template<typename T>
+auto Buffer<T>::makeMapped(Pool& _pool, vuk::Name _name, vuk::BufferUsageFlags _usage,
+	usize _elements) -> Buffer<T> {
+	
+	auto result = make(_pool, _name, _usage, _elements, vuk::MemoryUsage::eCPUtoGPU);
+	assert(result.handle->mapped_ptr);
+	assert(result.length() >= _elements);
+	return result;
+	
+}
+
 template<typename T>
 auto Buffer<T>::offsetView(usize _elements) const -> vuk::Buffer {
 	
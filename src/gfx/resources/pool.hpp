@@ -53,6 +53,10 @@ struct Pool {
 		
 	}
 	
+	// Enqueue destruction of the resource at the given name. If there is no such resource,
+	// nothing happens.
+	void erase(vuk::Name name) { m_resources.erase(name); }
+	
 private:
 	
 	vuk::PerThreadContext* m_ptc;
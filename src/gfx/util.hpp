@@ -1,5 +1,6 @@
 #pragma once
 
+#include <bit>
 #include "vuk/CommandBuffer.hpp"
 #include "vuk/Types.hpp"
 #include "vuk/Name.hpp"
@@ -74,6 +75,50 @@ constexpr auto u32Fromu16(uvec2 _v) -> u32 {
 	
 }
 
+// Convert to IEEE 754 half precision, rounding to nearest even. Values out of range
+// become infinity. Matches GLSL unpackHalf2x16()
+constexpr auto packHalf(f32 _val) -> u16 {
+	
+	auto bits = std::bit_cast<u32>(_val);
+	auto sign = (bits >> 16) & 0x8000u;
+	auto exponent = i32((bits >> 23) & 0xFFu) - 127 + 15;
+	auto mantissa = bits & 0x7FFFFFu;
+	
+	if (((bits >> 23) & 0xFFu) == 0xFFu) // Infinity or NaN
+		return u16(sign | 0x7C00u | (mantissa? 0x200u : 0u));
+	if (exponent >= 31) // Overflow
+		return u16(sign | 0x7C00u);
+	
+	if (exponent <= 0) { // Subnormal or zero
+		
+		if (exponent < -10) return u16(sign);
+		mantissa |= 0x800000u;
+		auto shift = u32(14 - exponent);
+		auto result = mantissa >> shift;
+		auto remainder = mantissa & ((1u << shift) - 1u);
+		auto halfway = 1u << (shift - 1u);
+		if (remainder > halfway || (remainder == halfway && (result & 1u)))
+			result += 1;
+		return u16(sign | result);
+		
+	}
+	
+	auto result = sign | (u32(exponent) << 10) | (mantissa >> 13);
+	auto remainder = mantissa & 0x1FFFu;
+	if (remainder > 0x1000u || (remainder == 0x1000u && (result & 1u)))
+		result += 1; // Carry into the exponent is correct behavior
+	return u16(result);
+	
+}
+
+// Convert a value in the [-1, 1] range to a 16-bit signed normalized integer.
+// Matches GLSL unpackSnorm2x16()
+constexpr auto packSnorm16(f32 _val) -> u16 {
+	
+	return u16(i16(round(clamp(_val, -1.0f, 1.0f) * 32767.0f)));
+	
+}
+
 // Shorthand for setting rendering area
 inline void cmdSetViewportScissor(vuk::CommandBuffer cmd, uvec2 area) {
 	
@@ -15,9 +15,20 @@ layout(binding = 2, std430) restrict readonly buffer Instances {
 layout(binding = 3, std430) restrict readonly buffer Transforms {
 	mat3x4 b_transforms[];
 };
+layout(binding = 4, std430) restrict readonly buffer InstanceCounts {
+	uvec4 b_instanceCounts[2]; // Early and late phase
+};
 
 void main() {
 	
+	// Move excess instances outside of the clip volume
+	if (uint(gl_InstanceIndex) >= b_instanceCounts[0].w + b_instanceCounts[1].w) {
+		
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+		return;
+		
+	}
+	
 	Instance instance = b_instances[gl_InstanceIndex];
 	
 	uint aabbOffset = instance.meshletIdx * 6;
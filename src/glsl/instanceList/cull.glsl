@@ -0,0 +1,88 @@
+// Bounding sphere visibility tests shared by culling passes. The including
+// shader needs to declare u_view, u_frustum, u_P00, u_P11, s_hiz, ZNear,
+// HiZSize and HiZInner first.
+
+#ifndef CULL_GLSL
+#define CULL_GLSL
+
+#include "../util.glsl"
+
+// 2D Polyhedral Bounds of a Clipped, Perspective-Projected 3D Sphere. Michael Mara, Morgan McGuire. 2013
+bool projectSphere(vec3 C, float r, float znear, float P00, float P11, out vec4 aabb) {
+	
+	if (C.z < r + znear)
+		return false;
+	
+	vec2 cx = -C.xz;
+	vec2 vx = vec2(sqrt(dot(cx, cx) - r * r), r);
+	vec2 minx = mat2(vx.x, vx.y, -vx.y, vx.x) * cx;
+	vec2 maxx = mat2(vx.x, -vx.y, vx.y, vx.x) * cx;
+	
+	vec2 cy = -C.yz;
+	vec2 vy = vec2(sqrt(dot(cy, cy) - r * r), r);
+	vec2 miny = mat2(vy.x, vy.y, -vy.y, vy.x) * cy;
+	vec2 maxy = mat2(vy.x, -vy.y, vy.y, vy.x) * cy;
+	
+	aabb = vec4(minx.x / minx.y * P00, miny.x / miny.y * P11, maxx.x / maxx.y * P00, maxy.x / maxy.y * P11);
+	aabb = aabb.xwzy * vec4(0.5f, -0.5f, 0.5f, -0.5f) + vec4(0.5f); // clip space -> uv space
+	
+	return true;
+	
+}
+
+// Largest scale factor of a transform along any axis.
+float transformScale(mat4 _transform) {
+	
+	return max(
+		length(_transform[0].xyz), max(
+		length(_transform[1].xyz),
+		length(_transform[2].xyz)));
+	
+}
+
+// Move a model-space bounding sphere into world space.
+void transformSphere(mat4 _transform, inout vec3 _center, inout float _radius) {
+	
+	_center = vec3(_transform * vec4(_center, 1.0));
+	_radius *= transformScale(_transform);
+	
+}
+
+// Test a world-space bounding sphere against the frustum.
+bool isSphereInFrustum(vec3 _center, float _radius) {
+	
+	vec3 viewCenter = vec3(u_view * vec4(_center, 1.0));
+	return
+		(viewCenter.z * u_frustum[1] - abs(viewCenter.x) * u_frustum[0] > -_radius) &&
+		(viewCenter.z * u_frustum[3] - abs(viewCenter.y) * u_frustum[2] > -_radius);
+	
+}
+
+// Test a world-space bounding sphere against the HiZ. Spheres that cross
+// the near plane are never occluded.
+bool isSphereOccluded(vec3 _center, float _radius) {
+	
+	vec3 viewCenter = vec3(u_view * vec4(_center, 1.0));
+	viewCenter.y *= -1;
+	
+	vec4 aabb;
+	if (!projectSphere(viewCenter, _radius, ZNear, u_P00, u_P11, aabb))
+		return false;
+	
+	float width = (aabb.z - aabb.x) * HiZInner.x;
+	float height = (aabb.w - aabb.y) * HiZInner.y;
+	
+	float level = floor(log2(max(width, height)));
+	vec2 offset = vec2(HiZSize - HiZInner) / 2.0 / vec2(HiZSize);
+	vec2 scale = vec2(HiZInner) / vec2(HiZSize);
+	
+	// Sampler is set up to do min reduction, so this computes the minimum depth of a 2x2 texel quad
+	vec2 depthUv = saturate((aabb.xy + aabb.zw) * 0.5) * scale + offset;
+	float depth = textureLod(s_hiz, depthUv, level).x;
+	float depthSphere = ZNear / (viewCenter.z - _radius);
+	
+	return depthSphere <= depth;
+	
+}
+
+#endif //CULL_GLSL
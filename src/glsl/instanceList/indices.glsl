@@ -1,6 +1,20 @@
 #ifndef INDICES_GLSL
 #define INDICES_GLSL
 
-#define INSTANCE_ID_BITS 6u
+// A visible triangle is stored as the index of its meshlet instance, and
+// its three meshlet-local vertex indices packed into 8 bits each. Its position
+// in the triangle list is its visibility ID. Must match MeshletCuller.
+
+uint packTriangle(uvec3 _indices) {
+	
+	return _indices.x | (_indices.y << 8) | (_indices.z << 16);
+	
+}
+
+uvec3 unpackTriangle(uint _packed) {
+	
+	return (uvec3(_packed) >> uvec3(0, 8, 16)) & 0xFFu;
+	
+}
 
 #endif //INDICES_GLSL
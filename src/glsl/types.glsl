@@ -21,12 +21,11 @@ struct World {
 	vec3 sunIlluminance;
 };
 
-// GPU representation of VkDrawIndexedIndirectCommand
+// GPU representation of VkDrawIndirectCommand
 struct Command {
-	uint indexCount;
+	uint vertexCount;
 	uint instanceCount;
-	uint firstIndex;
-	uint vertexOffset;
+	uint firstVertex;
 	uint firstInstance;
 };
 
@@ -40,11 +39,44 @@ struct Meshlet {
 	
 	vec3 boundingSphereCenter;
 	float boundingSphereRadius;
+	
+	vec3 coneApex;
+	float coneCutoff;
+	vec3 coneAxis;
+	float pad0;
+};
+
+// Node of a model's bounding sphere hierarchy over its meshlets
+struct MeshletGroup {
+	vec3 boundingSphereCenter;
+	float boundingSphereRadius;
+	
+	uint childOffset;
+	uint childCount; // 0 for leaf groups
+	uint meshletOffset;
+	uint meshletCount;
+};
+
+// Level of detail of a model, with its own meshlet range and group hierarchy
+struct ModelLod {
+	uint groupOffset; // Root of the LOD's hierarchy
+	uint meshletOffset;
+	uint meshletCount;
+	float error; // Geometric deviation from the most detailed LOD, in model space
 };
 
 struct Model {
 	uint meshletOffset;
 	uint meshletCount;
+	uint groupOffset;
+	uint groupCount;
+	uint lodOffset; // Ordered from the most detailed
+	uint lodCount;
+};
+
+struct ObjectInstance {
+	uint objectIdx;
+	uint modelIdx;
 };
 
 struct Instance {
@@ -52,6 +84,11 @@ struct Instance {
 	uint meshletIdx;
 };
 
+struct GroupInstance {
+	uint objectIdx;
+	uint groupIdx;
+};
+
 // Components of an instance transform
 struct BasicTransform {
 	vec3 position;
@@ -1,10 +1,12 @@
 #version 460
 #pragma shader_stage(fragment)
 
+layout(location = 0) flat in uint f_triangleIdx;
+
 layout(location = 0) out uint out_visibility;
 
 void main() {
 	
-	out_visibility = gl_PrimitiveID;
+	out_visibility = f_triangleIdx;
 	
 }
@@ -24,15 +24,25 @@ layout(binding = 4, std430) restrict readonly buffer Instances {
 layout(binding = 5, std430) restrict readonly buffer Transforms {
 	mat3x4 b_transforms[];
 };
+layout(binding = 6, std430) restrict readonly buffer Triangles {
+	uvec2 b_triangles[];
+};
+
+layout(location = 0) flat out uint f_triangleIdx;
 
 #include "../typesAccess.glsl"
 
 void main() {
 	
-	Instance instance = b_instances[gl_VertexIndex >> INSTANCE_ID_BITS];
+	// Drawn without an index buffer, three vertices per triangle. The late
+	// phase's firstVertex keeps triangle indices global across both draws
+	
+	uint triangleIdx = gl_VertexIndex / 3;
+	uvec2 triangle = b_triangles[triangleIdx];
+	Instance instance = b_instances[triangle.x];
 	Meshlet meshlet = b_meshlets[instance.meshletIdx];
 	
-	uint triIdx = (gl_VertexIndex & bitmask(6)) + meshlet.vertexOffset;
+	uint triIdx = unpackTriangle(triangle.y)[gl_VertexIndex % 3] + meshlet.vertexOffset;
 	
 	uint index = b_vertIndices[triIdx];
 	vec3 vertex = fetchVertex(index);
@@ -40,5 +50,6 @@ void main() {
 	uint transformIdx = instance.objectIdx;
 	mat4 transform = getTransform(b_transforms[transformIdx]);
 	gl_Position = u_world.viewProjection * transform * vec4(vertex, 1.0);
+	f_triangleIdx = triangleIdx;
 	
 }
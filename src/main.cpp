@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <io.h>
 #endif //_WIN32
+#include "base/threadPool.hpp"
 #include "base/math.hpp"
 #include "base/log.hpp"
 #include "sys/window.hpp"
@@ -101,9 +102,10 @@ auto main(int, char*[]) -> int try {
 	auto system = sys::System();
 	auto window = sys::Window(system, AppTitle, false, {960, 504});
 	auto vulkan = sys::Vulkan(window);
+	auto threadPool = ThreadPool();
 	
 	// Create graphics engine
-	auto engine = gfx::Engine(vulkan);
+	auto engine = gfx::Engine(vulkan, threadPool);
 	
 	// Initialize helpers
 	auto mapper = Mapper();
@@ -1,8 +1,14 @@
+#include <type_traits>
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <cstdio>
+#include <ranges>
+#include <limits>
 #include <cmath>
+#include <deque>
+#include <span>
 #include "meshoptimizer.h"
-#include "mpack/mpack.h"
 #define CGLTF_IMPLEMENTATION
 #include "cgltf.h"
 #include "base/containers/vector.hpp"
@@ -26,6 +32,12 @@ using GltfIndexType = u32;
 using GltfVertexType = vec3;
 using GltfNormalType = vec3;
 
+// Error allowed for a single simplification step, relative to mesh extents
+constexpr auto LodTargetError = 0.02f;
+
+// Stop generating LODs once a step removes less than this fraction of indices
+constexpr auto LodMinReduction = 0.85f;
+
 struct GltfMesh {
 	mat4 transform;
 	u32 materialIdx;
@@ -35,13 +47,7 @@ struct GltfMesh {
 	pvector<GltfNormalType> normals;
 };
 
-struct Material {
-	vec4 color;
-	vec3 emissive;
-	f32 metalness;
-	f32 roughness;
-};
-
+// Meshlet with its AABB, kept together while meshlets are reordered
 struct Meshlet {
 	u32 materialIdx;
 	
@@ -52,6 +58,12 @@ struct Meshlet {
 	vec3 boundingSphereCenter;
 	f32 boundingSphereRadius;
 	
+	// Normal cone; the meshlet is backfacing from any point where
+	// dot(normalize(coneApex - point), coneAxis) >= coneCutoff
+	vec3 coneApex;
+	vec3 coneAxis;
+	f32 coneCutoff;
+	
 	struct AABB {
 		vec3 min;
 		vec3 max;
@@ -59,8 +71,10 @@ struct Meshlet {
 };
 
 struct Model {
-	pvector<Material> materials;
+	pvector<ModelMaterial> materials;
 	pvector<Meshlet> meshlets;
+	pvector<ModelMeshletGroup> groups;
+	pvector<ModelLod> lods;
 	pvector<TriIndexType> triIndices;
 	pvector<VertIndexType> vertIndices;
 	pvector<VertexType> vertices;
@@ -70,7 +84,7 @@ struct Model {
 int main(int argc, char const* argv[]) try {
 	if (argc != 3)
 		throw runtime_error_fmt("Invalid number of arguments: found {}, expected 2", argc - 1);
-
+	
 	auto model = Model();
 	
 	// Load and parse input gltf
@@ -92,7 +106,7 @@ int main(int argc, char const* argv[]) try {
 		
 		auto& material = gltf->materials[i];
 		auto& pbr = material.pbr_metallic_roughness;
-		model.materials.emplace_back(Material{
+		model.materials.emplace_back(ModelMaterial{
 			.color = vec4{
 				pbr.base_color_factor[0],
 				pbr.base_color_factor[1],
@@ -325,16 +339,17 @@ int main(int argc, char const* argv[]) try {
 		
 	}
 	
-	// Convert meshes into meshlet representation
+	// Pre-transform vertex data and append it to the model. All LODs of a mesh
+	// share its vertices
 	
+	auto vertexOffsets = pvector<u32>();
+	vertexOffsets.reserve(meshes.size());
 	for (auto& mesh: meshes) {
 		
 		// Pre-transform vertices
 		
-		auto vertices = pvector<VertexType>();
-		vertices.reserve(mesh.vertices.size());
-		for (auto v: mesh.vertices)
-			vertices.push_back(vec3(mesh.transform * vec4(v, 1.0f)));
+		for (auto& v: mesh.vertices)
+			v = vec3(mesh.transform * vec4(v, 1.0f));
 		
 		// Pre-transform normals
 		
@@ -351,18 +366,30 @@ int main(int argc, char const* argv[]) try {
 		for (auto n: normals)
 			octNormals.push_back(octEncode(n));
 		
-		// Generate the meshlets
+		vertexOffsets.push_back(model.vertices.size());
+		model.vertices.insert(model.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+		model.normals.insert(model.normals.end(), octNormals.begin(), octNormals.end());
+		
+	}
+	
+	// Convert a mesh's triangles into meshlets, and append them to the model
+	
+	auto appendMeshlets = [&model](GltfMesh const& _mesh, pvector<GltfIndexType> const& _indices, u32 _vertexOffset) {
+		
+		if (_indices.empty())
+			return;
+		auto& vertices = _mesh.vertices;
 		
 		// meshoptimizer assumptions
 		static_assert(sizeof(TriIndexType) == sizeof(unsigned char));
 		static_assert(sizeof(VertIndexType) == sizeof(unsigned int));
 		
-		auto maxMeshletCount = meshopt_buildMeshletsBound(mesh.indices.size(), MeshletMaxVerts, MeshletMaxTris);
+		auto maxMeshletCount = meshopt_buildMeshletsBound(_indices.size(), MeshletMaxVerts, MeshletMaxTris);
 		auto rawMeshlets = pvector<meshopt_Meshlet>(maxMeshletCount);
 		auto meshletVertices = pvector<unsigned int>(maxMeshletCount * MeshletMaxVerts);
 		auto meshletTriangles = pvector<unsigned char>(maxMeshletCount * MeshletMaxTris * 3);
 		auto meshletCount = meshopt_buildMeshlets(rawMeshlets.data(), meshletVertices.data(), meshletTriangles.data(),
-			mesh.indices.data(), mesh.indices.size(), &vertices[0].x(), vertices.size(), sizeof(VertexType),
+			_indices.data(), _indices.size(), &vertices[0].x(), vertices.size(), sizeof(VertexType),
 			MeshletMaxVerts, MeshletMaxTris, 0.0f);
 		rawMeshlets.resize(meshletCount);
 		
@@ -420,7 +447,7 @@ int main(int argc, char const* argv[]) try {
 		// Offset the vertex indices
 		
 		for (auto& idx: meshletVertices)
-			idx += model.vertices.size();
+			idx += _vertexOffset;
 		
 		// Write meshlet descriptor
 		
@@ -431,7 +458,7 @@ int main(int argc, char const* argv[]) try {
 			auto& bound = bounds[mIdx];
 			auto& meshlet = model.meshlets.emplace_back();
 			
-			meshlet.materialIdx = mesh.materialIdx;
+			meshlet.materialIdx = _mesh.materialIdx;
 			
 			meshlet.indexOffset = rawMeshlet.triangle_offset + model.triIndices.size();
 			meshlet.indexCount = (rawMeshlet.triangle_count * 3 + 3) & ~3;
@@ -440,6 +467,10 @@ int main(int argc, char const* argv[]) try {
 			meshlet.boundingSphereCenter = vec3{bound.center[0], bound.center[1], bound.center[2]};
 			meshlet.boundingSphereRadius = bound.radius;
 			
+			meshlet.coneApex = vec3{bound.cone_apex[0], bound.cone_apex[1], bound.cone_apex[2]};
+			meshlet.coneAxis = vec3{bound.cone_axis[0], bound.cone_axis[1], bound.cone_axis[2]};
+			meshlet.coneCutoff = bound.cone_cutoff;
+			
 			meshlet.aabb = aabbs[mIdx];
 			
 		}
@@ -448,108 +479,268 @@ int main(int argc, char const* argv[]) try {
 		
 		model.triIndices.insert(model.triIndices.end(), meshletTriangles.begin(), meshletTriangles.end());
 		model.vertIndices.insert(model.vertIndices.end(), meshletVertices.begin(), meshletVertices.end());
-		model.vertices.insert(model.vertices.end(), vertices.begin(), vertices.end());
-		model.normals.insert(model.normals.end(), octNormals.begin(), octNormals.end());
 		
-	}
+	};
 	
-	// Serialize model to msgpack
-
-	auto const* outputPath = argv[2];
-	auto out = mpack_writer_t();
-	mpack_writer_init_filename(&out, outputPath);
-	if (out.error != mpack_ok)
-		throw runtime_error_fmt(R"(Failed to open output file "{}" for writing: error code {})", outputPath, out.error);
-	
-	mpack_write_u32(&out, ModelMagic);
-	mpack_start_map(&out, 6);
-		
-		mpack_write_cstr(&out, "materials");
-		mpack_start_array(&out, model.materials.size());
-		for (auto& material: model.materials) {
-			
-			mpack_start_map(&out, 4);
-				mpack_write_cstr(&out, "color");
-				mpack_start_array(&out, 4);
-					mpack_write_float(&out, material.color.r());
-					mpack_write_float(&out, material.color.g());
-					mpack_write_float(&out, material.color.b());
-					mpack_write_float(&out, material.color.a());
-				mpack_finish_array(&out);
-				mpack_write_cstr(&out, "emissive");
-				mpack_start_array(&out, 3);
-					mpack_write_float(&out, material.emissive.r());
-					mpack_write_float(&out, material.emissive.g());
-					mpack_write_float(&out, material.emissive.b());
-				mpack_finish_array(&out);
-				mpack_write_cstr(&out, "metalness");
-				mpack_write_float(&out, material.metalness);
-				mpack_write_cstr(&out, "roughness");
-				mpack_write_float(&out, material.roughness);
-			mpack_finish_map(&out);
+	// Group a range of meshlets into a hierarchy, breadth-first. Meshlets are
+	// reordered so that each group's meshlets are contiguous. Returns the index
+	// of the root group
+	
+	auto buildHierarchy = [&model](u32 _meshletBegin, u32 _meshletEnd) -> u32 {
+		
+		struct Range {
+			u32 begin;
+			u32 end;
+		};
+		
+		// Split a range of meshlets in half, along the longest axis of their centers
+		auto split = [&model](Range _range) -> std::pair<Range, Range> {
+			
+			auto first = model.meshlets.begin() + _range.begin;
+			auto last = model.meshlets.begin() + _range.end;
+			auto centerMin = first->boundingSphereCenter;
+			auto centerMax = first->boundingSphereCenter;
+			for (auto it = first; it != last; ++it) {
+				
+				centerMin = min(centerMin, it->boundingSphereCenter);
+				centerMax = max(centerMax, it->boundingSphereCenter);
+				
+			}
+			
+			auto extent = centerMax - centerMin;
+			auto axis = 0_zu;
+			if (extent[1] > extent[axis]) axis = 1;
+			if (extent[2] > extent[axis]) axis = 2;
+			
+			auto mid = _range.begin + (_range.end - _range.begin) / 2;
+			std::nth_element(first, model.meshlets.begin() + mid, last, [axis](auto const& _l, auto const& _r) {
+				return _l.boundingSphereCenter[axis] < _r.boundingSphereCenter[axis];
+			});
+			return {Range{_range.begin, mid}, Range{mid, _range.end}};
+			
+		};
+		
+		auto root = u32(model.groups.size());
+		model.groups.emplace_back(ModelMeshletGroup{
+			.meshletOffset = _meshletBegin,
+			.meshletCount = _meshletEnd - _meshletBegin });
+		auto queue = std::deque<u32>{root};
+		while (!queue.empty()) {
+			
+			auto groupIdx = queue.front();
+			queue.pop_front();
+			auto range = Range{
+				model.groups[groupIdx].meshletOffset,
+				model.groups[groupIdx].meshletOffset + model.groups[groupIdx].meshletCount };
+			if (range.end - range.begin <= MeshletGroupMaxMeshlets)
+				continue;
+			
+			// Keep halving the largest child until there are enough of them
+			
+			auto children = ivector<Range>{range};
+			while (children.size() < MeshletGroupMaxChildren) {
+				
+				auto largest = std::max_element(children.begin(), children.end(), [](auto _l, auto _r) {
+					return (_l.end - _l.begin) < (_r.end - _r.begin);
+				});
+				if (largest->end - largest->begin <= MeshletGroupMaxMeshlets)
+					break;
+				auto [left, right] = split(*largest);
+				*largest = left;
+				children.push_back(right);
+				
+			}
+			std::sort(children.begin(), children.end(), [](auto _l, auto _r) {
+				return _l.begin < _r.begin;
+			});
+			
+			model.groups[groupIdx].childOffset = model.groups.size();
+			model.groups[groupIdx].childCount = children.size();
+			for (auto child: children) {
+				
+				queue.push_back(model.groups.size());
+				model.groups.emplace_back(ModelMeshletGroup{
+					.meshletOffset = child.begin,
+					.meshletCount = child.end - child.begin });
+				
+			}
 			
 		}
-		mpack_finish_array(&out);
 		
-		mpack_write_cstr(&out, "meshlets");
-		mpack_start_array(&out, model.meshlets.size());
-		for (auto& meshlet: model.meshlets) {
+		// Compute bounding spheres bottom-up. The sphere encloses the spheres
+		// of the group's children or meshlets
+		
+		for (auto& group: std::span(&model.groups[root], model.groups.size() - root) | std::views::reverse) {
 			
-			mpack_start_map(&out, 8);
+			auto enclose = [&group](auto const& _spheres) {
+				
+				auto boundsMin = vec3(std::numeric_limits<f32>::max());
+				auto boundsMax = vec3(std::numeric_limits<f32>::lowest());
+				for (auto& s: _spheres) {
+					
+					boundsMin = min(boundsMin, s.boundingSphereCenter - vec3(s.boundingSphereRadius));
+					boundsMax = max(boundsMax, s.boundingSphereCenter + vec3(s.boundingSphereRadius));
+					
+				}
 				
-				mpack_write_cstr(&out, "materialIdx");
-				mpack_write_u32(&out, meshlet.materialIdx);
-				mpack_write_cstr(&out, "indexOffset");
-				mpack_write_u32(&out, meshlet.indexOffset);
-				mpack_write_cstr(&out, "indexCount");
-				mpack_write_u32(&out, meshlet.indexCount);
-				mpack_write_cstr(&out, "vertexOffset");
-				mpack_write_u32(&out, meshlet.vertexOffset);
-				mpack_write_cstr(&out, "boundingSphereCenter");
-				mpack_start_array(&out, 3);
-					mpack_write_float(&out, meshlet.boundingSphereCenter.x());
-					mpack_write_float(&out, meshlet.boundingSphereCenter.y());
-					mpack_write_float(&out, meshlet.boundingSphereCenter.z());
-				mpack_finish_array(&out);
-				mpack_write_cstr(&out, "boundingSphereRadius");
-				mpack_write_float(&out, meshlet.boundingSphereRadius);
-				mpack_write_cstr(&out, "aabbMin");
-				mpack_start_array(&out, 3);
-					mpack_write_float(&out, meshlet.aabb.min.x());
-					mpack_write_float(&out, meshlet.aabb.min.y());
-					mpack_write_float(&out, meshlet.aabb.min.z());
-				mpack_finish_array(&out);
-				mpack_write_cstr(&out, "aabbMax");
-				mpack_start_array(&out, 3);
-					mpack_write_float(&out, meshlet.aabb.max.x());
-					mpack_write_float(&out, meshlet.aabb.max.y());
-					mpack_write_float(&out, meshlet.aabb.max.z());
-				mpack_finish_array(&out);
-			mpack_finish_map(&out);
+				group.boundingSphereCenter = (boundsMin + boundsMax) * 0.5f;
+				group.boundingSphereRadius = 0.0f;
+				for (auto& s: _spheres) {
+					
+					group.boundingSphereRadius = std::max(group.boundingSphereRadius,
+						length(s.boundingSphereCenter - group.boundingSphereCenter) + s.boundingSphereRadius);
+					
+				}
+				
+			};
+			
+			if (group.childCount)
+				enclose(std::span(&model.groups[group.childOffset], group.childCount));
+			else
+				enclose(std::span(&model.meshlets[group.meshletOffset], group.meshletCount));
 			
 		}
-		mpack_finish_array(&out);
 		
-		mpack_write_cstr(&out, "triIndices");
-		mpack_write_bin(&out, reinterpret_cast<const char*>(model.triIndices.data()),
-			model.triIndices.size() * sizeof(TriIndexType));
+		return root;
 		
-		mpack_write_cstr(&out, "vertIndices");
-		mpack_write_bin(&out, reinterpret_cast<const char*>(model.vertIndices.data()),
-			model.vertIndices.size() * sizeof(VertIndexType));
+	};
+	
+	// Build the LOD chain. Each level simplifies the previous one to about half
+	// the triangles, and gets its own meshlets and group hierarchy. The error
+	// of a level accumulates the error of every simplification step before it
+	
+	auto lodIndices = ivector<pvector<GltfIndexType>>();
+	lodIndices.reserve(meshes.size());
+	for (auto& mesh: meshes)
+		lodIndices.emplace_back(mesh.indices);
+	auto lodError = 0.0f;
+	
+	for (auto lodIdx: iota(0u, ModelMaxLods)) {
 		
-		mpack_write_cstr(&out, "vertices");
-		mpack_write_bin(&out, reinterpret_cast<const char*>(model.vertices.data()),
-			model.vertices.size() * sizeof(VertexType));
+		if (lodIdx > 0) {
+			
+			auto simplified = ivector<pvector<GltfIndexType>>();
+			simplified.reserve(meshes.size());
+			auto prevIndexCount = 0_zu;
+			auto indexCount = 0_zu;
+			auto stepError = 0.0f;
+			for (auto meshIdx: iota(0_zu, meshes.size())) {
+				
+				auto& mesh = meshes[meshIdx];
+				auto& indices = lodIndices[meshIdx];
+				auto& result = simplified.emplace_back(indices.size());
+				prevIndexCount += indices.size();
+				if (indices.empty())
+					continue;
+				
+				auto error = 0.0f;
+				result.resize(meshopt_simplify(result.data(), indices.data(), indices.size(),
+					&mesh.vertices[0].x(), mesh.vertices.size(), sizeof(GltfVertexType),
+					indices.size() / 6 * 3, LodTargetError, &error));
+				indexCount += result.size();
+				
+				// meshoptimizer reports the error relative to the mesh's extents
+				auto scale = meshopt_simplifyScale(&mesh.vertices[0].x(), mesh.vertices.size(), sizeof(GltfVertexType));
+				stepError = std::max(stepError, error * scale);
+				
+			}
+			
+			// Stop once simplification doesn't pay for the extra meshlets
+			if (indexCount == 0 || f32(indexCount) > f32(prevIndexCount) * LodMinReduction)
+				break;
+			
+			lodIndices = std::move(simplified);
+			lodError += stepError;
+			
+		}
+		
+		auto meshletBegin = u32(model.meshlets.size());
+		for (auto meshIdx: iota(0_zu, meshes.size()))
+			appendMeshlets(meshes[meshIdx], lodIndices[meshIdx], vertexOffsets[meshIdx]);
+		auto meshletEnd = u32(model.meshlets.size());
+		if (meshletBegin == meshletEnd)
+			break;
+		
+		model.lods.emplace_back(ModelLod{
+			.groupOffset = buildHierarchy(meshletBegin, meshletEnd),
+			.meshletOffset = meshletBegin,
+			.meshletCount = meshletEnd - meshletBegin,
+			.error = lodError });
+		
+		// Nothing to gain below a single meshlet
+		if (meshletEnd - meshletBegin <= 1)
+			break;
 		
-		mpack_write_cstr(&out, "normals");
-		mpack_write_bin(&out, reinterpret_cast<const char*>(model.normals.data()),
-			model.normals.size() * sizeof(NormalType));
+	}
+	
+	// Lay out the model file. Sections follow the header in a fixed order,
+	// each at an aligned offset
+	
+	auto file = pvector<char>(sizeof(ModelHeader));
+	auto writeSection = [&file](ModelSection& _section, auto const& _elements) {
+		
+		using T = std::remove_cvref_t<decltype(_elements[0])>;
+		auto offset = alignPOT(file.size(), ModelSectionAlign);
+		auto size = _elements.size() * sizeof(T);
+		if (offset + size > std::numeric_limits<u32>::max())
+			throw runtime_error_fmt("Model is too large: {} bytes", offset + size);
+		
+		auto padding = offset - file.size();
+		file.resize(offset + size);
+		std::memset(file.data() + offset - padding, 0, padding);
+		if (size)
+			std::memcpy(file.data() + offset, _elements.data(), size);
+		_section = ModelSection{
+			.offset = u32(offset),
+			.count = u32(_elements.size()) };
+		
+	};
+	
+	auto meshlets = pvector<ModelMeshlet>();
+	auto meshletAABBs = pvector<ModelAABB>();
+	meshlets.reserve(model.meshlets.size());
+	meshletAABBs.reserve(model.meshlets.size());
+	for (auto& meshlet: model.meshlets) {
+		
+		meshlets.emplace_back(ModelMeshlet{
+			.materialIdx = meshlet.materialIdx,
+			.indexOffset = meshlet.indexOffset,
+			.indexCount = meshlet.indexCount,
+			.vertexOffset = meshlet.vertexOffset,
+			.boundingSphereCenter = meshlet.boundingSphereCenter,
+			.boundingSphereRadius = meshlet.boundingSphereRadius,
+			.coneApex = meshlet.coneApex,
+			.coneCutoff = meshlet.coneCutoff,
+			.coneAxis = meshlet.coneAxis });
+		meshletAABBs.emplace_back(ModelAABB{
+			.min = meshlet.aabb.min,
+			.max = meshlet.aabb.max });
 		
-	mpack_finish_map(&out);
+	}
+	
+	auto header = ModelHeader{
+		.magic = ModelMagic,
+		.version = ModelVersion };
+	writeSection(header.materials, model.materials);
+	writeSection(header.meshlets, meshlets);
+	writeSection(header.meshletAABBs, meshletAABBs);
+	writeSection(header.groups, model.groups);
+	writeSection(header.lods, model.lods);
+	writeSection(header.triIndices, model.triIndices);
+	writeSection(header.vertIndices, model.vertIndices);
+	writeSection(header.vertices, model.vertices);
+	writeSection(header.normals, model.normals);
+	std::memcpy(file.data(), &header, sizeof(header));
 	
-	if (auto error = mpack_writer_destroy(&out); error != mpack_ok)
-		throw runtime_error_fmt(R"(Failed to write output file "{}": error code {})", outputPath, error);
+	// Write the model file
+	
+	auto const* outputPath = argv[2];
+	auto* output = std::fopen(outputPath, "wb");
+	if (!output)
+		throw runtime_error_fmt(R"(Failed to open output file "{}" for writing)", outputPath);
+	defer { std::fclose(output); };
+	if (std::fwrite(file.data(), 1, file.size(), output) != file.size())
+		throw runtime_error_fmt(R"(Failed to write output file "{}")", outputPath);
 	
 	return 0;
 	
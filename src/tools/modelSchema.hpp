@@ -1,5 +1,6 @@
 #pragma once
 
+#include <type_traits>
 #include "base/math.hpp"
 
 namespace minote::tools {
@@ -11,9 +12,102 @@ using VertIndexType = u32;
 using VertexType = vec3;
 using NormalType = u32;
 
-constexpr auto ModelMagic = 0x10EF02FDu;
+constexpr auto ModelMagic = 0x10EF0400u;
+constexpr auto ModelVersion = 1u;
 constexpr auto NormalOctBits = 16u;
 constexpr auto MeshletMaxVerts = 64u;
 constexpr auto MeshletMaxTris = 128u;
+constexpr auto MeshletGroupMaxChildren = 8u;
+constexpr auto MeshletGroupMaxMeshlets = 8u; // Leaf groups only
+constexpr auto ModelMaxLods = 8u;
+
+// Visible triangles store meshlet-local vertex indices in 8 bits each
+static_assert(MeshletMaxVerts <= 256u);
+
+// A model file is a ModelHeader, followed by sections. Each section is
+// a tightly packed array of one of the types below, starting at an offset
+// aligned to ModelSectionAlign. All values are little-endian, and all
+// offsets and indices are relative to the model itself.
+
+constexpr auto ModelSectionAlign = 16u;
+
+struct ModelSection {
+	u32 offset; // In bytes, from the start of the file
+	u32 count; // In elements
+};
+
+struct ModelHeader {
+	u32 magic; // ModelMagic
+	u32 version; // ModelVersion
+	ModelSection materials; // ModelMaterial
+	ModelSection meshlets; // ModelMeshlet
+	ModelSection meshletAABBs; // ModelAABB, one per meshlet
+	ModelSection groups; // ModelMeshletGroup
+	ModelSection lods; // ModelLod
+	ModelSection triIndices; // TriIndexType, 3 per triangle, padded to 4 per meshlet
+	ModelSection vertIndices; // VertIndexType
+	ModelSection vertices; // VertexType
+	ModelSection normals; // NormalType, one per vertex
+};
+
+struct ModelMaterial {
+	vec4 color;
+	vec3 emissive;
+	f32 metalness;
+	f32 roughness;
+};
+
+struct ModelMeshlet {
+	u32 materialIdx;
+	
+	u32 indexOffset; // Into triIndices
+	u32 indexCount;
+	u32 vertexOffset; // Into vertIndices
+	
+	vec3 boundingSphereCenter;
+	f32 boundingSphereRadius;
+	
+	// Normal cone; the meshlet is backfacing from any point where
+	// dot(normalize(coneApex - point), coneAxis) >= coneCutoff
+	vec3 coneApex;
+	f32 coneCutoff;
+	vec3 coneAxis;
+};
+
+struct ModelAABB {
+	vec3 min;
+	vec3 max;
+};
+
+// Node of a LOD's bounding sphere hierarchy. Children of a group are
+// contiguous, and always come after it. Every group covers a contiguous range
+// of meshlets; leaf groups have no children.
+struct ModelMeshletGroup {
+	vec3 boundingSphereCenter;
+	f32 boundingSphereRadius;
+	
+	u32 childOffset;
+	u32 childCount;
+	u32 meshletOffset;
+	u32 meshletCount;
+};
+
+// Level of detail. Each LOD has its own meshlets and group hierarchy
+struct ModelLod {
+	u32 groupOffset; // Root of the hierarchy
+	u32 meshletOffset;
+	u32 meshletCount;
+	f32 error; // Geometric deviation from the most detailed LOD, in model space
+};
+
+// Sections are read and written as raw bytes
+static_assert(std::is_trivially_copyable_v<ModelHeader>);
+static_assert(std::is_trivially_copyable_v<ModelMaterial>);
+static_assert(std::is_trivially_copyable_v<ModelMeshlet>);
+static_assert(std::is_trivially_copyable_v<ModelAABB>);
+static_assert(std::is_trivially_copyable_v<ModelMeshletGroup>);
+static_assert(std::is_trivially_copyable_v<ModelLod>);
+static_assert(sizeof(ModelMeshlet) == 60);
+static_assert(sizeof(ModelMeshletGroup) == 32);
 
 }
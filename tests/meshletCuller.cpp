@@ -0,0 +1,231 @@
+// Runs MeshletCuller over a handcrafted model, and checks the exact instances
+// and triangles it outputs, with and without a HiZ.
+
+#include <exception>
+#include <algorithm>
+#include <cmath>
+#include "base/containers/bitvector.hpp"
+#include "base/containers/vector.hpp"
+#include "base/containers/array.hpp"
+#include "base/threadPool.hpp"
+#include "base/format.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "base/id.hpp"
+#include "gfx/meshletCuller.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/models.hpp"
+
+using namespace minote;
+using namespace base;
+using namespace base::literals;
+using namespace gfx;
+
+using Instance = MeshletCuller::Instance;
+
+constexpr auto Viewport = uvec2{256u, 128u};
+
+// Depth of the synthetic occluder, as reverse-Z at a distance of 20 units.
+// It covers the top half of the screen, and the rest is at infinity
+constexpr auto OccluderDepth = 0.01f;
+
+// Triangles of meshlet 0, as packed by the culler: i0 | i1 << 8 | i2 << 16
+constexpr auto Front0 = 0x020100u; // 0, 1, 2
+constexpr auto Front1 = 0x030200u; // 0, 2, 3
+
+// A unit quad in the YZ plane, facing -X. Meshlet 0 holds its two triangles
+// and the first one again with reversed winding, which is backfacing. Meshlet 1
+// holds a triangle of the same quad, with a normal cone that faces +X, so it's
+// rejected before its triangles are looked at. The root group has a leaf child
+// for each meshlet.
+auto makeModels() -> ModelBuffer {
+	
+	auto models = ModelBuffer();
+	
+	models.cpu_vertices = pvector<vec3>{
+		{0.0f, -1.0f, -1.0f},
+		{0.0f, -1.0f,  1.0f},
+		{0.0f,  1.0f,  1.0f},
+		{0.0f,  1.0f, -1.0f}};
+	models.cpu_vertIndices = {0u, 1u, 2u, 3u};
+	models.cpu_triIndices = {
+		0u, 1u, 2u,
+		0u, 2u, 3u,
+		0u, 2u, 1u,
+		0u, 1u, 2u};
+	
+	auto radius = std::sqrt(2.0f);
+	models.cpu_meshlets.push_back(Meshlet{
+		.indexOffset = 0,
+		.indexCount = 9,
+		.vertexOffset = 0,
+		.boundingSphereCenter = vec3(0.0f),
+		.boundingSphereRadius = radius,
+		.coneApex = vec3(0.0f),
+		.coneCutoff = 0.5f,
+		.coneAxis = vec3{-1.0f, 0.0f, 0.0f} });
+	models.cpu_meshlets.push_back(Meshlet{
+		.indexOffset = 9,
+		.indexCount = 3,
+		.vertexOffset = 0,
+		.boundingSphereCenter = vec3(0.0f),
+		.boundingSphereRadius = radius,
+		.coneApex = vec3(0.0f),
+		.coneCutoff = 0.5f,
+		.coneAxis = vec3{1.0f, 0.0f, 0.0f} });
+	
+	models.cpu_groups.push_back(MeshletGroup{
+		.boundingSphereCenter = vec3(0.0f),
+		.boundingSphereRadius = radius,
+		.childOffset = 1,
+		.childCount = 2,
+		.meshletOffset = 0,
+		.meshletCount = 2 });
+	for (auto i: iota(0u, 2u)) {
+		
+		models.cpu_groups.push_back(MeshletGroup{
+			.boundingSphereCenter = vec3(0.0f),
+			.boundingSphereRadius = radius,
+			.childOffset = 0,
+			.childCount = 0,
+			.meshletOffset = i,
+			.meshletCount = 1 });
+		
+	}
+	models.cpu_groupDepth = 2;
+	
+	models.cpu_lods.push_back(ModelLod{
+		.groupOffset = 0,
+		.meshletOffset = 0,
+		.meshletCount = 2,
+		.error = 0.0f });
+	models.cpu_models.push_back(Model{
+		.meshletOffset = 0,
+		.meshletCount = 2,
+		.groupOffset = 0,
+		.groupCount = 3,
+		.lodOffset = 0,
+		.lodCount = 1 });
+	models.cpu_modelIndices.emplace(ID("quad"), 0u);
+	
+	return models;
+	
+}
+
+int main() try {
+	
+	auto models = makeModels();
+	auto threadPool = ThreadPool();
+	auto culler = MeshletCuller();
+	
+	// Camera at the origin, looking down +X, with +Z up on screen like Camera
+	auto view = look(vec3{0.0f, 0.0f, 0.0f}, vec3{1.0f, 0.0f, 0.0f}, vec3{0.0f, 0.0f, -1.0f});
+	auto projection = perspective(50_deg, f32(Viewport.x()) / f32(Viewport.y()), 0.1f);
+	
+	// Object positions are also their indices, since they share a model
+	// and none are destroyed
+	
+	auto objects = ObjectPool();
+	auto positions = to_array<vec3>({
+		{ 5.0f,  0.0f, 0.0f}, // In view
+		{-5.0f,  0.0f, 0.0f}, // Behind the camera
+		{ 5.0f,  3.0f, 0.0f}, // Hidden
+		{50.0f,  0.0f, 8.0f}, // Behind the occluder
+		{ 5.0f, -3.0f, 0.0f}, // In view, off-center
+		{50.0f,  0.0f, -8.0f}}); // Far, below the occluder
+	for (auto position: positions) {
+		
+		auto id = objects.create(ID("quad"));
+		objects.get(id).transform.position = position;
+		
+	}
+	objects.get(objects.idAt(2)).visible = false;
+	
+	auto depth = pvector<f32>(Viewport.x() * Viewport.y(), 0.0f);
+	std::fill(depth.begin(), depth.begin() + depth.size() / 2, OccluderDepth);
+	auto hiz = MeshletCuller::HiZ::make(depth, Viewport);
+	
+	auto failures = 0u;
+	auto check = [&](char const* _name, std::span<Instance const> _expectedInstances,
+		std::span<uvec2 const> _expectedTriangles) {
+		
+		auto instances = culler.instances();
+		auto triangles = culler.triangles();
+		auto sameInstance = [](Instance _l, Instance _r) {
+			return _l.objectIdx == _r.objectIdx && _l.meshletIdx == _r.meshletIdx;
+		};
+		auto sameTriangle = [](uvec2 _l, uvec2 _r) {
+			return _l.x() == _r.x() && _l.y() == _r.y();
+		};
+		
+		if (!std::equal(instances.begin(), instances.end(),
+			_expectedInstances.begin(), _expectedInstances.end(), sameInstance)) {
+			
+			failures += 1;
+			fmt::print(stderr, "{}: expected {} instances, got:\n", _name, _expectedInstances.size());
+			for (auto& instance: instances)
+				fmt::print(stderr, "\tobject {}, meshlet {}\n", instance.objectIdx, instance.meshletIdx);
+			
+		}
+		
+		if (!std::equal(triangles.begin(), triangles.end(),
+			_expectedTriangles.begin(), _expectedTriangles.end(), sameTriangle)) {
+			
+			failures += 1;
+			fmt::print(stderr, "{}: expected {} triangles, got:\n", _name, _expectedTriangles.size());
+			for (auto& triangle: triangles)
+				fmt::print(stderr, "\tinstance {}, indices {:#08x}\n", triangle.x(), triangle.y());
+			
+		}
+		
+	};
+	
+	// Without a HiZ, the object behind the occluder is added
+	
+	culler.cull(threadPool, objects, objects.visible, models, view, projection, Viewport);
+	auto unoccludedInstances = to_array<Instance>({
+		{0, 0},
+		{3, 0},
+		{4, 0},
+		{5, 0}});
+	auto unoccludedTriangles = to_array<uvec2>({
+		{0u, Front0}, {0u, Front1},
+		{1u, Front0}, {1u, Front1},
+		{2u, Front0}, {2u, Front1},
+		{3u, Front0}, {3u, Front1}});
+	check("Without HiZ", unoccludedInstances, unoccludedTriangles);
+	
+	culler.cull(threadPool, objects, objects.visible, models, view, projection, Viewport, &hiz);
+	auto occludedInstances = to_array<Instance>({
+		{0, 0},
+		{4, 0},
+		{5, 0}});
+	auto occludedTriangles = to_array<uvec2>({
+		{0u, Front0}, {0u, Front1},
+		{1u, Front0}, {1u, Front1},
+		{2u, Front0}, {2u, Front1}});
+	check("With HiZ", occludedInstances, occludedTriangles);
+	
+	// Outputs of a previous cull must not leak into the next
+	
+	objects.get(objects.idAt(0)).visible = false;
+	objects.get(objects.idAt(3)).visible = false;
+	objects.get(objects.idAt(4)).visible = false;
+	objects.get(objects.idAt(5)).visible = false;
+	culler.cull(threadPool, objects, objects.visible, models, view, projection, Viewport, &hiz);
+	check("Nothing visible", {}, {});
+	
+	if (failures > 0) {
+		
+		fmt::print(stderr, "{} MeshletCuller outputs differed from the expected\n", failures);
+		return 1;
+		
+	}
+	return 0;
+	
+} catch (std::exception const& e) {
+	
+	fmt::print(stderr, "Runtime error: {}\n", e.what());
+	return 1;
+	
+}
@@ -0,0 +1,279 @@
+// Checks every ObjectBVH query against a linear scan over all object bounds,
+// while the pool is edited in random ways between updates.
+
+#include <algorithm>
+#include <optional>
+#include <cstdio>
+#include <limits>
+#include <cmath>
+#include "base/containers/hashmap.hpp"
+#include "base/containers/vector.hpp"
+#include "base/containers/array.hpp"
+#include "base/threadPool.hpp"
+#include "base/format.hpp"
+#include "base/error.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "base/util.hpp"
+#include "base/rng.hpp"
+#include "base/id.hpp"
+#include "gfx/objectBvh.hpp"
+#include "gfx/objects.hpp"
+#include "gfx/models.hpp"
+
+using namespace minote;
+using namespace base;
+using namespace base::literals;
+using namespace gfx;
+
+using ObjectID = ObjectPool::ObjectID;
+
+constexpr auto Frames = 200u;
+constexpr auto QueriesPerFrame = 32u;
+constexpr auto NearestCount = 8u;
+constexpr auto WorldSize = 50.0f;
+
+// Relative error allowed between distances computed by the tree and by the scan
+constexpr auto DistanceTolerance = 1e-5f;
+
+// Squared distance from a point to the nearest point of a box
+auto distanceSq(AABB _aabb, vec3 _point) -> f32 {
+	
+	auto nearest = max(min(_point, _aabb.max), _aabb.min);
+	auto offset = _point - nearest;
+	return dot(offset, offset);
+	
+}
+
+auto overlaps(AABB _left, AABB _right) -> bool {
+	
+	return
+		_left.min.x() <= _right.max.x() && _right.min.x() <= _left.max.x() &&
+		_left.min.y() <= _right.max.y() && _right.min.y() <= _left.max.y() &&
+		_left.min.z() <= _right.max.z() && _right.min.z() <= _left.max.z();
+	
+}
+
+// Distance at which the ray enters the box, or infinity if it misses it
+auto rayEntry(ObjectBVH::Ray const& _ray, AABB _bounds) -> f32 {
+	
+	auto invDir = vec3(1.0f) / _ray.direction;
+	auto t0 = (_bounds.min - _ray.origin) * invDir;
+	auto t1 = (_bounds.max - _ray.origin) * invDir;
+	auto tmin = min(t0, t1);
+	auto tmax = max(t0, t1);
+	auto enter = max(max(tmin.x(), tmin.y()), max(tmin.z(), 0.0f));
+	auto exit = min(min(tmax.x(), tmax.y()), min(tmax.z(), _ray.maxDistance));
+	return enter <= exit? enter : std::numeric_limits<f32>::infinity();
+	
+}
+
+auto sameDistance(f32 _left, f32 _right) -> bool {
+	
+	if (_left == _right) return true; // Also covers infinities
+	return std::abs(_left - _right) <= DistanceTolerance * max(1.0f, std::abs(_right));
+	
+}
+
+// Results are compared as sets, since traversal order is arbitrary
+auto sameObjects(ivector<ObjectID> _left, ivector<ObjectID> _right) -> bool {
+	
+	auto bySlot = [](ObjectID _l, ObjectID _r) { return _l.slot < _r.slot; };
+	std::sort(_left.begin(), _left.end(), bySlot);
+	std::sort(_right.begin(), _right.end(), bySlot);
+	return std::equal(_left.begin(), _left.end(), _right.begin(), _right.end());
+	
+}
+
+int main() try {
+	
+	auto rng = Rng();
+	rng.seed(0);
+	auto randomPoint = [&](f32 _extent) {
+		
+		return vec3{rng.randFloat(), rng.randFloat(), rng.randFloat()} * (_extent * 2.0f) - vec3(_extent);
+		
+	};
+	
+	// Three cube models of different sizes
+	
+	auto models = ModelBuffer();
+	auto modelIDs = to_array({ID("small"), ID("medium"), ID("large")});
+	for (auto i: iota(0u, u32(modelIDs.size()))) {
+		
+		auto extent = 0.5f * f32(i + 1);
+		models.cpu_modelAABBs.push_back(AABB{vec3(-extent), vec3(extent)});
+		models.cpu_modelIndices.emplace(modelIDs[i], i);
+		
+	}
+	
+	auto objects = ObjectPool();
+	auto live = ivector<ObjectID>();
+	auto bvh = ObjectBVH();
+	auto threadPool = ThreadPool();
+	
+	auto mismatches = 0u;
+	auto check = [&](bool _matched, char const* _query, u32 _frame) {
+		
+		if (_matched) return;
+		mismatches += 1;
+		fmt::print(stderr, "{} query mismatch in frame {}\n", _query, _frame);
+		
+	};
+	
+	for (auto frame: iota(0u, Frames)) {
+		
+		// Edit the pool, so that updates cover rebuilds, remaps and refits
+		
+		auto edit = rng.randInt(4);
+		if (edit == 0 || live.size() < 8) {
+			
+			for (auto remaining = 1 + rng.randInt(20); remaining > 0; remaining -= 1) {
+				
+				auto id = objects.create(modelIDs[rng.randInt(u32(modelIDs.size()))]);
+				objects.get(id).transform.position = randomPoint(WorldSize);
+				live.push_back(id);
+				
+			}
+			
+		} else if (edit == 1) {
+			
+			auto destroyed = ivector<ObjectID>();
+			for (auto remaining = min(u32(live.size()) - 1, 1 + rng.randInt(8)); remaining > 0; remaining -= 1) {
+				
+				auto idx = rng.randInt(u32(live.size()));
+				destroyed.push_back(live[idx]);
+				live.erase(live.begin() + idx);
+				
+			}
+			if (rng.randInt(2)) {
+				
+				objects.destroyBatch(destroyed);
+				
+			} else {
+				
+				for (auto id: destroyed)
+					objects.destroy(id);
+				
+			}
+			
+		} else if (edit == 2) {
+			
+			objects.setModel(live[rng.randInt(u32(live.size()))], modelIDs[rng.randInt(u32(modelIDs.size()))]);
+			
+		} else {
+			
+			for (auto remaining = 8u; remaining > 0; remaining -= 1)
+				objects.get(live[rng.randInt(u32(live.size()))]).transform.position += randomPoint(2.0f);
+			
+		}
+		
+		bvh.update(objects, models);
+		objects.copyTransforms();
+		
+		auto count = u32(objects.size());
+		auto positions = hashmap<u32, u32>(); // Object position, by slot
+		for (auto idx: iota(0u, count))
+			positions.emplace(objects.idAt(idx).slot, idx);
+		
+		auto rays = pvector<ObjectBVH::Ray>();
+		auto spheres = pvector<ObjectBVH::Sphere>();
+		auto points = pvector<vec3>();
+		auto rayHits = pvector<std::optional<ObjectBVH::RayHit>>();
+		auto sphereHits = ivector<ivector<ObjectID>>();
+		auto nearestHits = ivector<ivector<ObjectID>>();
+		
+		for (auto remaining = QueriesPerFrame; remaining > 0; remaining -= 1) {
+			
+			auto found = ivector<ObjectID>();
+			auto expected = ivector<ObjectID>();
+			
+			auto sphere = ObjectBVH::Sphere{randomPoint(WorldSize), rng.randFloat() * WorldSize * 0.2f};
+			bvh.overlap(sphere, found);
+			for (auto idx: iota(0u, count))
+				if (distanceSq(bvh.objectBounds(idx), sphere.center) <= sphere.radius * sphere.radius)
+					expected.push_back(objects.idAt(idx));
+			check(sameObjects(found, expected), "Sphere overlap", frame);
+			spheres.push_back(sphere);
+			sphereHits.emplace_back(std::move(found));
+			
+			found.clear();
+			expected.clear();
+			auto corner = randomPoint(WorldSize);
+			auto box = AABB{corner, corner + vec3(rng.randFloat() * WorldSize * 0.2f)};
+			bvh.overlap(box, found);
+			for (auto idx: iota(0u, count))
+				if (overlaps(bvh.objectBounds(idx), box))
+					expected.push_back(objects.idAt(idx));
+			check(sameObjects(found, expected), "Box overlap", frame);
+			
+			// Only the distance of the closest hit is compared, since ties
+			// can be broken either way
+			
+			auto origin = randomPoint(WorldSize);
+			auto ray = ObjectBVH::Ray{origin, randomPoint(WorldSize) - origin, 1.0f};
+			auto hit = bvh.raycast(ray);
+			auto closest = std::numeric_limits<f32>::infinity();
+			for (auto idx: iota(0u, count))
+				closest = min(closest, rayEntry(ray, bvh.objectBounds(idx)));
+			check(sameDistance(hit? hit->distance : std::numeric_limits<f32>::infinity(), closest), "Raycast", frame);
+			rays.push_back(ray);
+			rayHits.push_back(hit);
+			
+			// Same for the nearest objects, which are compared by distance
+			
+			auto point = randomPoint(WorldSize);
+			auto nearest = bvh.nearest(point, NearestCount);
+			auto expectedDistances = pvector<f32>();
+			for (auto idx: iota(0u, count))
+				expectedDistances.push_back(distanceSq(bvh.objectBounds(idx), point));
+			std::sort(expectedDistances.begin(), expectedDistances.end());
+			expectedDistances.resize(min(usize(NearestCount), expectedDistances.size()));
+			auto matched = nearest.size() == expectedDistances.size();
+			for (auto i: iota(0_zu, min(nearest.size(), expectedDistances.size()))) {
+				
+				auto distance = distanceSq(bvh.objectBounds(positions.at(nearest[i].slot)), point);
+				matched = matched && sameDistance(distance, expectedDistances[i]);
+				
+			}
+			check(matched, "Nearest", frame);
+			points.push_back(point);
+			nearestHits.emplace_back(std::move(nearest));
+			
+		}
+		
+		// Batched queries must give the same results as single ones
+		
+		auto batchedRayHits = pvector<std::optional<ObjectBVH::RayHit>>(rays.size());
+		bvh.raycast(threadPool, rays, batchedRayHits);
+		for (auto i: iota(0_zu, rays.size()))
+			check(batchedRayHits[i].has_value() == rayHits[i].has_value() &&
+				(!rayHits[i] || batchedRayHits[i]->distance == rayHits[i]->distance), "Batched raycast", frame);
+		
+		auto batchedSphereHits = ivector<ivector<ObjectID>>(spheres.size());
+		bvh.overlap(threadPool, spheres, batchedSphereHits);
+		for (auto i: iota(0_zu, spheres.size()))
+			check(sameObjects(batchedSphereHits[i], sphereHits[i]), "Batched sphere overlap", frame);
+		
+		auto batchedNearestHits = ivector<ivector<ObjectID>>(points.size());
+		bvh.nearest(threadPool, points, NearestCount, batchedNearestHits);
+		for (auto i: iota(0_zu, points.size()))
+			check(std::equal(batchedNearestHits[i].begin(), batchedNearestHits[i].end(),
+				nearestHits[i].begin(), nearestHits[i].end()), "Batched nearest", frame);
+		
+	}
+	
+	if (mismatches > 0) {
+		
+		fmt::print(stderr, "{} ObjectBVH queries disagreed with a linear scan\n", mismatches);
+		return 1;
+		
+	}
+	return 0;
+	
+} catch (std::exception const& e) {
+	
+	fmt::print(stderr, "Runtime error: {}\n", e.what());
+	return 1;
+	
+}
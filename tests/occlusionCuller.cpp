@@ -0,0 +1,91 @@
+// Rasterizes a single quad occluder and checks which boxes OcclusionCuller
+// reports as hidden behind it.
+
+#include <exception>
+#include "base/containers/array.hpp"
+#include "base/format.hpp"
+#include "base/types.hpp"
+#include "base/math.hpp"
+#include "gfx/occlusionCuller.hpp"
+
+using namespace minote;
+using namespace base;
+using namespace base::literals;
+using namespace gfx;
+
+// Quad facing the camera, split into two triangles along its diagonal
+constexpr auto QuadDistance = 10.0f;
+constexpr auto QuadHalfSize = 2.0f;
+
+struct Case {
+	char const* name;
+	AABB bounds;
+	bool occluded;
+};
+
+// Box of the given half-size around a point
+constexpr auto box(vec3 _center, f32 _halfSize) -> AABB {
+	
+	return AABB{_center - vec3(_halfSize), _center + vec3(_halfSize)};
+	
+}
+
+int main() try {
+	
+	auto view = look(vec3{0.0f, 0.0f, 0.0f}, vec3{1.0f, 0.0f, 0.0f}, vec3{0.0f, 0.0f, 1.0f});
+	auto projection = perspective(50_deg,
+		f32(OcclusionCuller::Width) / f32(OcclusionCuller::Height), 0.1f);
+	
+	auto quad = to_array<vec3>({
+		{QuadDistance, -QuadHalfSize, -QuadHalfSize},
+		{QuadDistance,  QuadHalfSize, -QuadHalfSize},
+		{QuadDistance,  QuadHalfSize,  QuadHalfSize},
+		{QuadDistance, -QuadHalfSize, -QuadHalfSize},
+		{QuadDistance,  QuadHalfSize,  QuadHalfSize},
+		{QuadDistance, -QuadHalfSize,  QuadHalfSize}});
+	
+	auto culler = OcclusionCuller();
+	culler.begin(projection * view);
+	culler.drawOccluder(quad, mat4::identity());
+	culler.finish();
+	
+	// At twice the quad's distance, its silhouette is at twice its size
+	
+	auto cases = to_array<Case>({
+		{"Behind the center", box({20.0f, 0.0f, 0.0f}, 0.5f), true},
+		{"Behind a corner", box({20.0f, 3.0f, 3.0f}, 0.5f), true},
+		{"Large, behind", box({40.0f, 0.0f, 0.0f}, 6.0f), true},
+		{"In front", box({5.0f, 0.0f, 0.0f}, 0.5f), false},
+		{"Through the quad", box({QuadDistance, 0.0f, 0.0f}, 0.5f), false},
+		{"Straddling a side", box({20.0f, 4.0f, 0.0f}, 0.5f), false},
+		{"Straddling a corner", box({20.0f, 4.0f, 4.0f}, 0.5f), false},
+		{"A fifth of a pixel past a side", AABB{{19.9f, 3.0f, -0.5f}, {20.1f, 4.01f, 0.5f}}, false},
+		{"Beside", box({20.0f, 6.5f, 0.0f}, 0.5f), false},
+		{"Crossing the near plane", box({0.0f, 0.0f, 0.0f}, 1.0f), false}});
+	
+	auto failures = 0u;
+	for (auto& c: cases) {
+		
+		auto occluded = culler.isOccluded(c.bounds);
+		if (occluded == c.occluded) continue;
+		
+		failures += 1;
+		fmt::print(stderr, "{}: expected {}, got {}\n", c.name,
+			c.occluded? "occluded" : "visible", occluded? "occluded" : "visible");
+		
+	}
+	
+	if (failures > 0) {
+		
+		fmt::print(stderr, "{} of {} occlusion cases failed\n", failures, cases.size());
+		return 1;
+		
+	}
+	return 0;
+	
+} catch (std::exception const& e) {
+	
+	fmt::print(stderr, "Runtime error: {}\n", e.what());
+	return 1;
+	
+}